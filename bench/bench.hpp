@@ -0,0 +1,41 @@
+/*
+ *    bench.hpp:
+ *
+ *    Minimal microbenchmark helpers. Each benchmark is its own executable that
+ *    includes src/tcp_relay.cpp for the classes under test.
+ *
+ */
+
+#pragma once
+
+#define TCP_RELAY_NO_MAIN
+#include "../src/tcp_relay.cpp"
+
+#include <cstdio>
+
+namespace bench {
+
+inline volatile std::uint64_t sink = 0;
+
+// Keeps the compiler from dropping the computation of `value`.
+inline void keep(std::uint64_t value) {
+  sink = sink ^ value;
+}
+
+// Calls `f` `iterations` times after a short warm-up and prints the mean time
+// per call.
+template <typename F>
+double run(const char *name, std::size_t iterations, F &&f) {
+  for (std::size_t i = 0; i < iterations / 10; ++i) {
+    f();
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; ++i) {
+    f();
+  }
+  auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+  std::printf("%-48s %10.1f ns/op\n", name, ns);
+  return ns;
+}
+
+} // namespace bench
@@ -0,0 +1,55 @@
+/*
+ *    hostname_table_bench.cpp:
+ *
+ *    Lookup cost of HostnameTable with 100k SNI routes, half exact names and
+ *    half wildcards, for random and for repeated host names.
+ *
+ */
+
+#include "bench.hpp"
+
+#include <random>
+
+namespace {
+
+constexpr std::size_t kNames = 100000;
+constexpr std::size_t kLookups = 2000000;
+
+std::string name(std::size_t i) {
+  return stdx::format("svc-{}.Tenant{}.example.com", i, i % 997);
+}
+
+} // namespace
+
+int main() {
+  auto group = std::make_shared<TargetGroup>(std::vector<TargetOptions>{{.address = {"127.0.0.1", 443}, .weight = 1}}, LoadBalancePolicy::round_robin);
+  HostnameTable table;
+  for (std::size_t i = 0; i < kNames; ++i) {
+    table.add(i % 2 == 0 ? name(i) : "*." + name(i), group);
+  }
+  // Pre-built keys, so that only the lookup is measured.
+  std::mt19937 rng(1);
+  std::vector<std::string> exact;
+  std::vector<std::string> wildcard;
+  for (std::size_t i = 0; i < kLookups; ++i) {
+    auto n = rng() % (kNames / 2);
+    exact.push_back(name(2 * n));
+    wildcard.push_back("www." + name(2 * n + 1));
+  }
+  std::size_t next = 0;
+  bench::run("exact names, random keys", kLookups, [&] {
+    bench::keep(table.find(exact[next++ % kLookups]) != nullptr);
+  });
+  next = 0;
+  bench::run("wildcard names, random keys", kLookups, [&] {
+    bench::keep(table.find(wildcard[next++ % kLookups]) != nullptr);
+  });
+  next = 0;
+  bench::run("exact names, 16 hot keys", kLookups, [&] {
+    bench::keep(table.find(exact[next++ % 16]) != nullptr);
+  });
+  bench::run("no match", kLookups, [&] {
+    bench::keep(table.find("unknown.example.org") != nullptr);
+  });
+  return 0;
+}
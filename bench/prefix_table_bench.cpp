@@ -0,0 +1,100 @@
+/*
+ *    prefix_table_bench.cpp:
+ *
+ *    Build and lookup cost of PrefixTable with 1M random prefixes: IPv4,
+ *    IPv6 spread over global unicast the way routing tables are (also at
+ *    10k), and IPv6 packed under one /16 down to host routes, the deepest
+ *    case for the trie.
+ *
+ */
+
+#include "bench.hpp"
+
+#include <random>
+
+namespace {
+
+constexpr std::size_t kPrefixes = 1000000;
+constexpr std::size_t kLookups = 4000000;
+
+asio::ip::address v6_address(std::uint64_t high, std::uint64_t low) {
+  asio::ip::address_v6::bytes_type bytes;
+  for (std::size_t i = 0; i < 8; ++i) {
+    bytes[i] = static_cast<unsigned char>(high >> (56 - 8 * i));
+    bytes[8 + i] = static_cast<unsigned char>(low >> (56 - 8 * i));
+  }
+  return asio::ip::address_v6(bytes);
+}
+
+// Builds a table from `prefixes` and times random and repeated lookups of
+// `addresses`.
+void run(const char *name, const std::vector<std::pair<asio::ip::address, std::uint32_t>> &prefixes,
+  const std::vector<asio::ip::address> &addresses) {
+  PrefixTable table;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < prefixes.size(); ++i) {
+    table.add(prefixes[i].first, prefixes[i].second, static_cast<std::uint32_t>(i % 1000 + 1));
+  }
+  table.build();
+  auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  std::printf("%-48s %10.1f ms\n", stdx::format("{}, build", name).c_str(), ms);
+  std::size_t next = 0;
+  bench::run(stdx::format("{}, random addresses", name).c_str(), kLookups, [&] {
+    bench::keep(table.find(addresses[next++ % addresses.size()]));
+  });
+  next = 0;
+  bench::run(stdx::format("{}, 16 hot addresses", name).c_str(), kLookups, [&] {
+    bench::keep(table.find(addresses[next++ % 16]));
+  });
+}
+
+} // namespace
+
+int main() {
+  std::mt19937_64 rng(1);
+  std::vector<std::pair<asio::ip::address, std::uint32_t>> prefixes;
+  std::vector<asio::ip::address> addresses;
+
+  // IPv4: lengths /8 to /32, most of them /24 as in a full routing table.
+  for (std::size_t i = 0; i < kPrefixes; ++i) {
+    auto length = rng() % 4 == 0 ? static_cast<std::uint32_t>(8 + rng() % 25) : 24u;
+    prefixes.emplace_back(asio::ip::make_address_v4(static_cast<std::uint32_t>(rng())), length);
+  }
+  for (std::size_t i = 0; i < kLookups; ++i) {
+    addresses.push_back(asio::ip::make_address_v4(static_cast<std::uint32_t>(rng())));
+  }
+  run("IPv4", prefixes, addresses);
+
+  // IPv6 in 2000::/3, lengths /19 to /64, most of them /48. The same at 10k
+  // prefixes, the size of a large ACL, shows the cache-resident cost.
+  for (std::size_t count : {kPrefixes, std::size_t(10000)}) {
+    prefixes.clear();
+    addresses.clear();
+    for (std::size_t i = 0; i < count; ++i) {
+      auto length = rng() % 4 == 0 ? static_cast<std::uint32_t>(19 + rng() % 46) : 48u;
+      prefixes.emplace_back(v6_address(0x2000000000000000 | rng() >> 3, 0), length);
+    }
+    for (std::size_t i = 0; i < kLookups; ++i) {
+      // Half of the addresses fall inside the /48 of a known prefix, half anywhere.
+      auto high = prefixes[rng() % count].first.to_v6().to_bytes();
+      std::uint64_t prefix = 0;
+      for (std::size_t b = 0; b < 6; ++b) {
+        prefix = prefix << 8 | high[b];
+      }
+      addresses.push_back(rng() % 2 ? v6_address(0x2000000000000000 | rng() >> 3, rng()) : v6_address(prefix << 16 | (rng() & 0xffff), rng()));
+    }
+    run(count == kPrefixes ? "IPv6 global unicast" : "IPv6 global unicast, 10k", prefixes, addresses);
+  }
+
+  // IPv6 under one /16, lengths /17 to /128.
+  prefixes.clear();
+  addresses.clear();
+  for (std::size_t i = 0; i < kPrefixes; ++i) {
+    prefixes.emplace_back(v6_address(0x2001000000000000 | rng() >> 16, rng()), static_cast<std::uint32_t>(17 + rng() % 112));
+  }
+  for (std::size_t i = 0; i < kLookups; ++i) {
+    addresses.push_back(v6_address(0x2001000000000000 | rng() >> 16, rng()));
+  }
+  run("IPv6 under one /16", prefixes, addresses);
+  return 0;
+}
@@ -11,12 +11,29 @@
 #include <asio/experimental/awaitable_operators.hpp>
 #include <asio/ip/tcp.hpp>
 #include <asio/read_until.hpp>
+#include <asio/write.hpp>
 #include <asio/signal_set.hpp>
 #include <asio/steady_timer.hpp>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
 #include <chrono>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
 #include <regex>
+#include <span>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <vector>
 
 #ifdef USE_STD_FORMAT
@@ -34,6 +51,11 @@ namespace stdx {
 }
 #endif
 
+#if defined(__linux__) && !defined(IP_LOCAL_PORT_RANGE)
+// Linux >= 6.3, not yet exported by every libc.
+#define IP_LOCAL_PORT_RANGE 51
+#endif
+
 using namespace asio::experimental::awaitable_operators;
 using AddressType = std::pair<std::string, asio::ip::port_type>;
 
@@ -41,11 +63,66 @@ constexpr char kAppVersionString[] = "1.0.0";
 
 constexpr std::uint32_t kResolveTimeout = 20;
 constexpr std::uint32_t kConnectTimeout = 20;
-constexpr std::uint32_t kHttpProxyHandshakeTimeout = 20;
+constexpr std::uint32_t kProxyHandshakeTimeout = 20;
+constexpr std::size_t kHttpProxyMaxResponseHeaderSize = 2048;
+constexpr std::size_t kMaxEarlyDataSize = 16384;
+constexpr std::uint32_t kProxyProtocolHeaderTimeout = 5;
+constexpr std::size_t kProxyProtocolMaxHeaderSize = 1024;
+constexpr std::uint32_t kSniffTimeout = 5;
+constexpr std::size_t kSniffMaxSize = 16384;
+// Method selection + auth status + CONNECT reply with the longest (domain) address.
+constexpr std::size_t kSocks5MaxReplySize = 2 + 2 + 4 + 1 + 255 + 2;
+constexpr std::uint32_t kHttp2ConnectionWindow = 16 * 1024 * 1024;
+constexpr std::uint32_t kHttp2StreamWindow = 256 * 1024;
+constexpr std::uint32_t kHttp2MaxFrameSize = 16384;
+constexpr std::uint32_t kHttp2DefaultMaxStreams = 100;
+constexpr std::size_t kHttp2MaxPendingWrite = 256 * 1024;
+constexpr std::size_t kHpackMaxTableSize = 4096;
+constexpr std::size_t kHttp2MaxHeaderBlockSize = 64 * 1024;
+constexpr std::uint32_t kPoolRetryInterval = 1;
+constexpr std::uint32_t kPoolMaxRetryInterval = 60;
+constexpr std::uint32_t kMaxTargetWeight = 100;
+constexpr double kConnectLatencyEwmaAlpha = 0.2;
+constexpr std::uint32_t kMaglevTableSize = 65537;
+constexpr std::uint32_t kOutlierWindow = 10;
+constexpr std::uint32_t kMaxEjectionTime = 300;
+constexpr std::uint32_t kRetryBudgetWindow = 10;
+constexpr std::uint32_t kMinRetriesPerWindow = 3;
+constexpr std::uint32_t kAcceptRetryDelayMs = 100;
 
 enum class ViaType {
   none,
   http_proxy,
+  socks5,
+  http2_proxy,
+};
+
+enum class HealthCheckType {
+  none,
+  tcp,
+  handshake,
+};
+
+enum class ProxyProtocolVersion {
+  none,
+  v1,
+  v2,
+};
+
+enum class SniffedProtocol {
+  tls,
+  http,
+  ssh,
+  proxy_protocol,
+  unknown,
+};
+
+enum class LoadBalancePolicy {
+  round_robin,
+  least_conn,
+  power_of_two,
+  ewma,
+  maglev,
 };
 
 class Watchdog {
@@ -54,8 +131,12 @@ public:
     : timer_(executor) {}
 
   virtual void expires_after(const std::chrono::seconds &interval) {
+    expires_at(std::chrono::steady_clock::now() + interval);
+  }
+
+  void expires_at(const std::chrono::steady_clock::time_point &time_point) {
     is_expired_ = false;
-    timer_.expires_after(interval);
+    timer_.expires_at(time_point);
     timer_.async_wait(
       [this](auto ec) {
         if (!ec) {
@@ -125,6 +206,11 @@ public:
     log(LogLevel::info, fmt, std::forward<Args>(args)...);
   }
 
+  template<typename... Args>
+  static void warn(stdx::format_string<Args...> fmt, Args&&... args) {
+    log(LogLevel::warn, fmt, std::forward<Args>(args)...);
+  }
+
   template<typename... Args>
   static void error(stdx::format_string<Args...> fmt, Args&&... args) {
     log(LogLevel::error, fmt, std::forward<Args>(args)...);
@@ -169,296 +255,4910 @@ private:
 
 LogLevel Log::s_log_level = LogLevel::info;
 
-enum class TransferType {
-  uplink,
-  downlink,
-};
+class Counter {
+public:
+  explicit Counter(std::string name);
 
-struct RelayConnectionOptions {
-  AddressType target_address;
-  std::uint32_t timeout;
-  ViaType via_type;
-  AddressType http_proxy_address;
+  void add(std::uint64_t n = 1) {
+    value_ += n;
+  }
+
+  std::uint64_t value() const {
+    return value_;
+  }
+
+  const std::string &name() const {
+    return name_;
+  }
+
+private:
+  std::string name_;
+  std::uint64_t value_ = 0;
 };
 
-class RelayConnection {
+class Histogram {
 public:
-  RelayConnection(std::uint64_t session_id, const RelayConnectionOptions &options)
-    : session_id_(session_id), options_(options) {}
+  explicit Histogram(std::string name);
 
-  asio::awaitable<void> relay(asio::ip::tcp::socket client) {
-    Log::info("[session: {}] | start connection from {}", session_id_, endpoint_to_string(client.remote_endpoint()));
-    try {
-      auto executor = co_await asio::this_coro::executor;
-      asio::ip::tcp::socket server = co_await connect_to_server();
-      if (options_.via_type == ViaType::http_proxy) {
-        co_await http_proxy_handshake(server);
+  void record(std::chrono::microseconds duration) {
+    auto us = static_cast<std::uint64_t>(std::max<std::int64_t>(duration.count(), 0));
+    auto index = std::min<std::size_t>(std::bit_width(us), buckets_.size() - 1);
+    ++buckets_[index];
+    ++count_;
+    max_ = std::max(max_, us);
+  }
+
+  // Upper bound (in microseconds) of the bucket holding the given quantile.
+  std::uint64_t quantile(double q) const {
+    auto rank = static_cast<std::uint64_t>(q * count_);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < buckets_.size(); ++i) {
+      seen += buckets_[i];
+      if (seen > rank) {
+        return std::min(i == 0 ? 0 : (std::uint64_t(1) << i) - 1, max_);
       }
-      co_await tunnel_transfer(client, server);
-    } catch (std::exception &e) {
     }
-    Log::info("[session: {}] | end connection", session_id_);
+    return max_;
+  }
+
+  std::string summary() const {
+    return stdx::format("count={} p50={}us p90={}us p99={}us max={}us", count_, quantile(0.5), quantile(0.9), quantile(0.99), max_);
+  }
+
+  const std::string &name() const {
+    return name_;
   }
 
 private:
-  asio::awaitable<asio::ip::tcp::socket> connect_to_server() {
-    auto address = server_address();
-    const auto &host = std::get<0>(address);
-    const auto &port = std::get<1>(address);
-    if (options_.via_type == ViaType::http_proxy) {
-      Log::debug("[session: {}] | start connecting to the http proxy server {}:{}", session_id_, host, port);
-    } else {
-      Log::debug("[session: {}] | start connecting to {}:{}", session_id_, host, port);
+  std::string name_;
+  std::array<std::uint64_t, 40> buckets_ = {};
+  std::uint64_t count_ = 0;
+  std::uint64_t max_ = 0;
+};
+
+class Gauge {
+public:
+  explicit Gauge(std::string name);
+
+  void add(std::int64_t n = 1) {
+    value_ += n;
+    max_ = std::max(max_, value_);
+  }
+
+  void sub(std::int64_t n = 1) {
+    value_ -= n;
+  }
+
+  std::int64_t value() const {
+    return value_;
+  }
+
+  std::int64_t max() const {
+    return max_;
+  }
+
+  const std::string &name() const {
+    return name_;
+  }
+
+private:
+  std::string name_;
+  std::int64_t value_ = 0;
+  std::int64_t max_ = 0;
+};
+
+class Metrics {
+public:
+  static Counter upstream_pool_hits;
+  static Counter upstream_pool_misses;
+  static Counter upstream_pool_expired;
+  static Counter upstream_pool_dead;
+  static Counter upstream_pool_failures;
+  static Counter health_check_probes;
+  static Counter health_check_failures;
+  static Counter health_check_transitions;
+  static Counter outlier_ejections;
+  static Counter circuit_breaker_rejections;
+  static Counter proxy_protocol_rejections;
+  static Counter route_misses;
+  static Counter client_denials;
+  static Counter client_limit_rejections;
+  static Counter connect_retries;
+  static Counter connect_retry_budget_exhausted;
+  static Counter source_port_exhausted;
+  static Counter connect_queue_rejections;
+  static Counter connect_queue_timeouts;
+  static Gauge connect_queue_depth;
+  static Histogram connect_queue_wait_time;
+  static Histogram upstream_connect_time;
+  static Counter http2_connections;
+  static Counter http2_streams;
+  static Gauge http2_active_streams;
+  static Histogram session_ttfb;
+
+  // One histogram per position in the proxy chain, created on first use.
+  static Histogram &proxy_hop_handshake_time(std::size_t hop) {
+    static std::deque<Histogram> s_hops;
+    while (s_hops.size() <= hop) {
+      s_hops.emplace_back(stdx::format("proxy_hop.{}.handshake_time", s_hops.size() + 1));
     }
-    auto executor = co_await asio::this_coro::executor;
-    asio::ip::tcp::resolver resolver(executor);
-    Watchdog watchdog(executor);
-    watchdog.expires_after(std::chrono::seconds(kResolveTimeout));
-    Log::trace("[session: {}] | start resolving {}:{}", session_id_, host, port);
-    auto [ec, resolver_entries] = co_await resolver.async_resolve(host, std::to_string(port),
-      asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
-    if (watchdog.is_expired()) {
-      Log::error("[session: {}] | resolve {}:{} timeout", session_id_, host, port);
-      throw std::system_error(std::make_error_code(std::errc::timed_out));
+    return s_hops[hop];
+  }
+
+  static void report() {
+    for (const auto *counter : counters()) {
+      Log::info("[stats] | {} {}", counter->name(), counter->value());
     }
-    if (ec) {
-      Log::error("[session: {}] | resolve {}:{} error: {}", session_id_, host, port, ec.message());
-      throw std::system_error(ec);
+    for (const auto *gauge : gauges()) {
+      Log::info("[stats] | {} {} (max {})", gauge->name(), gauge->value(), gauge->max());
     }
-    Log::trace("[session: {}] | resolve {}:{} success", session_id_, host, port);
-    asio::ip::tcp::socket server(executor);
-    for (const auto resolver_entry : resolver_entries) {
-      watchdog.expires_after(std::chrono::seconds(kConnectTimeout));
-      Log::trace("[session: {}] | start connecting {}:{}({})", session_id_, host, port, endpoint_to_string(resolver_entry.endpoint()));
-      auto [ec] = co_await server.async_connect(resolver_entry, asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
-      if (ec) {
-        Log::trace("[session: {}] | connecte to {}:{}({}) error: {}", session_id_, host, port, endpoint_to_string(resolver_entry.endpoint()), ec.message());
-      } else {
-        Log::debug("[session: {}] | successfully connected to {}:{}({})", session_id_, host, port, endpoint_to_string(resolver_entry.endpoint()));
-        co_return server;
-      }
+    for (const auto *histogram : histograms()) {
+      Log::info("[stats] | {} {}", histogram->name(), histogram->summary());
     }
-    Log::error("[session: {}] | failed to connect to {}:{}", session_id_, host, port);
-    throw std::runtime_error(stdx::format("failed to connect to {}:{}", session_id_, host, port));
   }
 
-  asio::awaitable<void> http_proxy_handshake(asio::ip::tcp::socket &server) {
-    const auto &target_address = options_.target_address;
-    std::string http_host;
-    if (std::get<0>(target_address).find(':') != std::string::npos) {
-      http_host = stdx::format("[{}]:{}", std::get<0>(target_address), std::get<1>(target_address));
-    } else {
-      http_host = stdx::format("{}:{}", std::get<0>(target_address), std::get<1>(target_address));
+  static asio::awaitable<void> report_periodically(std::chrono::seconds interval) {
+    asio::steady_timer timer(co_await asio::this_coro::executor);
+    for (;;) {
+      timer.expires_after(interval);
+      co_await timer.async_wait(asio::use_awaitable);
+      report();
     }
-    Log::debug("[session: {}] | http-proxy handshake CONNECT {} HTTP/1.1", session_id_, http_host);
-    std::string request_header = stdx::format("CONNECT {} HTTP/1.1\r\nHost: {}\r\nProxy-Connection: keep-alive\r\n\r\n", http_host, http_host);
-    std::size_t request_header_size = request_header.size();
-    std::size_t bytes_written = 0;
-    auto executor = co_await asio::this_coro::executor;
-    Watchdog watchdog(executor);
-    while (bytes_written < request_header_size) {
-      watchdog.expires_after(std::chrono::seconds(kHttpProxyHandshakeTimeout));
-      auto [ec, bytes_transfered] = co_await server.async_write_some(asio::buffer(request_header.data() + bytes_written, request_header_size - bytes_written),
-        asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
-      if (watchdog.is_expired()) {
-        Log::error("[session: {}] | http-proxy handshake write request header timeout", session_id_);
-        throw std::system_error(std::make_error_code(std::errc::timed_out));
+  }
+
+private:
+  friend class Counter;
+  friend class Gauge;
+  friend class Histogram;
+
+  static std::vector<const Counter *> &counters() {
+    static std::vector<const Counter *> s_counters;
+    return s_counters;
+  }
+
+  static std::vector<const Gauge *> &gauges() {
+    static std::vector<const Gauge *> s_gauges;
+    return s_gauges;
+  }
+
+  static std::vector<const Histogram *> &histograms() {
+    static std::vector<const Histogram *> s_histograms;
+    return s_histograms;
+  }
+};
+
+Counter::Counter(std::string name) : name_(std::move(name)) {
+  Metrics::counters().push_back(this);
+}
+
+Gauge::Gauge(std::string name) : name_(std::move(name)) {
+  Metrics::gauges().push_back(this);
+}
+
+Histogram::Histogram(std::string name) : name_(std::move(name)) {
+  Metrics::histograms().push_back(this);
+}
+
+Counter Metrics::upstream_pool_hits("upstream_pool.hits");
+Counter Metrics::upstream_pool_misses("upstream_pool.misses");
+Counter Metrics::upstream_pool_expired("upstream_pool.expired");
+Counter Metrics::upstream_pool_dead("upstream_pool.dead");
+Counter Metrics::upstream_pool_failures("upstream_pool.failures");
+Counter Metrics::health_check_probes("health_check.probes");
+Counter Metrics::health_check_failures("health_check.failures");
+Counter Metrics::health_check_transitions("health_check.transitions");
+Counter Metrics::outlier_ejections("outlier.ejections");
+Counter Metrics::circuit_breaker_rejections("circuit_breaker.rejections");
+Counter Metrics::proxy_protocol_rejections("proxy_protocol.rejections");
+Counter Metrics::route_misses("route.misses");
+Counter Metrics::client_denials("client.denials");
+Counter Metrics::client_limit_rejections("client_limit.rejections");
+Counter Metrics::connect_retries("connect.retries");
+Counter Metrics::connect_retry_budget_exhausted("connect.retry_budget_exhausted");
+Counter Metrics::source_port_exhausted("source.port_exhausted");
+Counter Metrics::connect_queue_rejections("connect_queue.rejections");
+Counter Metrics::connect_queue_timeouts("connect_queue.timeouts");
+Gauge Metrics::connect_queue_depth("connect_queue.depth");
+Histogram Metrics::connect_queue_wait_time("connect_queue.wait_time");
+Histogram Metrics::upstream_connect_time("upstream.connect_time");
+Counter Metrics::http2_connections("http2.connections");
+Counter Metrics::http2_streams("http2.streams");
+Gauge Metrics::http2_active_streams("http2.active_streams");
+Histogram Metrics::session_ttfb("session.ttfb");
+
+enum class TransferType {
+  uplink,
+  downlink,
+};
+
+std::string endpoint_to_string(const asio::ip::tcp::endpoint &endpoint) {
+  auto address = endpoint.address();
+  if (address.is_v6()) {
+    return stdx::format("[{}]:{}", address.to_string(), endpoint.port());
+  } else {
+    return stdx::format("{}:{}", address.to_string(), endpoint.port());
+  }
+}
+
+// Incremental parser for the status line and headers of an HTTP/1.x response.
+// Works on the received bytes in place, keeps no copies and never allocates;
+// bytes can be fed in arbitrary chunks. Accepts the same status lines as the
+// former `HTTP/1\.[01]\s+(\d+)\s+.*` (case-insensitive) regex, but also
+// tolerates an empty reason phrase.
+class HttpResponseParser {
+public:
+  enum class Result {
+    incomplete,
+    complete,
+    error,
+  };
+
+  // Feeds the next chunk. On `complete`, `header_size()` tells where the
+  // header ends; bytes after that in the stream are payload.
+  Result parse(std::string_view data) {
+    for (char c : data) {
+      ++header_size_;
+      if (!consume(c)) {
+        state_ = State::error;
+        return Result::error;
       }
-      if (ec) {
-        Log::error("[session: {}] | http-proxy handshake write request header error: {}", session_id_, ec.message());
-        throw std::system_error(ec);
+      if (state_ == State::done) {
+        return Result::complete;
       }
-      bytes_written += bytes_transfered;
-    }
-    std::string response_header;
-    watchdog.expires_after(std::chrono::seconds(kHttpProxyHandshakeTimeout));
-    auto [ec, bytes_read] = co_await asio::async_read_until(server, asio::dynamic_buffer(response_header, 2048), "\r\n\r\n",
-      asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
-    if (watchdog.is_expired()) {
-      Log::error("[session: {}] | http-proxy handshake read response header timeout", session_id_);
-      throw std::system_error(std::make_error_code(std::errc::timed_out));
     }
-    if (ec) {
-      Log::error("[session: {}] | http-proxy handshake read response header error: {}", session_id_, ec.message());
-      throw std::system_error(ec);
+    return Result::incomplete;
+  }
+
+  std::uint32_t status_code() const {
+    return status_code_;
+  }
+
+  std::size_t header_size() const {
+    return header_size_;
+  }
+
+  // The lookups below scan a complete header again. They are only used off
+  // the fast path, e.g. to reuse the connection after a 407.
+  std::optional<std::size_t> content_length(std::string_view header) const {
+    auto value = find_header(header, "content-length");
+    std::size_t length = 0;
+    if (!value || std::from_chars(value->data(), value->data() + value->size(), length).ec != std::errc()) {
+      return std::nullopt;
     }
+    return length;
+  }
 
-    auto first_line_end = response_header.find("\r\n");
-    std::regex re("^HTTP/1\\.[01]\\s+(\\d+)\\s+.*", std::regex_constants::ECMAScript | std::regex_constants::icase);
-    std::smatch m;
-    if (!std::regex_match(response_header.cbegin(), response_header.cbegin() + first_line_end, m, re)) {
-      Log::error("[session: {}] | http-proxy handshake failed bad HTTP response header", session_id_);
-      throw std::runtime_error("bad HTTP response header");
+  bool keep_alive(std::string_view header) const {
+    auto connection = find_header(header, "proxy-connection");
+    if (!connection) {
+      connection = find_header(header, "connection");
     }
-    std::string status_code = m[1].str();
-    if (status_code != "200") {
-      Log::error("[session: {}] | http-proxy handshake failed response status_code: {}", session_id_, status_code);
-      throw std::runtime_error("HTTP connect failed");
+    if (connection) {
+      return equals_ignore_case(*connection, "keep-alive");
     }
-    Log::debug("[session: {}] | http-proxy handshake success", session_id_);
+    return minor_version_ == '1';
   }
 
-  asio::awaitable<void> tunnel_transfer(asio::ip::tcp::socket &client, asio::ip::tcp::socket &server) {
-    Deadline deadline;
-    Log::debug("[session: {}] | start tunnel transfer", session_id_);
-    auto transfer_result = co_await (tunnel_transfer(client, server, deadline) || tunnel_transfer_timeout(deadline));
-    if (transfer_result.index() == 1) {
-      Log::debug("[session: {}] | tunnel transfer connection closed due to timeout", session_id_);
-    }
-    Log::debug("[session: {}] | end tunnel transfer", session_id_);
+private:
+  enum class State {
+    version,
+    version_minor,
+    first_space,
+    spaces,
+    status_code,
+    reason,
+    status_line_lf,
+    header_line_start,
+    header_line,
+    header_line_lf,
+    final_lf,
+    done,
+    error,
+  };
+
+  static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f';
   }
 
-  asio::awaitable<void> tunnel_transfer(asio::ip::tcp::socket &client, asio::ip::tcp::socket &server, Deadline &deadline) {
-    try {
-      co_await (transfer(TransferType::uplink, client, server, deadline) && transfer(TransferType::downlink, server, client, deadline));
-    } catch (std::exception &) {
-    }
+  static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
   }
 
-  asio::awaitable<void> transfer(TransferType type, asio::ip::tcp::socket &from, asio::ip::tcp::socket &to, Deadline &deadline) {
-    std::array<char, 4096> buffer;
-    std::string transfer_type_string = transfer_type_to_string(type);
-    for (;;) {
-      deadline.expires_after(std::chrono::seconds(options_.timeout));
-      auto [read_error, bytes_read] = co_await from.async_read_some(asio::buffer(buffer), asio::as_tuple(asio::use_awaitable));
-      if (read_error) {
-        if (read_error.value() == asio::error::eof) {
-          Log::debug("[session: {}] | {} transfer read eof", session_id_, transfer_type_string);
-          co_return;
-        }
-        Log::debug("[session: {}] | {} transfer read error: {}", session_id_, transfer_type_string, read_error.message());
-        throw std::system_error(read_error);
-      }
-      std::size_t bytes_written = 0;
-      while (bytes_written < bytes_read) {
-        deadline.expires_after(std::chrono::seconds(options_.timeout));
-        auto [write_error, bytes_transferred] = co_await to.async_write_some(asio::buffer(buffer.data() + bytes_written, bytes_read - bytes_written), asio::as_tuple(asio::use_awaitable));
-        if (write_error) {
-          Log::debug("[session: {}] | {} transfer write error: {}", session_id_, transfer_type_string, write_error.message());
-          throw std::system_error(write_error);
-        }
-        bytes_written += bytes_transferred;
-      }
-    }
+  static char to_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
   }
 
-  asio::awaitable<void> tunnel_transfer_timeout(const Deadline &deadline) {
-    asio::steady_timer timer(co_await asio::this_coro::executor);
-    while (!deadline.is_expired()) {
-      timer.expires_at(deadline.time_point());
-      co_await timer.async_wait(asio::use_awaitable);
+  static bool equals_ignore_case(std::string_view a, std::string_view b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) { return to_lower(x) == to_lower(y); });
+  }
+
+  static std::optional<std::string_view> find_header(std::string_view header, std::string_view name) {
+    for (auto line_end = header.find("\r\n"); line_end != std::string_view::npos;) {
+      auto line_begin = line_end + 2;
+      line_end = header.find("\r\n", line_begin);
+      if (line_end == std::string_view::npos) {
+        break;
+      }
+      auto line = header.substr(line_begin, line_end - line_begin);
+      auto colon = line.find(':');
+      if (colon == std::string_view::npos || !equals_ignore_case(line.substr(0, colon), name)) {
+        continue;
+      }
+      auto value = line.substr(colon + 1);
+      while (!value.empty() && is_space(value.front())) {
+        value.remove_prefix(1);
+      }
+      while (!value.empty() && is_space(value.back())) {
+        value.remove_suffix(1);
+      }
+      return value;
     }
+    return std::nullopt;
   }
 
-  const AddressType &server_address() const {
-    switch (options_.via_type) {
-      case ViaType::http_proxy:
-        return options_.http_proxy_address;
+  bool consume(char c) {
+    static constexpr std::string_view kVersionPrefix = "http/1.";
+    switch (state_) {
+      case State::version:
+        if (to_lower(c) != kVersionPrefix[matched_]) {
+          return false;
+        }
+        if (++matched_ == kVersionPrefix.size()) {
+          state_ = State::version_minor;
+        }
+        return true;
+      case State::version_minor:
+        state_ = State::first_space;
+        minor_version_ = c;
+        return c == '0' || c == '1';
+      case State::first_space:
+        state_ = State::spaces;
+        return is_space(c);
+      case State::spaces:
+        if (is_digit(c)) {
+          state_ = State::status_code;
+          return consume(c);
+        }
+        return is_space(c);
+      case State::status_code:
+        if (is_digit(c)) {
+          status_code_ = std::min<std::uint32_t>(status_code_ * 10 + (c - '0'), 1000);
+          return true;
+        }
+        if (c == '\r') {
+          state_ = State::status_line_lf;
+          return true;
+        }
+        state_ = State::reason;
+        return is_space(c);
+      case State::reason:
+        if (c == '\r') {
+          state_ = State::status_line_lf;
+        }
+        return c != '\n';
+      case State::status_line_lf:
+      case State::header_line_lf:
+        state_ = State::header_line_start;
+        return c == '\n';
+      case State::header_line_start:
+        state_ = c == '\r' ? State::final_lf : State::header_line;
+        return c != '\n';
+      case State::header_line:
+        if (c == '\r') {
+          state_ = State::header_line_lf;
+        }
+        return c != '\n';
+      case State::final_lf:
+        state_ = State::done;
+        return c == '\n';
       default:
-        return options_.target_address;
+        return false;
     }
   }
 
-  std::string endpoint_to_string(const asio::ip::tcp::endpoint &endpoint) {
-    auto address = endpoint.address();
-    if (address.is_v6()) {
-      return stdx::format("[{}]:{}", address.to_string(), endpoint.port());
+  State state_ = State::version;
+  std::size_t matched_ = 0;
+  char minor_version_ = 0;
+  std::uint32_t status_code_ = 0;
+  std::size_t header_size_ = 0;
+};
+
+// CONNECT request for one target. The bytes are built once when the
+// configuration is loaded and shared read-only by every session; the extra
+// headers and the Proxy-Authorization line are shared by all targets and sent
+// in the same gather write.
+class HttpConnectRequest {
+public:
+  HttpConnectRequest(const AddressType &target_address, std::shared_ptr<const std::string> extra_headers,
+      std::shared_ptr<const std::string> authorization, bool preemptive_auth)
+    : extra_headers_(std::move(extra_headers)), authorization_(std::move(authorization)), preemptive_auth_(preemptive_auth) {
+    if (std::get<0>(target_address).find(':') != std::string::npos) {
+      authority_ = stdx::format("[{}]:{}", std::get<0>(target_address), std::get<1>(target_address));
     } else {
-      return stdx::format("{}:{}", address.to_string(), endpoint.port());
+      authority_ = stdx::format("{}:{}", std::get<0>(target_address), std::get<1>(target_address));
     }
+    head_ = stdx::format("CONNECT {} HTTP/1.1\r\nHost: {}\r\nProxy-Connection: keep-alive\r\n", authority_, authority_);
   }
 
-  std::string transfer_type_to_string(TransferType transfer_type) {
-    switch (transfer_type) {
-      case TransferType::uplink:
-        return "uplink";
-      case TransferType::downlink:
-        return "downlink";
-      default:
-        // unreachable
-        std::abort();
+  const std::string &authority() const {
+    return authority_;
+  }
+
+  bool has_authorization() const {
+    return authorization_ != nullptr;
+  }
+
+  // Send credentials with the first request instead of waiting for a 407.
+  bool preemptive_auth() const {
+    return preemptive_auth_ || !authorization_;
+  }
+
+  std::array<asio::const_buffer, 4> buffers(bool authenticate) const {
+    static constexpr char kEndOfHeader[] = "\r\n";
+    return {asio::buffer(head_), authenticate && authorization_ ? asio::buffer(*authorization_) : asio::const_buffer(),
+      asio::buffer(*extra_headers_), asio::buffer(kEndOfHeader, 2)};
+  }
+
+  // "Proxy-Authorization: Basic ..." header line, encoded once at startup.
+  static std::string basic_authorization(const std::string &username, const std::string &password) {
+    static constexpr char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    auto credentials = username + ":" + password;
+    std::string encoded;
+    encoded.reserve((credentials.size() + 2) / 3 * 4);
+    for (std::size_t i = 0; i < credentials.size(); i += 3) {
+      std::uint32_t group = static_cast<std::uint8_t>(credentials[i]) << 16;
+      if (i + 1 < credentials.size()) {
+        group |= static_cast<std::uint8_t>(credentials[i + 1]) << 8;
+      }
+      if (i + 2 < credentials.size()) {
+        group |= static_cast<std::uint8_t>(credentials[i + 2]);
+      }
+      encoded += kAlphabet[(group >> 18) & 0x3f];
+      encoded += kAlphabet[(group >> 12) & 0x3f];
+      encoded += i + 1 < credentials.size() ? kAlphabet[(group >> 6) & 0x3f] : '=';
+      encoded += i + 2 < credentials.size() ? kAlphabet[group & 0x3f] : '=';
     }
+    return stdx::format("Proxy-Authorization: Basic {}\r\n", encoded);
   }
 
 private:
-  std::uint64_t session_id_;
-  RelayConnectionOptions options_;
-};
-
-struct RelayServerOptions {
-  asio::ip::address listen_address;
-  asio::ip::port_type listen_port;
-  AddressType target_address;
-  std::uint32_t timeout;
-  ViaType via_type;
-  AddressType http_proxy_address;
+  std::string authority_;
+  std::string head_;
+  std::shared_ptr<const std::string> extra_headers_;
+  std::shared_ptr<const std::string> authorization_;
+  bool preemptive_auth_;
 };
 
-class RelayServer {
+// SOCKS5 (RFC 1928) greeting, optional username/password sub-negotiation
+// (RFC 1929) and CONNECT for one target, built once like HttpConnectRequest.
+// Only one method is offered, so the server's choice is known in advance and
+// all messages go out in a single write. Host names are sent as ATYP 3 and
+// resolved by the proxy.
+class Socks5ConnectRequest {
 public:
-  RelayServer(const asio::any_io_executor &executor, const RelayServerOptions &options)
-    : acceptor_(executor, {options.listen_address, options.listen_port}), options_(options) {}
+  Socks5ConnectRequest(const AddressType &target_address, const std::string &username, const std::string &password)
+    : authenticate_(!username.empty()) {
+    const auto &[host, port] = target_address;
+    authority_ = stdx::format("{}:{}", host, port);
+    bytes_ = {0x05, 0x01, static_cast<char>(authenticate_ ? 0x02 : 0x00)};
+    if (authenticate_) {
+      bytes_ += static_cast<char>(0x01);
+      bytes_ += static_cast<char>(username.size());
+      bytes_ += username;
+      bytes_ += static_cast<char>(password.size());
+      bytes_ += password;
+    }
+    bytes_ += {0x05, 0x01, 0x00};
+    asio::error_code ec;
+    auto address = asio::ip::make_address(host, ec);
+    if (!ec && address.is_v4()) {
+      auto bytes = address.to_v4().to_bytes();
+      bytes_ += static_cast<char>(0x01);
+      bytes_.append(bytes.begin(), bytes.end());
+    } else if (!ec && address.is_v6()) {
+      auto bytes = address.to_v6().to_bytes();
+      bytes_ += static_cast<char>(0x04);
+      bytes_.append(bytes.begin(), bytes.end());
+    } else {
+      if (host.size() > 255) {
+        throw std::invalid_argument("SOCKS5 host name too long");
+      }
+      bytes_ += static_cast<char>(0x03);
+      bytes_ += static_cast<char>(host.size());
+      bytes_ += host;
+    }
+    bytes_ += static_cast<char>(port >> 8);
+    bytes_ += static_cast<char>(port & 0xff);
+  }
 
-  asio::awaitable<void> listen() {
-    auto executor = co_await asio::this_coro::executor;
-    RelayConnectionOptions conn_options = {
-      .target_address = options_.target_address,
-      .timeout = options_.timeout,
-      .via_type = options_.via_type,
-      .http_proxy_address = options_.http_proxy_address,
-    };
-    for (std::uint64_t session_id = 10000;; ++session_id) {
-      auto client = co_await acceptor_.async_accept(asio::use_awaitable);
-      asio::co_spawn(executor, [session_id, conn_options, client = std::move(client)]() mutable -> asio::awaitable<void> {
-        RelayConnection conn(session_id, conn_options);
-        co_await conn.relay(std::move(client));
-      }, asio::detached);
-    }    
+  const std::string &authority() const {
+    return authority_;
+  }
+
+  bool authenticate() const {
+    return authenticate_;
+  }
+
+  asio::const_buffer buffer() const {
+    return asio::buffer(bytes_);
   }
 
 private:
-  asio::ip::tcp::acceptor acceptor_;
-  RelayServerOptions options_;
+  bool authenticate_;
+  std::string authority_;
+  std::string bytes_;
 };
 
-struct Args {
-  asio::ip::address listen_address = asio::ip::address_v4::any();
-  asio::ip::port_type listen_port = 8886;
-  AddressType target_address = {"", 0};
-  std::uint32_t timeout = 240;
-  ViaType via_type = ViaType::none;
-  AddressType http_proxy_address = {"", 0};
-  LogLevel log_level = LogLevel::info;
+// The handshake that turns a connection to the proxy into a tunnel to one
+// target.
+using ProxyRequest = std::variant<HttpConnectRequest, Socks5ConnectRequest>;
 
-  static void print_usage() {
-#ifdef _WIN32
-    const char *prog = "tcp-relay.exe";
-#else
-    const char *prog = "tcp-relay";
-#endif
-    Args args;
-    std::cout << "Usage: " << prog << " [options]\n\n"
-              << "options:\n"
-              << "  -h, --help                  Show this help message and exit\n"
-              << "  -v, --version               Print the program version and exit\n"
-              << "  -l, --listen_addr string    Local address to listen on (default: " << args.listen_address.to_string() << ")\n"
-              << "  -p, --port number           Local port to listen on (default: " << args.listen_port << ")\n"
-              << "  -t, --target string         Taget address (host:port) to connect\n"
-              << "  --timeout number            Connection timeout (in seconds) (default: " << args.timeout << ")\n"
-              << "  --via [none | http_proxy]   Transfer via other proxy (default: none)\n"
-              << "  --http_proxy string         HTTP-Proxy address (host:port)\n"
-              << "  --log_level string [trace | debug | info | warn | error | disable] Log level (default: info)\n";
-  }
+// One request per hop; each hop is asked to connect to the next hop, the last
+// one to the target.
+using ProxyChain = std::vector<ProxyRequest>;
 
-  static asio::ip::port_type parse_port(const std::string &port) {
-    auto result = std::stoul(port);
-    if (result <= 0 || result >= 65536) {
-      throw std::invalid_argument("invalid port value");
+struct ProxyHop {
+  ViaType type;
+  AddressType address;
+};
+
+// Local addresses (and an optional local port range) used for outbound
+// connections. Spreading connections over several source IPs multiplies the
+// available 4-tuples towards a single target ip:port.
+class SourceAddressPool {
+public:
+  static void set_addresses(const std::vector<asio::ip::address> &addresses) {
+    for (const auto &address : addresses) {
+      (address.is_v6() ? s_v6_addresses : s_v4_addresses).push_back(address);
     }
-    return static_cast<asio::ip::port_type>(result);
   }
 
-  static AddressType parse_host_port_pair(const std::string &address) {
+  static void set_port_range(std::uint16_t first, std::uint16_t last) {
+    s_port_range = {first, last};
+  }
+
+  static std::size_t size(const asio::ip::tcp &protocol) {
+    return addresses(protocol).size();
+  }
+
+  // Opens the socket and binds it to the next source address of the same
+  // family. The port is left to the kernel: with IP_BIND_ADDRESS_NO_PORT it is
+  // chosen at connect time per 4-tuple instead of being reserved by bind().
+  static asio::error_code prepare(asio::ip::tcp::socket &socket, const asio::ip::tcp &protocol) {
+    asio::error_code ec;
+    auto &candidates = addresses(protocol);
+    if (candidates.empty() && !s_port_range) {
+      return ec;
+    }
+    socket.open(protocol, ec);
+    if (ec) {
+      return ec;
+    }
+#ifdef IP_LOCAL_PORT_RANGE
+    if (s_port_range) {
+      std::uint32_t range = (std::uint32_t(s_port_range->second) << 16) | s_port_range->first;
+      // Older kernels reject the option, the system wide range applies then.
+      ::setsockopt(socket.native_handle(), IPPROTO_IP, IP_LOCAL_PORT_RANGE, &range, sizeof(range));
+    }
+#endif
+    if (candidates.empty()) {
+      return ec;
+    }
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    int one = 1;
+    ::setsockopt(socket.native_handle(), IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+    auto &next = protocol == asio::ip::tcp::v6() ? s_v6_next : s_v4_next;
+    socket.bind({candidates[next++ % candidates.size()], 0}, ec);
+    return ec;
+  }
+
+  static bool is_port_exhausted(const asio::error_code &ec) {
+    return ec == std::errc::address_not_available || ec == asio::error::address_in_use;
+  }
+
+private:
+  static std::vector<asio::ip::address> &addresses(const asio::ip::tcp &protocol) {
+    return protocol == asio::ip::tcp::v6() ? s_v6_addresses : s_v4_addresses;
+  }
+
+  static std::vector<asio::ip::address> s_v4_addresses;
+  static std::vector<asio::ip::address> s_v6_addresses;
+  static std::size_t s_v4_next;
+  static std::size_t s_v6_next;
+  static std::optional<std::pair<std::uint16_t, std::uint16_t>> s_port_range;
+};
+
+std::vector<asio::ip::address> SourceAddressPool::s_v4_addresses;
+std::vector<asio::ip::address> SourceAddressPool::s_v6_addresses;
+std::size_t SourceAddressPool::s_v4_next = 0;
+std::size_t SourceAddressPool::s_v6_next = 0;
+std::optional<std::pair<std::uint16_t, std::uint16_t>> SourceAddressPool::s_port_range;
+
+class UpstreamConnector {
+public:
+  explicit UpstreamConnector(std::string tag)
+    : tag_(std::move(tag)) {}
+
+  // Caps every following step (resolve, connect, handshake) at the given time
+  // point, in addition to the per-step timeouts.
+  void set_deadline(const std::chrono::steady_clock::time_point &deadline) {
+    deadline_ = deadline;
+  }
+
+  asio::awaitable<asio::ip::tcp::socket> connect(const AddressType &address) {
+    const auto &host = std::get<0>(address);
+    const auto &port = std::get<1>(address);
+    auto start_time = std::chrono::steady_clock::now();
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::resolver resolver(executor);
+    Watchdog watchdog(executor);
+    arm(watchdog, std::chrono::seconds(kResolveTimeout));
+    Log::trace("[{}] | start resolving {}:{}", tag_, host, port);
+    auto [ec, resolver_entries] = co_await resolver.async_resolve(host, std::to_string(port),
+      asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+    if (watchdog.is_expired()) {
+      Log::error("[{}] | resolve {}:{} timeout", tag_, host, port);
+      throw std::system_error(std::make_error_code(std::errc::timed_out));
+    }
+    if (ec) {
+      Log::error("[{}] | resolve {}:{} error: {}", tag_, host, port, ec.message());
+      throw std::system_error(ec);
+    }
+    Log::trace("[{}] | resolve {}:{} success", tag_, host, port);
+    asio::ip::tcp::socket server(executor);
+    for (const auto &resolver_entry : resolver_entries) {
+      const auto &endpoint = resolver_entry.endpoint();
+      // On port exhaustion the next source address gets a chance.
+      auto sources = std::max<std::size_t>(SourceAddressPool::size(endpoint.protocol()), 1);
+      for (std::size_t source_attempt = 0; source_attempt < sources; ++source_attempt) {
+        arm(watchdog, std::chrono::seconds(kConnectTimeout));
+        Log::trace("[{}] | start connecting {}:{}({})", tag_, host, port, endpoint_to_string(endpoint));
+        asio::error_code ignored_ec;
+        server.close(ignored_ec);
+        auto ec = SourceAddressPool::prepare(server, endpoint.protocol());
+        if (!ec) {
+          auto [connect_ec] = co_await server.async_connect(endpoint, asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+          ec = connect_ec;
+        }
+        if (!ec) {
+          Log::debug("[{}] | successfully connected to {}:{}({})", tag_, host, port, endpoint_to_string(endpoint));
+          Metrics::upstream_connect_time.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time));
+          co_return server;
+        }
+        Log::trace("[{}] | connecte to {}:{}({}) error: {}", tag_, host, port, endpoint_to_string(endpoint), ec.message());
+        if (!SourceAddressPool::is_port_exhausted(ec)) {
+          break;
+        }
+        Metrics::source_port_exhausted.add();
+        Log::warn("[{}] | local ports exhausted connecting to {}:{}({}): {}", tag_, host, port, endpoint_to_string(endpoint), ec.message());
+      }
+    }
+    Log::error("[{}] | failed to connect to {}:{}", tag_, host, port);
+    throw std::runtime_error(stdx::format("failed to connect to {}:{}", host, port));
+  }
+
+  // Sends the CONNECT request, optionally followed by client data in the same
+  // write (pipelining), and returns any payload the proxy sent right after the
+  // response header so the caller can forward it instead of dropping it. With
+  // challenge-response auth the first request goes out without credentials and
+  // is repeated with them on the same connection after a 407; early data waits
+  // for the request that carries them, or for a 200 to the first one.
+  asio::awaitable<std::string> http_proxy_handshake(asio::ip::tcp::socket &server, const HttpConnectRequest &request,
+      asio::const_buffer early_data, std::chrono::steady_clock::time_point handshake_deadline) {
+    Log::debug("[{}] | http-proxy handshake CONNECT {} HTTP/1.1", tag_, request.authority());
+    auto executor = co_await asio::this_coro::executor;
+    Watchdog watchdog(executor);
+    watchdog.expires_at(handshake_deadline);
+    std::array<char, kHttpProxyMaxResponseHeaderSize> response_header;
+    for (bool authenticate = request.preemptive_auth();;) {
+      bool challenge_expected = request.has_authorization() && !authenticate;
+      auto request_buffers = request.buffers(authenticate);
+      std::array<asio::const_buffer, std::tuple_size_v<decltype(request_buffers)> + 1> buffers;
+      std::copy(request_buffers.begin(), request_buffers.end(), buffers.begin());
+      if (!challenge_expected && early_data.size() > 0) {
+        Log::trace("[{}] | http-proxy handshake pipelining {} bytes of client data", tag_, early_data.size());
+        buffers.back() = early_data;
+      }
+      auto [write_error, bytes_written] = co_await asio::async_write(server, buffers,
+        asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+      if (watchdog.is_expired()) {
+        Log::error("[{}] | http-proxy handshake write request header timeout", tag_);
+        throw std::system_error(std::make_error_code(std::errc::timed_out));
+      }
+      if (write_error) {
+        Log::error("[{}] | http-proxy handshake write request header error: {}", tag_, write_error.message());
+        throw std::system_error(write_error);
+      }
+      std::size_t bytes_received = 0;
+      HttpResponseParser parser;
+      for (;;) {
+        if (bytes_received == response_header.size()) {
+          Log::error("[{}] | http-proxy handshake failed HTTP response header too large", tag_);
+          throw std::runtime_error("HTTP response header too large");
+        }
+        auto [ec, bytes_read] = co_await server.async_read_some(asio::buffer(response_header.data() + bytes_received, response_header.size() - bytes_received),
+          asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+        if (watchdog.is_expired()) {
+          Log::error("[{}] | http-proxy handshake read response header timeout", tag_);
+          throw std::system_error(std::make_error_code(std::errc::timed_out));
+        }
+        if (ec) {
+          Log::error("[{}] | http-proxy handshake read response header error: {}", tag_, ec.message());
+          throw std::system_error(ec);
+        }
+        auto result = parser.parse(std::string_view(response_header.data() + bytes_received, bytes_read));
+        bytes_received += bytes_read;
+        if (result == HttpResponseParser::Result::complete) {
+          break;
+        }
+        if (result == HttpResponseParser::Result::error) {
+          Log::error("[{}] | http-proxy handshake failed bad HTTP response header", tag_);
+          throw std::runtime_error("bad HTTP response header");
+        }
+      }
+      auto status_code = parser.status_code();
+      if (status_code == 407 && challenge_expected) {
+        std::string_view header(response_header.data(), parser.header_size());
+        auto content_length = parser.content_length(header);
+        if (!content_length || !parser.keep_alive(header)) {
+          Log::error("[{}] | http-proxy handshake failed proxy does not keep the connection after 407", tag_);
+          throw std::runtime_error("HTTP proxy authentication required");
+        }
+        // Skip the 407 body so that the next response starts at a clean boundary.
+        std::size_t body_received = bytes_received - parser.header_size();
+        while (body_received < *content_length) {
+          auto [ec, bytes_read] = co_await server.async_read_some(asio::buffer(response_header),
+            asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+          if (watchdog.is_expired()) {
+            Log::error("[{}] | http-proxy handshake read response body timeout", tag_);
+            throw std::system_error(std::make_error_code(std::errc::timed_out));
+          }
+          if (ec) {
+            Log::error("[{}] | http-proxy handshake read response body error: {}", tag_, ec.message());
+            throw std::system_error(ec);
+          }
+          body_received += bytes_read;
+        }
+        if (body_received != *content_length) {
+          Log::error("[{}] | http-proxy handshake failed unexpected data after 407 response", tag_);
+          throw std::runtime_error("bad HTTP response");
+        }
+        Log::debug("[{}] | http-proxy handshake retry with credentials after 407", tag_);
+        authenticate = true;
+        continue;
+      }
+      if (status_code != 200) {
+        Log::error("[{}] | http-proxy handshake failed response status_code: {}", tag_, status_code);
+        throw std::runtime_error("HTTP connect failed");
+      }
+      if (challenge_expected && early_data.size() > 0) {
+        // The proxy accepted the request without asking for credentials, so
+        // the early data held back for the retry goes out now.
+        Log::trace("[{}] | http-proxy handshake writing {} bytes of held back client data", tag_, early_data.size());
+        auto [ec, bytes_written] = co_await asio::async_write(server, early_data,
+          asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+        if (watchdog.is_expired()) {
+          Log::error("[{}] | http-proxy handshake write client data timeout", tag_);
+          throw std::system_error(std::make_error_code(std::errc::timed_out));
+        }
+        if (ec) {
+          Log::error("[{}] | http-proxy handshake write client data error: {}", tag_, ec.message());
+          throw std::system_error(ec);
+        }
+      }
+      Log::debug("[{}] | http-proxy handshake success", tag_);
+      co_return std::string(response_header.data() + parser.header_size(), bytes_received - parser.header_size());
+    }
+  }
+
+  // Like http_proxy_handshake, returns the payload that followed the reply.
+  asio::awaitable<std::string> socks5_handshake(asio::ip::tcp::socket &server, const Socks5ConnectRequest &request,
+      std::chrono::steady_clock::time_point handshake_deadline) {
+    Log::debug("[{}] | socks5 handshake CONNECT {}", tag_, request.authority());
+    auto executor = co_await asio::this_coro::executor;
+    Watchdog watchdog(executor);
+    watchdog.expires_at(handshake_deadline);
+    auto [write_error, bytes_written] = co_await asio::async_write(server, request.buffer(),
+      asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+    if (watchdog.is_expired()) {
+      Log::error("[{}] | socks5 handshake write request timeout", tag_);
+      throw std::system_error(std::make_error_code(std::errc::timed_out));
+    }
+    if (write_error) {
+      Log::error("[{}] | socks5 handshake write request error: {}", tag_, write_error.message());
+      throw std::system_error(write_error);
+    }
+    // The replies to the pipelined greeting, authentication and CONNECT come
+    // back to back. Each one is checked as soon as it is complete, so that a
+    // proxy that rejects and closes is reported as a rejection.
+    enum class Step {
+      method,
+      authentication,
+      connect,
+      bound_address,
+    };
+    std::array<std::uint8_t, kSocks5MaxReplySize> reply;
+    std::size_t bytes_received = 0;
+    std::size_t connect_reply = request.authenticate() ? 4 : 2;
+    auto step = Step::method;
+    std::size_t reply_size = 2;
+    for (;;) {
+      while (bytes_received < reply_size) {
+        auto [ec, bytes_read] = co_await server.async_read_some(asio::buffer(reply.data() + bytes_received, reply.size() - bytes_received),
+          asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+        if (watchdog.is_expired()) {
+          Log::error("[{}] | socks5 handshake read reply timeout", tag_);
+          throw std::system_error(std::make_error_code(std::errc::timed_out));
+        }
+        if (ec) {
+          Log::error("[{}] | socks5 handshake read reply error: {}", tag_, ec.message());
+          throw std::system_error(ec);
+        }
+        bytes_received += bytes_read;
+      }
+      if (step == Step::method) {
+        if (reply[0] != 0x05 || reply[1] != (request.authenticate() ? 0x02 : 0x00)) {
+          Log::error("[{}] | socks5 handshake failed no acceptable authentication method", tag_);
+          throw std::runtime_error("SOCKS5 no acceptable authentication method");
+        }
+        step = request.authenticate() ? Step::authentication : Step::connect;
+        // Up to the first address byte, which is enough to know the full size.
+        reply_size = request.authenticate() ? 4 : connect_reply + 5;
+      } else if (step == Step::authentication) {
+        if (reply[3] != 0x00) {
+          Log::error("[{}] | socks5 handshake failed authentication rejected", tag_);
+          throw std::runtime_error("SOCKS5 authentication failed");
+        }
+        step = Step::connect;
+        reply_size = connect_reply + 5;
+      } else if (step == Step::connect) {
+        if (reply[connect_reply] != 0x05 || reply[connect_reply + 1] != 0x00) {
+          Log::error("[{}] | socks5 handshake failed reply code: {}", tag_, reply[connect_reply + 1]);
+          throw std::runtime_error("SOCKS5 connect failed");
+        }
+        switch (reply[connect_reply + 3]) {
+          case 0x01:
+            reply_size = connect_reply + 4 + 4 + 2;
+            break;
+          case 0x03:
+            reply_size = connect_reply + 4 + 1 + reply[connect_reply + 4] + 2;
+            break;
+          case 0x04:
+            reply_size = connect_reply + 4 + 16 + 2;
+            break;
+          default:
+            Log::error("[{}] | socks5 handshake failed bad address type", tag_);
+            throw std::runtime_error("bad SOCKS5 reply");
+        }
+        step = Step::bound_address;
+      } else {
+        break;
+      }
+    }
+    Log::debug("[{}] | socks5 handshake success", tag_);
+    co_return std::string(reinterpret_cast<const char *>(reply.data()) + reply_size, bytes_received - reply_size);
+  }
+
+  // Runs each hop's handshake over the tunnel opened by the previous one. All
+  // hops share one handshake deadline, still bounded by the connect deadline.
+  // Early data is sent with the last hop, and only if that is an http proxy.
+  asio::awaitable<std::string> proxy_handshake(asio::ip::tcp::socket &server, const ProxyChain &chain,
+      asio::const_buffer early_data = {}) {
+    auto handshake_deadline = std::min(std::chrono::steady_clock::now() + std::chrono::seconds(kProxyHandshakeTimeout), deadline_);
+    std::string pending_downlink;
+    for (std::size_t hop = 0; hop < chain.size(); ++hop) {
+      bool last_hop = hop + 1 == chain.size();
+      auto start_time = std::chrono::steady_clock::now();
+      if (const auto *http_request = std::get_if<HttpConnectRequest>(&chain[hop])) {
+        pending_downlink = co_await http_proxy_handshake(server, *http_request, last_hop ? early_data : asio::const_buffer(), handshake_deadline);
+      } else {
+        pending_downlink = co_await socks5_handshake(server, std::get<Socks5ConnectRequest>(chain[hop]), handshake_deadline);
+      }
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time);
+      Metrics::proxy_hop_handshake_time(hop).record(elapsed);
+      Log::trace("[{}] | proxy hop {} handshake done in {}us", tag_, hop + 1, elapsed.count());
+      if (!last_hop && !pending_downlink.empty()) {
+        Log::error("[{}] | proxy hop {} sent data before the tunnel was complete", tag_, hop + 1);
+        throw std::runtime_error("unexpected data from proxy");
+      }
+    }
+    co_return pending_downlink;
+  }
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return deadline_;
+  }
+
+private:
+  void arm(Watchdog &watchdog, const std::chrono::seconds &step_timeout) const {
+    watchdog.expires_at(std::min(std::chrono::steady_clock::now() + step_timeout, deadline_));
+  }
+
+  std::string tag_;
+  std::chrono::steady_clock::time_point deadline_ = std::chrono::steady_clock::time_point::max();
+};
+
+class Http2Stream;
+
+// An upstream socket ready to carry client data, plus payload that already
+// arrived from the target during the handshake and still has to reach the
+// client. With an HTTP/2 proxy the tunnel is a stream and the socket is unused.
+struct Tunnel {
+  asio::ip::tcp::socket socket;
+  std::string pending_downlink;
+  std::shared_ptr<Http2Stream> stream;
+};
+
+struct UpstreamPoolOptions {
+  std::size_t size;
+  std::uint32_t idle_timeout;
+  std::uint32_t refill_rate;
+};
+
+// Keeps a number of idle, already connected sockets to the upstream server so
+// that new sessions can skip the resolve and TCP handshake. When a tunnel
+// request is given the sockets are also tunneled through the proxy.
+class UpstreamPool : public std::enable_shared_from_this<UpstreamPool> {
+public:
+  UpstreamPool(const asio::any_io_executor &executor, const AddressType &server_address,
+      std::shared_ptr<const ProxyChain> proxy_chain, const UpstreamPoolOptions &options)
+    : executor_(executor), timer_(executor), server_address_(server_address), proxy_chain_(std::move(proxy_chain)), options_(options) {}
+
+  void start() {
+    asio::co_spawn(executor_, [self = shared_from_this()]() -> asio::awaitable<void> {
+      co_await self->refill();
+    }, asio::detached);
+  }
+
+  std::optional<Tunnel> acquire() {
+    auto now = std::chrono::steady_clock::now();
+    while (!idle_.empty()) {
+      auto entry = std::move(idle_.back());
+      idle_.pop_back();
+      if (now - entry.idle_since >= std::chrono::seconds(options_.idle_timeout)) {
+        Metrics::upstream_pool_expired.add();
+        continue;
+      }
+      if (!is_alive(entry.socket)) {
+        Metrics::upstream_pool_dead.add();
+        continue;
+      }
+      Metrics::upstream_pool_hits.add();
+      wake_up();
+      return Tunnel{std::move(entry.socket), std::move(entry.pending_downlink), nullptr};
+    }
+    Metrics::upstream_pool_misses.add();
+    wake_up();
+    return std::nullopt;
+  }
+
+private:
+  struct Entry {
+    asio::ip::tcp::socket socket;
+    std::chrono::steady_clock::time_point idle_since;
+    std::string pending_downlink;
+  };
+
+  asio::awaitable<void> refill() {
+    UpstreamConnector connector("pool");
+    std::uint32_t consecutive_failures = 0;
+    auto next_attempt = std::chrono::steady_clock::now();
+    for (;;) {
+      evict_expired();
+      if (idle_.size() < options_.size) {
+        if (std::chrono::steady_clock::now() < next_attempt) {
+          timer_.expires_at(next_attempt);
+          co_await timer_.async_wait(asio::as_tuple(asio::use_awaitable));
+          continue;
+        }
+        next_attempt = std::chrono::steady_clock::now() + std::chrono::microseconds(1000000 / options_.refill_rate);
+        bool connected = false;
+        try {
+          auto socket = co_await connector.connect(server_address_);
+          std::string pending_downlink;
+          if (proxy_chain_) {
+            pending_downlink = co_await connector.proxy_handshake(socket, *proxy_chain_);
+          }
+          idle_.push_back({std::move(socket), std::chrono::steady_clock::now(), std::move(pending_downlink)});
+          connected = true;
+          Log::trace("[pool] | {} idle connections", idle_.size());
+        } catch (std::exception &) {
+        }
+        if (connected) {
+          consecutive_failures = 0;
+        } else {
+          Metrics::upstream_pool_failures.add();
+          // Back off exponentially so a dead upstream is not hammered by the pool.
+          auto backoff = std::chrono::seconds(std::min(kPoolMaxRetryInterval, kPoolRetryInterval << std::min(consecutive_failures, 16u)));
+          ++consecutive_failures;
+          Log::debug("[pool] | refill failed {} times in a row, retry in {}s", consecutive_failures, backoff.count());
+          next_attempt = std::chrono::steady_clock::now() + backoff;
+        }
+        continue;
+      }
+      // Full: sleep until the oldest entry expires or a session takes one.
+      waiting_for_demand_ = true;
+      timer_.expires_at(idle_.front().idle_since + std::chrono::seconds(options_.idle_timeout));
+      co_await timer_.async_wait(asio::as_tuple(asio::use_awaitable));
+      waiting_for_demand_ = false;
+    }
+  }
+
+  void evict_expired() {
+    auto now = std::chrono::steady_clock::now();
+    while (!idle_.empty() && now - idle_.front().idle_since >= std::chrono::seconds(options_.idle_timeout)) {
+      idle_.pop_front();
+      Metrics::upstream_pool_expired.add();
+    }
+  }
+
+  void wake_up() {
+    if (waiting_for_demand_) {
+      timer_.cancel();
+    }
+  }
+
+  // An idle upstream socket must not have been closed by the peer. Unsolicited
+  // data (e.g. a server greeting) is fine, it will be relayed to the client.
+  // Leaves the socket in the blocking mode it was in.
+  static bool is_alive(asio::ip::tcp::socket &socket) {
+    std::array<char, 1> buffer;
+    asio::error_code ec;
+    auto was_non_blocking = socket.non_blocking();
+    socket.non_blocking(true, ec);
+    if (ec) {
+      return false;
+    }
+    auto bytes_read = socket.receive(asio::buffer(buffer), asio::socket_base::message_peek, ec);
+    asio::error_code restore_ec;
+    socket.non_blocking(was_non_blocking, restore_ec);
+    if (restore_ec) {
+      return false;
+    }
+    if (ec == asio::error::would_block) {
+      return true;
+    }
+    return !ec && bytes_read > 0;
+  }
+
+  asio::any_io_executor executor_;
+  asio::steady_timer timer_;
+  AddressType server_address_;
+  std::shared_ptr<const ProxyChain> proxy_chain_;
+  UpstreamPoolOptions options_;
+  std::deque<Entry> idle_;
+  bool waiting_for_demand_ = false;
+};
+
+// HPACK (RFC 7541) decoder for the response headers of the HTTP/2 proxy. Every
+// header block must be decoded, even for streams that are already gone, to
+// keep the dynamic table in sync with the proxy.
+class HpackDecoder {
+public:
+  using Header = std::pair<std::string, std::string>;
+
+  // Returns false on a malformed block, which is fatal for the connection.
+  bool decode(std::string_view block, std::vector<Header> &headers) {
+    std::size_t pos = 0;
+    while (pos < block.size()) {
+      auto byte = static_cast<std::uint8_t>(block[pos]);
+      if (byte & 0x80) {
+        std::uint64_t index;
+        if (!decode_integer(block, pos, 7, index)) {
+          return false;
+        }
+        const auto *header = lookup(index);
+        if (!header) {
+          return false;
+        }
+        headers.push_back(*header);
+      } else if ((byte & 0xe0) == 0x20) {
+        std::uint64_t size;
+        if (!decode_integer(block, pos, 5, size) || size > kHpackMaxTableSize) {
+          return false;
+        }
+        max_table_size_ = size;
+        evict(0);
+      } else {
+        bool indexing = byte & 0x40;
+        std::uint64_t index;
+        if (!decode_integer(block, pos, indexing ? 6 : 4, index)) {
+          return false;
+        }
+        Header header;
+        if (index == 0) {
+          if (!decode_string(block, pos, header.first)) {
+            return false;
+          }
+        } else {
+          const auto *name = lookup(index);
+          if (!name) {
+            return false;
+          }
+          header.first = name->first;
+        }
+        if (!decode_string(block, pos, header.second)) {
+          return false;
+        }
+        if (indexing) {
+          insert(header);
+        }
+        headers.push_back(std::move(header));
+      }
+    }
+    return true;
+  }
+
+private:
+  struct HuffmanNode {
+    std::array<std::uint16_t, 2> children = {0, 0};
+    std::int16_t symbol = -1;
+  };
+
+  static bool decode_integer(std::string_view block, std::size_t &pos, unsigned prefix_bits, std::uint64_t &value) {
+    if (pos >= block.size()) {
+      return false;
+    }
+    std::uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = static_cast<std::uint8_t>(block[pos++]) & max_prefix;
+    if (value < max_prefix) {
+      return true;
+    }
+    for (unsigned shift = 0; pos < block.size() && shift < 56; shift += 7) {
+      auto byte = static_cast<std::uint8_t>(block[pos++]);
+      value += static_cast<std::uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool decode_string(std::string_view block, std::size_t &pos, std::string &value) {
+    if (pos >= block.size()) {
+      return false;
+    }
+    bool huffman = block[pos] & 0x80;
+    std::uint64_t length;
+    if (!decode_integer(block, pos, 7, length) || length > block.size() - pos) {
+      return false;
+    }
+    auto data = block.substr(pos, length);
+    pos += length;
+    if (!huffman) {
+      value.assign(data);
+      return true;
+    }
+    return huffman_decode(data, value);
+  }
+
+  // Walks the code tree bit by bit. Trailing padding must be the most
+  // significant bits of EOS (all ones) and shorter than a byte.
+  static bool huffman_decode(std::string_view data, std::string &value) {
+    const auto &tree = huffman_tree();
+    std::size_t node = 0;
+    unsigned pending_bits = 0;
+    bool all_ones = true;
+    for (char c : data) {
+      for (int bit = 7; bit >= 0; --bit) {
+        bool one = (static_cast<std::uint8_t>(c) >> bit) & 1;
+        node = tree[node].children[one];
+        if (node == 0) {
+          return false;
+        }
+        ++pending_bits;
+        all_ones = all_ones && one;
+        if (tree[node].symbol >= 0) {
+          value += static_cast<char>(tree[node].symbol);
+          node = 0;
+          pending_bits = 0;
+          all_ones = true;
+        }
+      }
+    }
+    return pending_bits < 8 && all_ones;
+  }
+
+  static const std::vector<HuffmanNode> &huffman_tree() {
+    static const std::vector<HuffmanNode> s_tree = [] {
+      std::vector<HuffmanNode> tree(1);
+      for (std::size_t symbol = 0; symbol < kHuffmanCodes.size(); ++symbol) {
+        auto [code, length] = kHuffmanCodes[symbol];
+        std::size_t node = 0;
+        for (int bit = length - 1; bit >= 0; --bit) {
+          auto branch = (code >> bit) & 1;
+          if (tree[node].children[branch] == 0) {
+            tree[node].children[branch] = static_cast<std::uint16_t>(tree.size());
+            tree.emplace_back();
+          }
+          node = tree[node].children[branch];
+        }
+        tree[node].symbol = static_cast<std::int16_t>(symbol);
+      }
+      return tree;
+    }();
+    return s_tree;
+  }
+
+  const Header *lookup(std::uint64_t index) const {
+    static const std::array<Header, 61> kStaticTable = {{
+      {":authority", ""},
+      {":method", "GET"},
+      {":method", "POST"},
+      {":path", "/"},
+      {":path", "/index.html"},
+      {":scheme", "http"},
+      {":scheme", "https"},
+      {":status", "200"},
+      {":status", "204"},
+      {":status", "206"},
+      {":status", "304"},
+      {":status", "400"},
+      {":status", "404"},
+      {":status", "500"},
+      {"accept-charset", ""},
+      {"accept-encoding", "gzip, deflate"},
+      {"accept-language", ""},
+      {"accept-ranges", ""},
+      {"accept", ""},
+      {"access-control-allow-origin", ""},
+      {"age", ""},
+      {"allow", ""},
+      {"authorization", ""},
+      {"cache-control", ""},
+      {"content-disposition", ""},
+      {"content-encoding", ""},
+      {"content-language", ""},
+      {"content-length", ""},
+      {"content-location", ""},
+      {"content-range", ""},
+      {"content-type", ""},
+      {"cookie", ""},
+      {"date", ""},
+      {"etag", ""},
+      {"expect", ""},
+      {"expires", ""},
+      {"from", ""},
+      {"host", ""},
+      {"if-match", ""},
+      {"if-modified-since", ""},
+      {"if-none-match", ""},
+      {"if-range", ""},
+      {"if-unmodified-since", ""},
+      {"last-modified", ""},
+      {"link", ""},
+      {"location", ""},
+      {"max-forwards", ""},
+      {"proxy-authenticate", ""},
+      {"proxy-authorization", ""},
+      {"range", ""},
+      {"referer", ""},
+      {"refresh", ""},
+      {"retry-after", ""},
+      {"server", ""},
+      {"set-cookie", ""},
+      {"strict-transport-security", ""},
+      {"transfer-encoding", ""},
+      {"user-agent", ""},
+      {"vary", ""},
+      {"via", ""},
+      {"www-authenticate", ""},
+    }};
+    if (index == 0) {
+      return nullptr;
+    }
+    if (index <= kStaticTable.size()) {
+      return &kStaticTable[index - 1];
+    }
+    index -= kStaticTable.size() + 1;
+    return index < dynamic_table_.size() ? &dynamic_table_[index] : nullptr;
+  }
+
+  void insert(const Header &header) {
+    auto size = entry_size(header);
+    evict(size);
+    if (size <= max_table_size_) {
+      dynamic_table_.push_front(header);
+      table_size_ += size;
+    }
+  }
+
+  // Drops the oldest entries until `incoming` more bytes fit.
+  void evict(std::size_t incoming) {
+    while (!dynamic_table_.empty() && table_size_ + incoming > max_table_size_) {
+      table_size_ -= entry_size(dynamic_table_.back());
+      dynamic_table_.pop_back();
+    }
+  }
+
+  static std::size_t entry_size(const Header &header) {
+    return header.first.size() + header.second.size() + 32;
+  }
+
+  static constexpr std::array<std::pair<std::uint32_t, std::uint8_t>, 256> kHuffmanCodes = {{
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+  }};
+
+  std::deque<Header> dynamic_table_;
+  std::size_t table_size_ = 0;
+  std::size_t max_table_size_ = kHpackMaxTableSize;
+};
+
+// HPACK header block of the CONNECT request for one target, encoded once when
+// the configuration is loaded. All fields are literals without indexing, so
+// the proxy's view of our (empty) dynamic table never changes.
+class Http2ConnectRequest {
+public:
+  // `headers` are HTTP/1 style "Name: value" lines; connection-specific ones
+  // are not allowed in HTTP/2 and are dropped.
+  Http2ConnectRequest(const AddressType &target_address, const std::vector<std::string> &headers) {
+    if (std::get<0>(target_address).find(':') != std::string::npos) {
+      authority_ = stdx::format("[{}]:{}", std::get<0>(target_address), std::get<1>(target_address));
+    } else {
+      authority_ = stdx::format("{}:{}", std::get<0>(target_address), std::get<1>(target_address));
+    }
+    encode_literal(kMethodIndex, "", "CONNECT");
+    encode_literal(kAuthorityIndex, "", authority_);
+    for (const auto &line : headers) {
+      auto colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; });
+      if (name == "connection" || name == "proxy-connection" || name == "keep-alive" || name == "transfer-encoding" || name == "upgrade") {
+        continue;
+      }
+      auto value_begin = line.find_first_not_of(" \t", colon + 1);
+      auto value_end = line.find_last_not_of(" \t\r\n");
+      encode_literal(0, name, value_begin == std::string::npos || value_end < value_begin ? std::string_view() :
+        std::string_view(line).substr(value_begin, value_end - value_begin + 1));
+    }
+  }
+
+  const std::string &authority() const {
+    return authority_;
+  }
+
+  const std::string &header_block() const {
+    return header_block_;
+  }
+
+private:
+  static constexpr std::uint64_t kAuthorityIndex = 1;
+  static constexpr std::uint64_t kMethodIndex = 2;
+
+  void encode_integer(std::uint8_t first_byte, unsigned prefix_bits, std::uint64_t value) {
+    std::uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+      header_block_ += static_cast<char>(first_byte | value);
+      return;
+    }
+    header_block_ += static_cast<char>(first_byte | max_prefix);
+    for (value -= max_prefix; value >= 0x80; value >>= 7) {
+      header_block_ += static_cast<char>((value & 0x7f) | 0x80);
+    }
+    header_block_ += static_cast<char>(value);
+  }
+
+  // Literal header field without indexing (RFC 7541 6.2.2), name taken from
+  // the static table when `name_index` is set.
+  void encode_literal(std::uint64_t name_index, std::string_view name, std::string_view value) {
+    encode_integer(0x00, 4, name_index);
+    if (name_index == 0) {
+      encode_integer(0x00, 7, name.size());
+      header_block_ += name;
+    }
+    encode_integer(0x00, 7, value.size());
+    header_block_ += value;
+  }
+
+  std::string authority_;
+  std::string header_block_;
+};
+
+class Http2Connection;
+
+// One tunnel (CONNECT stream) on a multiplexed HTTP/2 connection to the proxy.
+// Received data is buffered per stream and the receive window is only handed
+// back once the session has taken the data out, so a slow client pushes back
+// to the target through HTTP/2 flow control, like a full socket buffer would.
+class Http2Stream {
+public:
+  Http2Stream(std::shared_ptr<Http2Connection> connection, std::uint32_t id, std::int64_t send_window);
+  ~Http2Stream();
+
+  Http2Stream(const Http2Stream &) = delete;
+  Http2Stream &operator=(const Http2Stream &) = delete;
+
+  std::uint32_t id() const {
+    return id_;
+  }
+
+  // Waits for the response HEADERS; a 2xx status opens the tunnel.
+  asio::awaitable<void> wait_for_response(std::chrono::steady_clock::time_point deadline);
+
+  // Same completion values as the socket operations used by the relay loop.
+  asio::awaitable<std::tuple<asio::error_code, std::size_t>> async_read_some(asio::mutable_buffer buffer);
+  asio::awaitable<std::tuple<asio::error_code, std::size_t>> async_write_some(asio::const_buffer buffer);
+
+private:
+  friend class Http2Connection;
+
+  void fail(const asio::error_code &ec) {
+    if (!error_) {
+      error_ = ec;
+    }
+    read_timer_.cancel();
+    write_timer_.cancel();
+  }
+
+  std::shared_ptr<Http2Connection> connection_;
+  std::uint32_t id_;
+  asio::steady_timer read_timer_;
+  asio::steady_timer write_timer_;
+  std::deque<std::string> inbound_;
+  std::size_t inbound_offset_ = 0;
+  std::size_t inbound_size_ = 0;
+  std::uint32_t status_code_ = 0;
+  bool remote_closed_ = false;
+  asio::error_code error_;
+  std::int64_t send_window_;
+  std::int64_t receive_window_ = kHttp2StreamWindow;
+  std::size_t unacked_ = 0;
+};
+
+// Client side of a cleartext (prior knowledge) HTTP/2 connection to the proxy.
+// A reader coroutine dispatches frames to the streams; a writer coroutine
+// flushes everything queued since its last write in one go.
+class Http2Connection : public std::enable_shared_from_this<Http2Connection> {
+public:
+  explicit Http2Connection(asio::ip::tcp::socket socket)
+    : socket_(std::move(socket)), write_timer_(socket_.get_executor()),
+      tag_(stdx::format("http2: {}", endpoint_to_string(socket_.local_endpoint()))) {}
+
+  void start() {
+    static constexpr std::string_view kPreface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    outbound_ += kPreface;
+    std::string settings;
+    append_setting(settings, kSettingsEnablePush, 0);
+    append_setting(settings, kSettingsInitialWindowSize, kHttp2StreamWindow);
+    queue_frame(FrameType::settings, 0, 0, settings);
+    std::string increment;
+    append_uint32(increment, kHttp2ConnectionWindow - kHttp2DefaultWindow);
+    queue_frame(FrameType::window_update, 0, 0, increment);
+    asio::co_spawn(socket_.get_executor(), [self = shared_from_this()]() -> asio::awaitable<void> {
+      co_await self->read_loop();
+    }, asio::detached);
+    asio::co_spawn(socket_.get_executor(), [self = shared_from_this()]() -> asio::awaitable<void> {
+      co_await self->write_loop();
+    }, asio::detached);
+  }
+
+  bool is_usable() const {
+    return !closed_ && !going_away_ && next_stream_id_ <= kMaxStreamId;
+  }
+
+  bool has_capacity() const {
+    return streams_.size() < max_concurrent_streams_;
+  }
+
+  std::size_t active_streams() const {
+    return streams_.size();
+  }
+
+  std::shared_ptr<Http2Stream> open_stream(const Http2ConnectRequest &request) {
+    auto stream = std::make_shared<Http2Stream>(shared_from_this(), next_stream_id_, peer_initial_window_);
+    next_stream_id_ += 2;
+    streams_.emplace(stream->id(), stream.get());
+    std::string_view block = request.header_block();
+    auto type = FrameType::headers;
+    do {
+      auto fragment = block.substr(0, peer_max_frame_size_);
+      block.remove_prefix(fragment.size());
+      queue_frame(type, block.empty() ? kFlagEndHeaders : 0, stream->id(), fragment);
+      type = FrameType::continuation;
+    } while (!block.empty());
+    Log::trace("[{}] | open stream {} CONNECT {}", tag_, stream->id(), request.authority());
+    return stream;
+  }
+
+private:
+  friend class Http2Stream;
+
+  enum class FrameType : std::uint8_t {
+    data = 0x0,
+    headers = 0x1,
+    priority = 0x2,
+    rst_stream = 0x3,
+    settings = 0x4,
+    push_promise = 0x5,
+    ping = 0x6,
+    goaway = 0x7,
+    window_update = 0x8,
+    continuation = 0x9,
+  };
+
+  static constexpr std::uint8_t kFlagEndStream = 0x1;
+  static constexpr std::uint8_t kFlagAck = 0x1;
+  static constexpr std::uint8_t kFlagEndHeaders = 0x4;
+  static constexpr std::uint8_t kFlagPadded = 0x8;
+  static constexpr std::uint8_t kFlagPriority = 0x20;
+  static constexpr std::uint16_t kSettingsEnablePush = 0x2;
+  static constexpr std::uint16_t kSettingsMaxConcurrentStreams = 0x3;
+  static constexpr std::uint16_t kSettingsInitialWindowSize = 0x4;
+  static constexpr std::uint16_t kSettingsMaxFrameSize = 0x5;
+  static constexpr std::uint32_t kErrorProtocol = 0x1;
+  static constexpr std::uint32_t kErrorFlowControl = 0x3;
+  static constexpr std::uint32_t kErrorCancel = 0x8;
+  static constexpr std::uint32_t kHttp2DefaultWindow = 65535;
+  static constexpr std::uint32_t kMaxStreamId = 0x7fffffff;
+
+  static void append_uint32(std::string &out, std::uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+  }
+
+  static void append_setting(std::string &out, std::uint16_t id, std::uint32_t value) {
+    out += static_cast<char>(id >> 8);
+    out += static_cast<char>(id);
+    append_uint32(out, value);
+  }
+
+  static std::uint32_t read_uint32(const char *data) {
+    return static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[0])) << 24 | static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[1])) << 16 |
+      static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[2])) << 8 | static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[3]));
+  }
+
+  void queue_frame(FrameType type, std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    auto length = static_cast<std::uint32_t>(payload.size());
+    outbound_ += static_cast<char>(length >> 16);
+    outbound_ += static_cast<char>(length >> 8);
+    outbound_ += static_cast<char>(length);
+    outbound_ += static_cast<char>(type);
+    outbound_ += static_cast<char>(flags);
+    append_uint32(outbound_, stream_id);
+    outbound_ += payload;
+    write_timer_.cancel();
+  }
+
+  void queue_rst_stream(std::uint32_t stream_id, std::uint32_t error_code) {
+    std::string payload;
+    append_uint32(payload, error_code);
+    queue_frame(FrameType::rst_stream, 0, stream_id, payload);
+  }
+
+  void queue_window_update(std::uint32_t stream_id, std::uint32_t increment) {
+    std::string payload;
+    append_uint32(payload, increment);
+    queue_frame(FrameType::window_update, 0, stream_id, payload);
+  }
+
+  asio::awaitable<void> write_loop() {
+    std::string writing;
+    while (!closed_) {
+      if (outbound_.empty()) {
+        write_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+        co_await write_timer_.async_wait(asio::as_tuple(asio::use_awaitable));
+        continue;
+      }
+      writing.clear();
+      std::swap(writing, outbound_);
+      auto [ec, bytes_written] = co_await asio::async_write(socket_, asio::buffer(writing), asio::as_tuple(asio::use_awaitable));
+      if (ec) {
+        Log::debug("[{}] | write error: {}", tag_, ec.message());
+        close(ec);
+      }
+      if (write_blocked_ && outbound_.size() < kHttp2MaxPendingWrite) {
+        write_blocked_ = false;
+        for (auto &[id, stream] : streams_) {
+          stream->write_timer_.cancel();
+        }
+      }
+    }
+  }
+
+  asio::awaitable<void> read_loop() {
+    std::vector<char> buffer(64 * 1024);
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    for (;;) {
+      // Reads as much as the socket has, so small frames don't cost a read each.
+      std::size_t needed = kFrameHeaderSize;
+      if (end - begin >= kFrameHeaderSize) {
+        needed += static_cast<std::uint8_t>(buffer[begin]) << 16 | static_cast<std::uint8_t>(buffer[begin + 1]) << 8 | static_cast<std::uint8_t>(buffer[begin + 2]);
+        if (needed > kFrameHeaderSize + kHttp2MaxFrameSize) {
+          Log::error("[{}] | frame too large", tag_);
+          close(asio::error::connection_aborted);
+          co_return;
+        }
+      }
+      if (end - begin < needed) {
+        if (buffer.size() - begin < needed) {
+          std::copy(buffer.begin() + begin, buffer.begin() + end, buffer.begin());
+          end -= begin;
+          begin = 0;
+        }
+        auto [ec, bytes_read] = co_await socket_.async_read_some(asio::buffer(buffer.data() + end, buffer.size() - end), asio::as_tuple(asio::use_awaitable));
+        if (ec) {
+          if (!closed_) {
+            Log::debug("[{}] | read error: {}", tag_, ec.message());
+          }
+          close(ec);
+          co_return;
+        }
+        end += bytes_read;
+        continue;
+      }
+      const char *frame = buffer.data() + begin;
+      begin += needed;
+      auto type = static_cast<FrameType>(frame[3]);
+      auto flags = static_cast<std::uint8_t>(frame[4]);
+      auto stream_id = read_uint32(frame + 5) & kMaxStreamId;
+      if (!handle_frame(type, flags, stream_id, std::string_view(frame + kFrameHeaderSize, needed - kFrameHeaderSize))) {
+        close(asio::error::connection_aborted);
+        co_return;
+      }
+    }
+  }
+
+  // Returns false on a connection error.
+  bool handle_frame(FrameType type, std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    if (continuation_stream_ != 0 && (type != FrameType::continuation || stream_id != continuation_stream_)) {
+      Log::error("[{}] | expected CONTINUATION for stream {}", tag_, continuation_stream_);
+      return false;
+    }
+    switch (type) {
+      case FrameType::data:
+        return handle_data(flags, stream_id, payload);
+      case FrameType::headers:
+        if (stream_id == 0 || !strip_padding(flags, payload)) {
+          return false;
+        }
+        if (flags & kFlagPriority) {
+          if (payload.size() < 5) {
+            return false;
+          }
+          payload.remove_prefix(5);
+        }
+        header_block_.assign(payload);
+        header_end_stream_ = flags & kFlagEndStream;
+        continuation_stream_ = stream_id;
+        return !(flags & kFlagEndHeaders) || handle_header_block();
+      case FrameType::continuation:
+        if (continuation_stream_ == 0) {
+          return false;
+        }
+        if (header_block_.size() + payload.size() > kHttp2MaxHeaderBlockSize) {
+          Log::error("[{}] | header block on stream {} too large", tag_, continuation_stream_);
+          return false;
+        }
+        header_block_ += payload;
+        return !(flags & kFlagEndHeaders) || handle_header_block();
+      case FrameType::rst_stream:
+        if (stream_id == 0 || payload.size() != 4) {
+          return false;
+        }
+        if (auto it = streams_.find(stream_id); it != streams_.end()) {
+          Log::debug("[{}] | stream {} reset by proxy, error code {}", tag_, stream_id, read_uint32(payload.data()));
+          it->second->fail(asio::error::connection_reset);
+        }
+        return true;
+      case FrameType::settings:
+        return handle_settings(flags, stream_id, payload);
+      case FrameType::ping:
+        if (stream_id != 0 || payload.size() != 8) {
+          return false;
+        }
+        if (!(flags & kFlagAck)) {
+          queue_frame(FrameType::ping, kFlagAck, 0, payload);
+        }
+        return true;
+      case FrameType::goaway: {
+        if (stream_id != 0 || payload.size() < 8) {
+          return false;
+        }
+        auto last_stream_id = read_uint32(payload.data()) & kMaxStreamId;
+        Log::info("[{}] | proxy going away, last stream {}, error code {}", tag_, last_stream_id, read_uint32(payload.data() + 4));
+        going_away_ = true;
+        for (auto &[id, stream] : streams_) {
+          if (id > last_stream_id) {
+            stream->fail(asio::error::connection_aborted);
+          }
+        }
+        if (streams_.empty()) {
+          close(asio::error::connection_aborted);
+        }
+        return true;
+      }
+      case FrameType::window_update: {
+        if (payload.size() != 4) {
+          return false;
+        }
+        // A zero increment is a PROTOCOL_ERROR and a window past 2^31-1 a
+        // FLOW_CONTROL_ERROR, for the connection or the stream (RFC 9113 6.9).
+        auto increment = read_uint32(payload.data()) & kMaxStreamId;
+        if (stream_id == 0) {
+          if (increment == 0 || send_window_ + increment > kMaxStreamId) {
+            Log::error("[{}] | bad connection WINDOW_UPDATE increment {}", tag_, increment);
+            return false;
+          }
+          send_window_ += increment;
+          for (auto &[id, stream] : streams_) {
+            stream->write_timer_.cancel();
+          }
+        } else if (auto it = streams_.find(stream_id); it != streams_.end()) {
+          auto &stream = *it->second;
+          if (increment == 0 || stream.send_window_ + increment > kMaxStreamId) {
+            Log::error("[{}] | bad WINDOW_UPDATE increment {} on stream {}", tag_, increment, stream_id);
+            queue_rst_stream(stream_id, increment == 0 ? kErrorProtocol : kErrorFlowControl);
+            stream.fail(asio::error::connection_reset);
+            return true;
+          }
+          stream.send_window_ += increment;
+          stream.write_timer_.cancel();
+        }
+        return true;
+      }
+      case FrameType::push_promise:
+        // Push is disabled in our SETTINGS.
+        return false;
+      default:
+        return true;
+    }
+  }
+
+  bool handle_data(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    if (stream_id == 0) {
+      return false;
+    }
+    auto frame_size = payload.size();
+    if (!strip_padding(flags, payload)) {
+      return false;
+    }
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end() || it->second->remote_closed_ || it->second->error_) {
+      // Nobody will read it, hand the window back right away.
+      consume_connection(frame_size);
+      return true;
+    }
+    auto &stream = *it->second;
+    stream.receive_window_ -= frame_size;
+    if (stream.receive_window_ < 0) {
+      Log::error("[{}] | stream {} exceeded its flow control window", tag_, stream_id);
+      queue_rst_stream(stream_id, kErrorFlowControl);
+      stream.fail(asio::error::connection_reset);
+      consume_connection(frame_size);
+      return true;
+    }
+    if (!payload.empty()) {
+      stream.inbound_.emplace_back(payload);
+      stream.inbound_size_ += payload.size();
+    }
+    if (flags & kFlagEndStream) {
+      stream.remote_closed_ = true;
+    }
+    stream.read_timer_.cancel();
+    if (frame_size > payload.size()) {
+      consume(stream, frame_size - payload.size());
+    }
+    return true;
+  }
+
+  bool handle_header_block() {
+    auto stream_id = continuation_stream_;
+    continuation_stream_ = 0;
+    std::vector<HpackDecoder::Header> headers;
+    if (!decoder_.decode(header_block_, headers)) {
+      Log::error("[{}] | bad header block on stream {}", tag_, stream_id);
+      return false;
+    }
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end()) {
+      return true;
+    }
+    auto &stream = *it->second;
+    if (stream.status_code_ == 0) {
+      for (const auto &[name, value] : headers) {
+        if (name == ":status") {
+          std::from_chars(value.data(), value.data() + value.size(), stream.status_code_);
+        }
+      }
+    }
+    if (header_end_stream_) {
+      stream.remote_closed_ = true;
+    }
+    stream.read_timer_.cancel();
+    return true;
+  }
+
+  bool handle_settings(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    if (stream_id != 0 || payload.size() % 6 != 0) {
+      return false;
+    }
+    if (flags & kFlagAck) {
+      return true;
+    }
+    for (std::size_t pos = 0; pos < payload.size(); pos += 6) {
+      auto id = static_cast<std::uint16_t>(static_cast<std::uint8_t>(payload[pos]) << 8 | static_cast<std::uint8_t>(payload[pos + 1]));
+      auto value = read_uint32(payload.data() + pos + 2);
+      switch (id) {
+        case kSettingsMaxConcurrentStreams:
+          max_concurrent_streams_ = value;
+          break;
+        case kSettingsInitialWindowSize: {
+          if (value > kMaxStreamId) {
+            return false;
+          }
+          // Applies to the send windows of all open streams (RFC 9113 6.9.2).
+          auto delta = static_cast<std::int64_t>(value) - peer_initial_window_;
+          peer_initial_window_ = value;
+          for (auto &[id, stream] : streams_) {
+            if (stream->send_window_ + delta > kMaxStreamId) {
+              Log::error("[{}] | SETTINGS_INITIAL_WINDOW_SIZE overflows the window of stream {}", tag_, id);
+              return false;
+            }
+            stream->send_window_ += delta;
+            stream->write_timer_.cancel();
+          }
+          break;
+        }
+        case kSettingsMaxFrameSize:
+          if (value < 16384 || value > 16777215) {
+            return false;
+          }
+          peer_max_frame_size_ = value;
+          break;
+        default:
+          break;
+      }
+    }
+    queue_frame(FrameType::settings, kFlagAck, 0, {});
+    return true;
+  }
+
+  static bool strip_padding(std::uint8_t flags, std::string_view &payload) {
+    if (!(flags & kFlagPadded)) {
+      return true;
+    }
+    if (payload.empty() || static_cast<std::uint8_t>(payload[0]) >= payload.size()) {
+      return false;
+    }
+    auto padding = static_cast<std::uint8_t>(payload[0]);
+    payload = payload.substr(1, payload.size() - 1 - padding);
+    return true;
+  }
+
+  // The session took `size` bytes out of the stream: return them to both
+  // windows once enough has accumulated to be worth a frame.
+  void consume(Http2Stream &stream, std::size_t size) {
+    stream.unacked_ += size;
+    if (!stream.remote_closed_ && stream.unacked_ >= kHttp2StreamWindow / 2) {
+      queue_window_update(stream.id_, static_cast<std::uint32_t>(stream.unacked_));
+      stream.receive_window_ += stream.unacked_;
+      stream.unacked_ = 0;
+    }
+    consume_connection(size);
+  }
+
+  void consume_connection(std::size_t size) {
+    unacked_ += size;
+    if (unacked_ >= kHttp2ConnectionWindow / 2) {
+      queue_window_update(0, static_cast<std::uint32_t>(unacked_));
+      unacked_ = 0;
+    }
+  }
+
+  void send_data(Http2Stream &stream, std::string_view data) {
+    stream.send_window_ -= data.size();
+    send_window_ -= data.size();
+    queue_frame(FrameType::data, 0, stream.id_, data);
+  }
+
+  void close_stream(Http2Stream &stream) {
+    streams_.erase(stream.id_);
+    if (!closed_) {
+      if (!stream.error_) {
+        queue_rst_stream(stream.id_, kErrorCancel);
+      }
+      consume_connection(stream.inbound_size_);
+      if (going_away_ && streams_.empty()) {
+        close(asio::error::connection_aborted);
+      }
+    }
+  }
+
+  void close(const asio::error_code &ec) {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    Log::debug("[{}] | connection closed with {} streams", tag_, streams_.size());
+    for (auto &[id, stream] : streams_) {
+      stream->fail(ec);
+    }
+    asio::error_code ignored;
+    socket_.close(ignored);
+    write_timer_.cancel();
+  }
+
+  static constexpr std::size_t kFrameHeaderSize = 9;
+
+  asio::ip::tcp::socket socket_;
+  asio::steady_timer write_timer_;
+  std::string tag_;
+  std::string outbound_;
+  std::unordered_map<std::uint32_t, Http2Stream *> streams_;
+  std::uint32_t next_stream_id_ = 1;
+  std::uint32_t max_concurrent_streams_ = kHttp2DefaultMaxStreams;
+  std::int64_t peer_initial_window_ = kHttp2DefaultWindow;
+  std::uint32_t peer_max_frame_size_ = 16384;
+  std::int64_t send_window_ = kHttp2DefaultWindow;
+  std::size_t unacked_ = 0;
+  HpackDecoder decoder_;
+  std::string header_block_;
+  std::uint32_t continuation_stream_ = 0;
+  bool header_end_stream_ = false;
+  bool write_blocked_ = false;
+  bool going_away_ = false;
+  bool closed_ = false;
+};
+
+Http2Stream::Http2Stream(std::shared_ptr<Http2Connection> connection, std::uint32_t id, std::int64_t send_window)
+  : connection_(std::move(connection)), id_(id), read_timer_(connection_->socket_.get_executor()),
+    write_timer_(connection_->socket_.get_executor()), send_window_(send_window) {
+  Metrics::http2_streams.add();
+  Metrics::http2_active_streams.add();
+}
+
+Http2Stream::~Http2Stream() {
+  Metrics::http2_active_streams.sub();
+  connection_->close_stream(*this);
+}
+
+asio::awaitable<void> Http2Stream::wait_for_response(std::chrono::steady_clock::time_point deadline) {
+  while (status_code_ == 0) {
+    if (error_) {
+      throw std::system_error(error_);
+    }
+    if (remote_closed_) {
+      throw std::runtime_error("HTTP/2 stream closed without response");
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      throw std::system_error(std::make_error_code(std::errc::timed_out));
+    }
+    read_timer_.expires_at(deadline);
+    co_await read_timer_.async_wait(asio::as_tuple(asio::use_awaitable));
+  }
+  if (status_code_ < 200 || status_code_ >= 300) {
+    throw std::runtime_error(stdx::format("HTTP/2 CONNECT failed with status {}", status_code_));
+  }
+}
+
+asio::awaitable<std::tuple<asio::error_code, std::size_t>> Http2Stream::async_read_some(asio::mutable_buffer buffer) {
+  for (;;) {
+    if (inbound_size_ > 0) {
+      std::size_t bytes_read = 0;
+      auto *out = static_cast<char *>(buffer.data());
+      while (bytes_read < buffer.size() && !inbound_.empty()) {
+        const auto &chunk = inbound_.front();
+        auto size = std::min(buffer.size() - bytes_read, chunk.size() - inbound_offset_);
+        std::copy_n(chunk.data() + inbound_offset_, size, out + bytes_read);
+        bytes_read += size;
+        inbound_offset_ += size;
+        if (inbound_offset_ == chunk.size()) {
+          inbound_.pop_front();
+          inbound_offset_ = 0;
+        }
+      }
+      inbound_size_ -= bytes_read;
+      connection_->consume(*this, bytes_read);
+      co_return std::make_tuple(asio::error_code(), bytes_read);
+    }
+    if (error_) {
+      co_return std::make_tuple(error_, std::size_t(0));
+    }
+    if (remote_closed_) {
+      co_return std::make_tuple(asio::error_code(asio::error::eof), std::size_t(0));
+    }
+    // Woken by the connection through cancel(). When the session itself is
+    // cancelled, the next wait throws (asio's throw_if_cancelled default).
+    read_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+    co_await read_timer_.async_wait(asio::as_tuple(asio::use_awaitable));
+  }
+}
+
+asio::awaitable<std::tuple<asio::error_code, std::size_t>> Http2Stream::async_write_some(asio::const_buffer buffer) {
+  for (;;) {
+    if (error_) {
+      co_return std::make_tuple(error_, std::size_t(0));
+    }
+    // Flow control windows can be large, so also wait for the socket to drain.
+    auto window = std::min(send_window_, connection_->send_window_);
+    if (connection_->outbound_.size() >= kHttp2MaxPendingWrite) {
+      connection_->write_blocked_ = true;
+    } else if (window > 0) {
+      auto size = std::min({buffer.size(), static_cast<std::size_t>(window), static_cast<std::size_t>(connection_->peer_max_frame_size_)});
+      connection_->send_data(*this, std::string_view(static_cast<const char *>(buffer.data()), size));
+      co_return std::make_tuple(asio::error_code(), size);
+    }
+    write_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+    co_await write_timer_.async_wait(asio::as_tuple(asio::use_awaitable));
+  }
+}
+
+// A few long-lived HTTP/2 connections to the proxy, shared by all sessions and
+// targets. A new connection is only opened when the open ones are at the
+// proxy's concurrent stream limit; sessions wait while one is being opened.
+class Http2ConnectionPool {
+public:
+  Http2ConnectionPool(const AddressType &proxy_address, std::size_t max_connections)
+    : proxy_address_(proxy_address), max_connections_(max_connections) {}
+
+  // Routes that go through the same proxy share its connections. The first
+  // route sets the connection limit.
+  static std::shared_ptr<Http2ConnectionPool> shared(const AddressType &proxy_address, std::size_t max_connections) {
+    static std::map<AddressType, std::shared_ptr<Http2ConnectionPool>> s_pools;
+    auto &pool = s_pools[proxy_address];
+    if (!pool) {
+      pool = std::make_shared<Http2ConnectionPool>(proxy_address, max_connections);
+    }
+    return pool;
+  }
+
+  asio::awaitable<std::shared_ptr<Http2Stream>> open_stream(UpstreamConnector &connector, const Http2ConnectRequest &request,
+      std::chrono::steady_clock::time_point deadline) {
+    for (;;) {
+      std::erase_if(connections_, [](const auto &connection) { return !connection->is_usable(); });
+      std::shared_ptr<Http2Connection> best;
+      for (const auto &connection : connections_) {
+        if (connection->has_capacity() && (!best || connection->active_streams() < best->active_streams())) {
+          best = connection;
+        }
+      }
+      if (best) {
+        co_return best->open_stream(request);
+      }
+      if (connections_.size() + connecting_ < max_connections_) {
+        ++connecting_;
+        std::exception_ptr error;
+        try {
+          auto connection = std::make_shared<Http2Connection>(co_await connector.connect(proxy_address_));
+          connection->start();
+          connections_.push_back(std::move(connection));
+          Metrics::http2_connections.add();
+        } catch (std::exception &) {
+          error = std::current_exception();
+        }
+        --connecting_;
+        notify_waiters();
+        if (error) {
+          std::rethrow_exception(error);
+        }
+        continue;
+      }
+      if (connecting_ == 0) {
+        Log::debug("[http2] | all {} connections are at the stream limit", connections_.size());
+        throw std::system_error(std::make_error_code(std::errc::resource_unavailable_try_again));
+      }
+      asio::steady_timer timer(co_await asio::this_coro::executor);
+      timer.expires_at(deadline);
+      waiters_.push_back(&timer);
+      auto [ec] = co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+      std::erase(waiters_, &timer);
+      if (!ec) {
+        throw std::system_error(std::make_error_code(std::errc::timed_out));
+      }
+    }
+  }
+
+private:
+  void notify_waiters() {
+    for (auto *timer : waiters_) {
+      timer->cancel();
+    }
+  }
+
+  AddressType proxy_address_;
+  std::size_t max_connections_;
+  std::size_t connecting_ = 0;
+  std::vector<std::shared_ptr<Http2Connection>> connections_;
+  std::vector<asio::steady_timer *> waiters_;
+};
+
+struct HealthCheckOptions {
+  HealthCheckType type;
+  std::uint32_t interval;
+  std::uint32_t timeout;
+  std::uint32_t rise;
+  std::uint32_t fall;
+};
+
+struct OutlierDetectionOptions {
+  std::uint32_t min_failures;
+  std::uint32_t error_rate;
+  std::uint32_t base_ejection_time;
+};
+
+struct ConnectLimitOptions {
+  std::uint32_t max_in_flight;
+  std::uint32_t max_queue;
+  std::uint32_t queue_timeout;
+};
+
+// Limits the number of upstream connects in flight. Sessions over the limit
+// wait in a bounded FIFO; a waiter is an intrusive list node plus a timer in
+// the session's coroutine frame, so queueing allocates nothing. A finished
+// connect hands its slot directly to the oldest waiter.
+class ConnectLimiter {
+public:
+  class Permit {
+  public:
+    Permit() = default;
+
+    explicit Permit(ConnectLimiter *limiter)
+      : limiter_(limiter) {}
+
+    Permit(Permit &&other) noexcept
+      : limiter_(std::exchange(other.limiter_, nullptr)), unlimited_(other.unlimited_) {}
+
+    Permit &operator=(Permit &&other) noexcept {
+      if (this != &other) {
+        reset();
+        limiter_ = std::exchange(other.limiter_, nullptr);
+        unlimited_ = other.unlimited_;
+      }
+      return *this;
+    }
+
+    ~Permit() {
+      reset();
+    }
+
+    explicit operator bool() const {
+      return limiter_ != nullptr || unlimited_;
+    }
+
+    static Permit unlimited() {
+      Permit permit;
+      permit.unlimited_ = true;
+      return permit;
+    }
+
+  private:
+    void reset() {
+      if (limiter_) {
+        std::exchange(limiter_, nullptr)->release();
+      }
+    }
+
+    ConnectLimiter *limiter_ = nullptr;
+    bool unlimited_ = false;
+  };
+
+  explicit ConnectLimiter(const ConnectLimitOptions &options)
+    : options_(options) {}
+
+  asio::awaitable<Permit> acquire() {
+    if (options_.max_in_flight == 0) {
+      co_return Permit::unlimited();
+    }
+    if (in_flight_ < options_.max_in_flight) {
+      ++in_flight_;
+      co_return Permit(this);
+    }
+    if (queue_size_ >= options_.max_queue) {
+      Metrics::connect_queue_rejections.add();
+      co_return Permit();
+    }
+    Waiter waiter(co_await asio::this_coro::executor, this);
+    auto start_time = std::chrono::steady_clock::now();
+    waiter.timer.expires_after(std::chrono::seconds(options_.queue_timeout));
+    co_await waiter.timer.async_wait(asio::as_tuple(asio::use_awaitable));
+    Metrics::connect_queue_wait_time.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time));
+    if (waiter.granted) {
+      co_return Permit(this);
+    }
+    Metrics::connect_queue_timeouts.add();
+    co_return Permit();
+  }
+
+private:
+  struct Waiter {
+    Waiter(const asio::any_io_executor &executor, ConnectLimiter *limiter)
+      : timer(executor), limiter(limiter) {
+      limiter->push_back(this);
+    }
+
+    ~Waiter() {
+      if (!granted) {
+        limiter->unlink(this);
+      }
+    }
+
+    asio::steady_timer timer;
+    ConnectLimiter *limiter;
+    Waiter *prev = nullptr;
+    Waiter *next = nullptr;
+    bool granted = false;
+  };
+
+  void release() {
+    if (head_) {
+      auto *waiter = head_;
+      unlink(waiter);
+      waiter->granted = true;
+      waiter->timer.cancel();
+    } else {
+      --in_flight_;
+    }
+  }
+
+  void push_back(Waiter *waiter) {
+    waiter->prev = tail_;
+    if (tail_) {
+      tail_->next = waiter;
+    } else {
+      head_ = waiter;
+    }
+    tail_ = waiter;
+    ++queue_size_;
+    Metrics::connect_queue_depth.add();
+  }
+
+  void unlink(Waiter *waiter) {
+    (waiter->prev ? waiter->prev->next : head_) = waiter->next;
+    (waiter->next ? waiter->next->prev : tail_) = waiter->prev;
+    waiter->prev = nullptr;
+    waiter->next = nullptr;
+    --queue_size_;
+    Metrics::connect_queue_depth.sub();
+  }
+
+  ConnectLimitOptions options_;
+  std::uint32_t in_flight_ = 0;
+  std::uint32_t queue_size_ = 0;
+  Waiter *head_ = nullptr;
+  Waiter *tail_ = nullptr;
+};
+
+// Approximate counts for any number of keys in fixed memory. Each row counts
+// in one column picked by a seeded hash of the key, and the estimate of a key
+// is its smallest column, so collisions can only overcount. An add only raises
+// the columns that are at that minimum (conservative update), which keeps the
+// overcount of light keys low while heavy ones share their columns. Counters
+// saturate instead of wrapping. The seeds are random per sketch, so an
+// attacker cannot choose keys that share a victim's columns. The counters are
+// allocated on the first add.
+class CountMinSketch {
+public:
+  using Key = std::array<std::uint64_t, 2>;
+
+  CountMinSketch() {
+    std::random_device device;
+    for (auto &seed : seeds_) {
+      seed = std::uint64_t(device()) << 32 | device();
+    }
+  }
+
+  // Returns the estimate of `key` including this add.
+  std::uint32_t add(const Key &key) {
+    if (counters_.empty()) {
+      counters_.assign(kRows * kColumns, 0);
+    }
+    std::array<std::size_t, kRows> slots;
+    std::uint16_t min = std::numeric_limits<std::uint16_t>::max();
+    for (std::size_t row = 0; row < kRows; ++row) {
+      slots[row] = slot(key, row);
+      min = std::min(min, counters_[slots[row]]);
+    }
+    if (min == std::numeric_limits<std::uint16_t>::max()) {
+      return min;
+    }
+    for (auto slot : slots) {
+      if (counters_[slot] == min) {
+        ++counters_[slot];
+      }
+    }
+    return min + 1;
+  }
+
+  std::uint32_t estimate(const Key &key) const {
+    if (counters_.empty()) {
+      return 0;
+    }
+    auto result = counters_[slot(key, 0)];
+    for (std::size_t row = 1; row < kRows; ++row) {
+      result = std::min(result, counters_[slot(key, row)]);
+    }
+    return result;
+  }
+
+  void clear() {
+    std::fill(counters_.begin(), counters_.end(), 0);
+  }
+
+  // A seeded 64-bit mix of `key`, for other tables of client keys as well.
+  static std::uint64_t hash(const Key &key, std::uint64_t seed) {
+    return mix(mix(key[0] ^ seed) ^ key[1]);
+  }
+
+private:
+  static constexpr std::size_t kRows = 4;
+  static constexpr std::size_t kColumns = 65536;
+
+  static std::uint64_t mix(std::uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  std::size_t slot(const Key &key, std::size_t row) const {
+    return row * kColumns + (hash(key, seeds_[row]) & (kColumns - 1));
+  }
+
+  std::array<std::uint64_t, kRows> seeds_;
+  std::vector<std::uint16_t> counters_;
+};
+
+struct ClientLimitOptions {
+  std::uint32_t max_sessions_per_ip;
+  std::uint32_t max_rate_per_ip;
+  std::uint32_t max_sessions_per_prefix;
+  std::uint32_t max_rate_per_prefix;
+  std::uint32_t prefix_length_v4;
+  std::uint32_t prefix_length_v6;
+};
+
+// Caps the concurrent sessions and the new connections per second of each
+// client address and of each client subnet. It is checked in the accept loop,
+// so a client over its limits costs no more than an accept and a close; behind
+// a PROXY protocol sender the session checks them after the header.
+// Rates are counted over a sliding second in count-min sketches, so their
+// memory stays fixed however many addresses connect; every attempt counts,
+// including rejected ones. Sessions are counted exactly, per client with open
+// sessions, which the file descriptor limit bounds already.
+class ClientLimiter : public std::enable_shared_from_this<ClientLimiter> {
+public:
+  using Key = CountMinSketch::Key;
+
+  // The rate sketches saturate at 65535, which must still be over the limit.
+  static constexpr std::uint32_t kMaxRate = std::numeric_limits<std::uint16_t>::max() - 1;
+
+  // Holds a session slot of one client until destroyed.
+  class Lease {
+  public:
+    Lease(std::shared_ptr<ClientLimiter> limiter, const Key &ip, const Key &prefix)
+      : limiter_(std::move(limiter)), ip_(ip), prefix_(prefix) {}
+
+    Lease(Lease &&other) noexcept = default;
+
+    Lease &operator=(Lease &&other) noexcept {
+      if (this != &other) {
+        reset();
+        limiter_ = std::move(other.limiter_);
+        ip_ = other.ip_;
+        prefix_ = other.prefix_;
+      }
+      return *this;
+    }
+
+    ~Lease() {
+      reset();
+    }
+
+  private:
+    void reset() {
+      if (limiter_) {
+        std::exchange(limiter_, nullptr)->release(ip_, prefix_);
+      }
+    }
+
+    std::shared_ptr<ClientLimiter> limiter_;
+    Key ip_;
+    Key prefix_;
+  };
+
+  explicit ClientLimiter(const ClientLimitOptions &options)
+    : options_(options), ip_(options.max_sessions_per_ip, options.max_rate_per_ip),
+      prefix_(options.max_sessions_per_prefix, options.max_rate_per_prefix) {}
+
+  static bool enabled(const ClientLimitOptions &options) {
+    return options.max_sessions_per_ip > 0 || options.max_rate_per_ip > 0 || options.max_sessions_per_prefix > 0 || options.max_rate_per_prefix > 0;
+  }
+
+  // Counts a new connection from `address`. Returns nullopt if it goes over
+  // a limit, and the session slot of the client otherwise.
+  std::optional<Lease> admit(const asio::ip::address &address) {
+    auto now = std::chrono::steady_clock::now();
+    advance(now);
+    auto previous_weight = 1.0 - std::chrono::duration<double>(now - window_).count();
+    auto ip = make_key(address, 32, 128);
+    auto prefix = make_key(address, options_.prefix_length_v4, options_.prefix_length_v6);
+    // Both are evaluated, so that the attempt counts against both rates.
+    bool allowed = ip_.allows(ip, previous_weight) & prefix_.allows(prefix, previous_weight);
+    if (!allowed) {
+      return std::nullopt;
+    }
+    ip_.open(ip);
+    prefix_.open(prefix);
+    return Lease(shared_from_this(), ip, prefix);
+  }
+
+private:
+  // Seeded per process, so that clients cannot pick keys that collide.
+  struct KeyHash {
+    std::uint64_t seed;
+
+    std::size_t operator()(const Key &key) const {
+      return CountMinSketch::hash(key, seed);
+    }
+  };
+
+  struct Limit {
+    Limit(std::uint32_t max_sessions, std::uint32_t max_rate)
+      : max_sessions(max_sessions), max_rate(max_rate), sessions(0, KeyHash{std::random_device()()}) {}
+
+    bool allows(const Key &key, double previous_weight) {
+      if (max_rate > 0 && current.add(key) + previous.estimate(key) * previous_weight > max_rate) {
+        return false;
+      }
+      if (max_sessions > 0) {
+        auto it = sessions.find(key);
+        return it == sessions.end() || it->second < max_sessions;
+      }
+      return true;
+    }
+
+    void open(const Key &key) {
+      if (max_sessions > 0) {
+        ++sessions[key];
+      }
+    }
+
+    void close(const Key &key) {
+      if (max_sessions > 0) {
+        auto it = sessions.find(key);
+        if (--it->second == 0) {
+          sessions.erase(it);
+        }
+      }
+    }
+
+    std::uint32_t max_sessions;
+    std::uint32_t max_rate;
+    std::unordered_map<Key, std::uint32_t, KeyHash> sessions;
+    // Connections in the current second and in the one before.
+    CountMinSketch current;
+    CountMinSketch previous;
+  };
+
+  // The address with all bits past the prefix cleared. IPv4 keys are tagged
+  // in the low word, which IPv6 keys use for their interface identifier.
+  static Key make_key(const asio::ip::address &address, std::uint32_t length_v4, std::uint32_t length_v6) {
+    auto high_bits = [](std::uint64_t word, std::uint32_t bits) {
+      return bits == 0 ? 0 : bits >= 64 ? word : word & ~(~std::uint64_t(0) >> bits);
+    };
+    if (address.is_v4() || address.to_v6().is_v4_mapped()) {
+      auto v4 = address.is_v4() ? address.to_v4() : asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6());
+      return {high_bits(std::uint64_t(v4.to_uint()) << 32, length_v4), ~std::uint64_t(0)};
+    }
+    auto bytes = address.to_v6().to_bytes();
+    Key key = {0, 0};
+    for (std::size_t i = 0; i < bytes.size(); ++i) {
+      key[i / 8] |= std::uint64_t(bytes[i]) << (56 - i % 8 * 8);
+    }
+    return {high_bits(key[0], length_v6), high_bits(key[1], length_v6 > 64 ? length_v6 - 64 : 0)};
+  }
+
+  void advance(std::chrono::steady_clock::time_point now) {
+    auto second = std::chrono::floor<std::chrono::seconds>(now);
+    if (second == window_) {
+      return;
+    }
+    for (auto *limit : {&ip_, &prefix_}) {
+      if (second - window_ == std::chrono::seconds(1)) {
+        std::swap(limit->previous, limit->current);
+      } else {
+        limit->previous.clear();
+      }
+      limit->current.clear();
+    }
+    window_ = second;
+  }
+
+  void release(const Key &ip, const Key &prefix) {
+    ip_.close(ip);
+    prefix_.close(prefix);
+  }
+
+  ClientLimitOptions options_;
+  Limit ip_;
+  Limit prefix_;
+  std::chrono::steady_clock::time_point window_ = {};
+};
+
+struct TargetOptions {
+  AddressType address;
+  std::uint32_t weight;
+  HealthCheckOptions health_check;
+  OutlierDetectionOptions outlier_detection;
+  ConnectLimitOptions connect_limit;
+};
+
+// Targets for the sessions whose host name (e.g. the TLS SNI) matches
+// `hostname`, either exactly or as a "*.example.com" wildcard.
+struct HostnameRouteOptions {
+  std::string hostname;
+  std::vector<TargetOptions> targets;
+};
+
+// Targets for the sessions that start like `protocol`.
+struct ProtocolRouteOptions {
+  SniffedProtocol protocol;
+  std::vector<TargetOptions> targets;
+};
+
+// What to do with the clients in a subnet: accept them, close them right
+// after accept, or send them to `targets` regardless of any other route.
+struct ClientRuleOptions {
+  enum class Action {allow, deny, route};
+  Action action;
+  asio::ip::address address;
+  std::uint32_t length;
+  std::vector<TargetOptions> targets;
+};
+
+// Runtime state of one member of a target group. All targets are only touched
+// from the io_context thread, so plain counters are enough.
+class Target {
+public:
+  explicit Target(const TargetOptions &options)
+    : options_(options), connect_limiter_(options.connect_limit) {}
+
+  const AddressType &address() const {
+    return options_.address;
+  }
+
+  // The address for the listen port at `port_offset` in a range, whose
+  // sessions go to the target port moved up by the same offset.
+  AddressType address(std::uint32_t port_offset) const {
+    return {options_.address.first, static_cast<asio::ip::port_type>(options_.address.second + port_offset)};
+  }
+
+  std::uint32_t weight() const {
+    return options_.weight;
+  }
+
+  const HealthCheckOptions &health_check_options() const {
+    return options_.health_check;
+  }
+
+  std::uint32_t active_connections() const {
+    return active_connections_;
+  }
+
+  bool is_healthy() const {
+    return healthy_;
+  }
+
+  bool is_available() const {
+    return healthy_ && !ejected_;
+  }
+
+  bool is_ejected() const {
+    return ejected_;
+  }
+
+  std::chrono::steady_clock::time_point ejected_until() const {
+    return ejected_until_;
+  }
+
+  // Tracks connect/handshake outcomes in a tumbling window and ejects the
+  // target when the failures in the window cross both the count and the rate
+  // threshold. Each ejection doubles the next ejection time, every clean
+  // window halves it again. Returns true if the target got ejected.
+  bool record_outcome(bool success) {
+    const auto &options = options_.outlier_detection;
+    if (options.min_failures == 0 || ejected_) {
+      return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - window_start_ >= std::chrono::seconds(kOutlierWindow)) {
+      if (window_failures_ == 0 && ejection_count_ > 0) {
+        --ejection_count_;
+      }
+      window_start_ = now;
+      window_attempts_ = 0;
+      window_failures_ = 0;
+    }
+    ++window_attempts_;
+    if (!success) {
+      ++window_failures_;
+    }
+    if (window_failures_ < options.min_failures || window_failures_ * 100 < window_attempts_ * options.error_rate) {
+      return false;
+    }
+    auto ejection_time = std::min<std::uint64_t>(std::uint64_t(options.base_ejection_time) << std::min(ejection_count_, 16u), kMaxEjectionTime);
+    ++ejection_count_;
+    ejected_ = true;
+    ejected_until_ = now + std::chrono::seconds(ejection_time);
+    window_start_ = now;
+    window_attempts_ = 0;
+    window_failures_ = 0;
+    return true;
+  }
+
+  // Returns true if the target just came back from an ejection.
+  bool try_return(const std::chrono::steady_clock::time_point &now) {
+    if (ejected_ && now >= ejected_until_) {
+      ejected_ = false;
+      return true;
+    }
+    return false;
+  }
+
+  // Applies the rise/fall hysteresis, returns true if the health state changed.
+  bool record_probe_result(bool success) {
+    const auto &options = options_.health_check;
+    if (success) {
+      consecutive_probe_failures_ = 0;
+      if (!healthy_ && ++consecutive_probe_successes_ >= options.rise) {
+        healthy_ = true;
+        return true;
+      }
+    } else {
+      consecutive_probe_successes_ = 0;
+      if (healthy_ && ++consecutive_probe_failures_ >= options.fall) {
+        healthy_ = false;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Smoothed connect latency in microseconds, 0 until the first sample.
+  double connect_latency() const {
+    return connect_latency_;
+  }
+
+  void connection_started() {
+    ++active_connections_;
+  }
+
+  void connection_finished() {
+    --active_connections_;
+  }
+
+  void record_connect_latency(std::chrono::microseconds latency) {
+    if (connect_latency_ == 0) {
+      connect_latency_ = static_cast<double>(latency.count());
+    } else {
+      connect_latency_ += kConnectLatencyEwmaAlpha * (static_cast<double>(latency.count()) - connect_latency_);
+    }
+  }
+
+  // A failed connect counts as a full connect timeout (the route's
+  // --connect_timeout) for latency-aware policies.
+  void record_connect_failure(std::chrono::seconds connect_timeout) {
+    record_connect_latency(connect_timeout);
+  }
+
+  // The proxy chain, CONNECT request and pool name the target port, so they
+  // are kept per listen port offset. Only set when connecting via a proxy.
+  const std::shared_ptr<const ProxyChain> &proxy_chain(std::uint32_t port_offset) const {
+    return port(port_offset).proxy_chain;
+  }
+
+  void set_proxy_chain(std::uint32_t port_offset, std::shared_ptr<const ProxyChain> chain) {
+    port(port_offset).proxy_chain = std::move(chain);
+  }
+
+  // Only set when connecting via an HTTP/2 proxy.
+  const std::shared_ptr<const Http2ConnectRequest> &http2_connect_request(std::uint32_t port_offset) const {
+    return port(port_offset).http2_connect_request;
+  }
+
+  void set_http2_connect_request(std::uint32_t port_offset, std::shared_ptr<const Http2ConnectRequest> request) {
+    port(port_offset).http2_connect_request = std::move(request);
+  }
+
+  ConnectLimiter &connect_limiter() {
+    return connect_limiter_;
+  }
+
+  const std::shared_ptr<UpstreamPool> &pool(std::uint32_t port_offset) const {
+    return port(port_offset).pool;
+  }
+
+  void set_pool(std::uint32_t port_offset, std::shared_ptr<UpstreamPool> pool) {
+    port(port_offset).pool = std::move(pool);
+  }
+
+private:
+  struct Port {
+    std::shared_ptr<const ProxyChain> proxy_chain;
+    std::shared_ptr<const Http2ConnectRequest> http2_connect_request;
+    std::shared_ptr<UpstreamPool> pool;
+  };
+
+  const Port &port(std::uint32_t offset) const {
+    static const Port kUnset;
+    return offset < ports_.size() ? ports_[offset] : kUnset;
+  }
+
+  Port &port(std::uint32_t offset) {
+    if (offset >= ports_.size()) {
+      ports_.resize(offset + 1);
+    }
+    return ports_[offset];
+  }
+
+  TargetOptions options_;
+  ConnectLimiter connect_limiter_;
+  std::uint32_t active_connections_ = 0;
+  double connect_latency_ = 0;
+  bool healthy_ = true;
+  std::uint32_t consecutive_probe_successes_ = 0;
+  std::uint32_t consecutive_probe_failures_ = 0;
+  bool ejected_ = false;
+  std::chrono::steady_clock::time_point ejected_until_;
+  std::uint32_t ejection_count_ = 0;
+  std::chrono::steady_clock::time_point window_start_;
+  std::uint32_t window_attempts_ = 0;
+  std::uint32_t window_failures_ = 0;
+  // Indexed by the listen port offset.
+  std::vector<Port> ports_;
+};
+
+class TargetGroup {
+public:
+  TargetGroup(const std::vector<TargetOptions> &targets, LoadBalancePolicy policy)
+    : policy_(policy), rng_(std::random_device()()) {
+    for (const auto &options : targets) {
+      targets_.push_back(std::make_shared<Target>(options));
+    }
+    rebuild();
+  }
+
+  const std::vector<std::shared_ptr<Target>> &targets() const {
+    return targets_;
+  }
+
+  // Returns nullptr while the circuit is open, i.e. every target is ejected.
+  std::shared_ptr<Target> select(const asio::ip::address &client_address) {
+    if (next_return_ != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= next_return_) {
+      rebuild();
+    }
+    if (eligible_.empty()) {
+      return nullptr;
+    }
+    if (targets_.size() == 1) {
+      return targets_[0];
+    }
+    switch (policy_) {
+      case LoadBalancePolicy::maglev:
+        return targets_[maglev_table_[hash_address(client_address) % maglev_table_.size()]];
+      case LoadBalancePolicy::least_conn:
+        return select_least_conn();
+      case LoadBalancePolicy::power_of_two:
+      case LoadBalancePolicy::ewma: {
+        const auto &a = targets_[schedule_[rng_() % schedule_.size()]];
+        const auto &b = targets_[schedule_[rng_() % schedule_.size()]];
+        return cost(*a) <= cost(*b) ? a : b;
+      }
+      default:
+        return targets_[schedule_[next_++ % schedule_.size()]];
+    }
+  }
+
+  // Picks the cheapest eligible target that has not been tried yet by the
+  // session, or nullptr if there is none left.
+  std::shared_ptr<Target> select_retry(const std::vector<std::shared_ptr<Target>> &tried) {
+    const std::shared_ptr<Target> *best = nullptr;
+    for (auto index : eligible_) {
+      const auto &target = targets_[index];
+      if (std::find(tried.begin(), tried.end(), target) != tried.end()) {
+        continue;
+      }
+      if (!best || cost(*target) < cost(**best)) {
+        best = &target;
+      }
+    }
+    return best ? *best : nullptr;
+  }
+
+  void record_outcome(const std::shared_ptr<Target> &target, bool success) {
+    if (target->record_outcome(success)) {
+      Metrics::outlier_ejections.add();
+      Log::warn("[target: {}:{}] | ejected for {}s after a failure burst", std::get<0>(target->address()), std::get<1>(target->address()),
+        std::chrono::ceil<std::chrono::seconds>(target->ejected_until() - std::chrono::steady_clock::now()).count());
+      rebuild();
+    }
+  }
+
+  // Recomputes the selection tables over the targets that are currently
+  // available. Called whenever a target changes state, which is rare compared
+  // to selections. If all targets fail their health checks they are used
+  // anyway, but ejected targets are not: with every target ejected the
+  // circuit opens and sessions fail fast until the first ejection ends.
+  void rebuild() {
+    auto now = std::chrono::steady_clock::now();
+    next_return_ = std::chrono::steady_clock::time_point::max();
+    eligible_.clear();
+    for (std::uint32_t i = 0; i < targets_.size(); ++i) {
+      const auto &target = targets_[i];
+      if (target->try_return(now)) {
+        Log::info("[target: {}:{}] | returned after ejection", std::get<0>(target->address()), std::get<1>(target->address()));
+      }
+      if (target->is_available()) {
+        eligible_.push_back(i);
+      } else if (target->is_ejected()) {
+        next_return_ = std::min(next_return_, target->ejected_until());
+      }
+    }
+    if (eligible_.empty()) {
+      for (std::uint32_t i = 0; i < targets_.size(); ++i) {
+        if (!targets_[i]->is_ejected()) {
+          eligible_.push_back(i);
+        }
+      }
+    }
+    if (eligible_.empty() != circuit_open_) {
+      circuit_open_ = eligible_.empty();
+      if (circuit_open_) {
+        Log::warn("[target group] | circuit open, all targets are ejected");
+      } else {
+        Log::info("[target group] | circuit closed");
+      }
+    }
+    if (circuit_open_) {
+      return;
+    }
+    build_schedule();
+    // A single target is returned without a lookup.
+    if (policy_ == LoadBalancePolicy::maglev && targets_.size() > 1) {
+      build_maglev_table();
+    }
+  }
+
+private:
+  // Smooth weighted round robin: a target with weight w appears w times in the
+  // schedule, spread out instead of in bursts. Random picks from the schedule
+  // are weighted as well.
+  void build_schedule() {
+    std::uint32_t total_weight = 0;
+    for (auto index : eligible_) {
+      total_weight += targets_[index]->weight();
+    }
+    std::vector<std::int64_t> current(eligible_.size(), 0);
+    schedule_.clear();
+    schedule_.reserve(total_weight);
+    for (std::uint32_t n = 0; n < total_weight; ++n) {
+      std::size_t best = 0;
+      for (std::size_t i = 0; i < eligible_.size(); ++i) {
+        current[i] += targets_[eligible_[i]]->weight();
+        if (current[i] > current[best]) {
+          best = i;
+        }
+      }
+      current[best] -= total_weight;
+      schedule_.push_back(eligible_[best]);
+    }
+  }
+
+  // Target groups are small, a linear scan is cheaper than keeping a heap in
+  // sync with every connection start and finish.
+  std::shared_ptr<Target> select_least_conn() {
+    std::uint32_t best = eligible_[0];
+    for (auto index : eligible_) {
+      if (cost(*targets_[index]) < cost(*targets_[best])) {
+        best = index;
+      }
+    }
+    return targets_[best];
+  }
+
+  // Maglev hashing (Eisenbud et al., NSDI 2016): every target walks its own
+  // permutation of the lookup table and claims free slots in turn, in
+  // proportion to its weight. Permutations only depend on the target address,
+  // so adding or removing a target moves few clients to another target.
+  void build_maglev_table() {
+    std::uint32_t max_weight = 0;
+    for (auto index : eligible_) {
+      max_weight = std::max(max_weight, targets_[index]->weight());
+    }
+    std::vector<std::uint64_t> offsets, skips, next(eligible_.size(), 0);
+    std::vector<std::uint32_t> credits(eligible_.size(), 0);
+    for (auto index : eligible_) {
+      const auto &address = targets_[index]->address();
+      auto name = stdx::format("{}:{}", std::get<0>(address), std::get<1>(address));
+      offsets.push_back(fnv1a(name, 0xcbf29ce484222325ull) % kMaglevTableSize);
+      skips.push_back(fnv1a(name, 0x84222325cbf29ce4ull) % (kMaglevTableSize - 1) + 1);
+    }
+    std::vector<std::int32_t> table(kMaglevTableSize, -1);
+    std::uint32_t filled = 0;
+    while (filled < kMaglevTableSize) {
+      for (std::size_t i = 0; i < eligible_.size() && filled < kMaglevTableSize; ++i) {
+        credits[i] += targets_[eligible_[i]]->weight();
+        if (credits[i] < max_weight) {
+          continue;
+        }
+        credits[i] -= max_weight;
+        std::uint64_t slot;
+        do {
+          slot = (offsets[i] + next[i] * skips[i]) % kMaglevTableSize;
+          ++next[i];
+        } while (table[slot] >= 0);
+        table[slot] = static_cast<std::int32_t>(eligible_[i]);
+        ++filled;
+      }
+    }
+    maglev_table_.assign(table.begin(), table.end());
+  }
+
+  // IPv4-mapped IPv6 addresses hash like the IPv4 address, so that a client
+  // keeps its target on dual-stack listeners.
+  static std::uint64_t hash_address(const asio::ip::address &address) {
+    if (address.is_v4() || address.to_v6().is_v4_mapped()) {
+      auto v4 = address.is_v4() ? address.to_v4() : asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6());
+      auto bytes = v4.to_bytes();
+      return fnv1a(std::string_view(reinterpret_cast<const char *>(bytes.data()), bytes.size()), 0xcbf29ce484222325ull);
+    }
+    auto bytes = address.to_v6().to_bytes();
+    return fnv1a(std::string_view(reinterpret_cast<const char *>(bytes.data()), bytes.size()), 0xcbf29ce484222325ull);
+  }
+
+  static std::uint64_t fnv1a(std::string_view data, std::uint64_t seed) {
+    std::uint64_t hash = seed;
+    for (unsigned char c : data) {
+      hash ^= c;
+      hash *= 0x100000001b3ull;
+    }
+    return hash;
+  }
+
+  double cost(const Target &target) const {
+    double load = static_cast<double>(target.active_connections() + 1) / target.weight();
+    if (policy_ == LoadBalancePolicy::ewma) {
+      return load * (target.connect_latency() + 1);
+    }
+    return load;
+  }
+
+  std::vector<std::shared_ptr<Target>> targets_;
+  LoadBalancePolicy policy_;
+  std::vector<std::uint32_t> eligible_;
+  std::chrono::steady_clock::time_point next_return_ = std::chrono::steady_clock::time_point::max();
+  bool circuit_open_ = false;
+  std::vector<std::uint32_t> schedule_;
+  std::size_t next_ = 0;
+  std::minstd_rand rng_;
+  std::vector<std::uint32_t> maglev_table_;
+};
+
+// Periodically probes one target, either with a plain TCP connect or with a
+// full tunnel handshake through the proxy, and takes it out of selection after
+// `fall` consecutive failures until `rise` consecutive successes. Behind a
+// listen port range the target's first port speaks for the whole range.
+class HealthChecker : public std::enable_shared_from_this<HealthChecker> {
+public:
+  HealthChecker(std::shared_ptr<TargetGroup> target_group, std::shared_ptr<Target> target, const AddressType &server_address)
+    : target_group_(std::move(target_group)), target_(std::move(target)), server_address_(server_address),
+      tag_(stdx::format("health: {}:{}", std::get<0>(target_->address()), std::get<1>(target_->address()))) {}
+
+  void start(const asio::any_io_executor &executor) {
+    asio::co_spawn(executor, [self = shared_from_this()]() -> asio::awaitable<void> {
+      co_await self->run();
+    }, asio::detached);
+  }
+
+private:
+  asio::awaitable<void> run() {
+    const auto &options = target_->health_check_options();
+    asio::steady_timer timer(co_await asio::this_coro::executor);
+    for (;;) {
+      timer.expires_after(std::chrono::seconds(options.interval));
+      co_await timer.async_wait(asio::use_awaitable);
+      auto start_time = std::chrono::steady_clock::now();
+      bool success = co_await probe();
+      Metrics::health_check_probes.add();
+      if (!success) {
+        Metrics::health_check_failures.add();
+      }
+      Log::trace("[{}] | probe {} in {}ms", tag_, success ? "succeeded" : "failed",
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count());
+      if (target_->record_probe_result(success)) {
+        Metrics::health_check_transitions.add();
+        if (target_->is_healthy()) {
+          Log::info("[{}] | target is healthy again", tag_);
+        } else {
+          Log::warn("[{}] | target is unhealthy after {} failed probes", tag_, options.fall);
+        }
+        target_group_->rebuild();
+      }
+    }
+  }
+
+  asio::awaitable<bool> probe() {
+    const auto &options = target_->health_check_options();
+    UpstreamConnector connector(tag_);
+    connector.set_deadline(std::chrono::steady_clock::now() + std::chrono::seconds(options.timeout));
+    try {
+      auto server = co_await connector.connect(server_address_);
+      if (options.type == HealthCheckType::handshake) {
+        co_await connector.proxy_handshake(server, *target_->proxy_chain(0));
+      }
+    } catch (std::exception &) {
+      co_return false;
+    }
+    co_return true;
+  }
+
+  std::shared_ptr<TargetGroup> target_group_;
+  std::shared_ptr<Target> target_;
+  AddressType server_address_;
+  std::string tag_;
+};
+
+// Process wide cap on connect retries: within a window, retries may not
+// exceed the given percentage of first attempts (plus a small floor so that
+// low traffic can still fail over). Keeps retries from amplifying an outage.
+// A budget of 0 allows no retries at all, floor included.
+class RetryBudget {
+public:
+  explicit RetryBudget(std::uint32_t percent)
+    : percent_(percent) {}
+
+  void record_attempt() {
+    roll_window();
+    ++attempts_;
+  }
+
+  bool try_acquire_retry() {
+    roll_window();
+    if (percent_ == 0 || retries_ >= std::max<std::uint64_t>(kMinRetriesPerWindow, attempts_ * percent_ / 100)) {
+      return false;
+    }
+    ++retries_;
+    return true;
+  }
+
+private:
+  void roll_window() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - window_start_ >= std::chrono::seconds(kRetryBudgetWindow)) {
+      window_start_ = now;
+      attempts_ = 0;
+      retries_ = 0;
+    }
+  }
+
+  std::uint32_t percent_;
+  std::chrono::steady_clock::time_point window_start_;
+  std::uint64_t attempts_ = 0;
+  std::uint64_t retries_ = 0;
+};
+
+// PROXY protocol header (haproxy's proxy-protocol.txt) that tells the target
+// the original client address. Version 2 may also carry the session id as a
+// PP2_TYPE_UNIQUE_ID TLV, so backend logs can be matched with ours.
+class ProxyProtocolHeader {
+public:
+  static std::string encode(ProxyProtocolVersion version, asio::ip::tcp::endpoint source, asio::ip::tcp::endpoint destination,
+      std::optional<std::uint64_t> session_id) {
+    source = unmap(source);
+    destination = unmap(destination);
+    bool known = source.address().is_v4() == destination.address().is_v4();
+    if (version == ProxyProtocolVersion::v1) {
+      if (!known) {
+        return "PROXY UNKNOWN\r\n";
+      }
+      return stdx::format("PROXY {} {} {} {} {}\r\n", source.address().is_v4() ? "TCP4" : "TCP6", source.address().to_string(),
+          destination.address().to_string(), source.port(), destination.port());
+    }
+    std::string payload;
+    if (known && source.address().is_v4()) {
+      append_bytes(payload, source.address().to_v4().to_bytes());
+      append_bytes(payload, destination.address().to_v4().to_bytes());
+    } else if (known) {
+      append_bytes(payload, source.address().to_v6().to_bytes());
+      append_bytes(payload, destination.address().to_v6().to_bytes());
+    }
+    if (known) {
+      append_uint16(payload, source.port());
+      append_uint16(payload, destination.port());
+    }
+    if (session_id) {
+      auto unique_id = std::to_string(*session_id);
+      payload += static_cast<char>(kUniqueIdType);
+      append_uint16(payload, static_cast<std::uint16_t>(unique_id.size()));
+      payload += unique_id;
+    }
+    std::string header(kV2Signature, sizeof(kV2Signature));
+    header += static_cast<char>(0x21);  // version 2, PROXY command
+    header += static_cast<char>(!known ? 0x00 : source.address().is_v4() ? 0x11 : 0x21);
+    append_uint16(header, static_cast<std::uint16_t>(payload.size()));
+    return header + payload;
+  }
+
+private:
+  static constexpr char kV2Signature[12] = {'\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n'};
+  static constexpr std::uint8_t kUniqueIdType = 0x05;
+
+  // A dual-stack listener sees IPv4 clients as mapped IPv6 addresses.
+  static asio::ip::tcp::endpoint unmap(const asio::ip::tcp::endpoint &endpoint) {
+    if (endpoint.address().is_v6() && endpoint.address().to_v6().is_v4_mapped()) {
+      return {asio::ip::make_address_v4(asio::ip::v4_mapped, endpoint.address().to_v6()), endpoint.port()};
+    }
+    return endpoint;
+  }
+
+  template <typename Bytes>
+  static void append_bytes(std::string &out, const Bytes &bytes) {
+    out.append(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+  }
+
+  static void append_uint16(std::string &out, std::uint16_t value) {
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value & 0xff);
+  }
+};
+
+// Parser for the PROXY protocol v1 or v2 header that a load balancer in front
+// of the listener sends ahead of the client data. It works in place on the
+// bytes received so far and only copies the addresses out.
+class ProxyProtocolParser {
+public:
+  enum class Result {
+    incomplete,
+    complete,
+    error,
+  };
+
+  // Parses `data`, everything received so far. On `complete`, `header_size()`
+  // tells where client data starts. `source()` stays empty for LOCAL and
+  // UNKNOWN headers, e.g. the balancer's own health checks, in which case the
+  // socket addresses are kept.
+  Result parse(std::string_view data) {
+    if (data.empty()) {
+      return Result::incomplete;
+    }
+    if (data[0] == 'P') {
+      return parse_v1(data);
+    }
+    if (data[0] == '\r') {
+      return parse_v2(data);
+    }
+    return Result::error;
+  }
+
+  std::size_t header_size() const {
+    return header_size_;
+  }
+
+  const std::optional<asio::ip::tcp::endpoint> &source() const {
+    return source_;
+  }
+
+  const std::optional<asio::ip::tcp::endpoint> &destination() const {
+    return destination_;
+  }
+
+private:
+  static constexpr std::size_t kV1MaxLineSize = 107;
+  static constexpr std::string_view kV2Signature{"\r\n\r\n\0\r\nQUIT\n", 12};
+  static constexpr std::size_t kV2FixedSize = 16;
+
+  Result parse_v1(std::string_view data) {
+    if (!starts_with(data, "PROXY ")) {
+      return Result::error;
+    }
+    auto end = data.substr(0, kV1MaxLineSize).find("\r\n");
+    if (end == std::string_view::npos) {
+      return data.size() >= kV1MaxLineSize ? Result::error : Result::incomplete;
+    }
+    header_size_ = end + 2;
+    // "PROXY TCP4 <src> <dst> <sport> <dport>", or "PROXY UNKNOWN ...".
+    std::array<std::string_view, 5> fields;
+    std::size_t field_count = 0;
+    auto line = data.substr(6, end - 6);
+    while (!line.empty() && field_count < fields.size()) {
+      auto pos = line.find(' ');
+      fields[field_count++] = line.substr(0, pos);
+      line = pos == std::string_view::npos ? std::string_view() : line.substr(pos + 1);
+    }
+    if (fields[0] == "UNKNOWN") {
+      return Result::complete;
+    }
+    if ((fields[0] != "TCP4" && fields[0] != "TCP6") || field_count != fields.size() || !line.empty()) {
+      return Result::error;
+    }
+    source_ = parse_endpoint(fields[1], fields[3]);
+    destination_ = parse_endpoint(fields[2], fields[4]);
+    bool v4 = fields[0] == "TCP4";
+    if (!source_ || !destination_ || source_->address().is_v4() != v4 || destination_->address().is_v4() != v4) {
+      return Result::error;
+    }
+    return Result::complete;
+  }
+
+  Result parse_v2(std::string_view data) {
+    if (!starts_with(data, kV2Signature)) {
+      return Result::error;
+    }
+    if (data.size() < kV2FixedSize) {
+      return Result::incomplete;
+    }
+    auto version_command = static_cast<std::uint8_t>(data[12]);
+    auto family = static_cast<std::uint8_t>(data[13]);
+    auto length = read_uint16(data.substr(14));
+    if ((version_command >> 4) != 2 || (version_command & 0x0f) > 1 || kV2FixedSize + length > kProxyProtocolMaxHeaderSize) {
+      return Result::error;
+    }
+    if (data.size() < kV2FixedSize + length) {
+      return Result::incomplete;
+    }
+    header_size_ = kV2FixedSize + length;
+    if ((version_command & 0x0f) == 0) {
+      // LOCAL
+      return Result::complete;
+    }
+    // The address block is followed by TLVs, which are skipped.
+    auto addresses = data.substr(kV2FixedSize, length);
+    if (family == 0x11) {
+      if (addresses.size() < 12) {
+        return Result::error;
+      }
+      source_.emplace(asio::ip::address_v4(read_bytes<asio::ip::address_v4::bytes_type>(addresses)), read_uint16(addresses.substr(8)));
+      destination_.emplace(asio::ip::address_v4(read_bytes<asio::ip::address_v4::bytes_type>(addresses.substr(4))), read_uint16(addresses.substr(10)));
+    } else if (family == 0x21) {
+      if (addresses.size() < 36) {
+        return Result::error;
+      }
+      source_.emplace(asio::ip::address_v6(read_bytes<asio::ip::address_v6::bytes_type>(addresses)), read_uint16(addresses.substr(32)));
+      destination_.emplace(asio::ip::address_v6(read_bytes<asio::ip::address_v6::bytes_type>(addresses.substr(16))), read_uint16(addresses.substr(34)));
+    }
+    // Other families (UNSPEC, UDP, UNIX) keep the socket addresses.
+    return Result::complete;
+  }
+
+  // Compares what has arrived of a fixed prefix.
+  static bool starts_with(std::string_view data, std::string_view prefix) {
+    auto size = std::min(data.size(), prefix.size());
+    return data.substr(0, size) == prefix.substr(0, size);
+  }
+
+  static std::optional<asio::ip::tcp::endpoint> parse_endpoint(std::string_view address, std::string_view port) {
+    asio::error_code ec;
+    auto ip = asio::ip::make_address(std::string(address), ec);
+    asio::ip::port_type port_number = 0;
+    auto [end, errc] = std::from_chars(port.data(), port.data() + port.size(), port_number);
+    if (ec || errc != std::errc() || end != port.data() + port.size()) {
+      return std::nullopt;
+    }
+    return asio::ip::tcp::endpoint(ip, port_number);
+  }
+
+  template <typename Bytes>
+  static Bytes read_bytes(std::string_view data) {
+    Bytes bytes;
+    std::copy_n(data.begin(), bytes.size(), reinterpret_cast<char *>(bytes.data()));
+    return bytes;
+  }
+
+  static std::uint16_t read_uint16(std::string_view data) {
+    return static_cast<std::uint16_t>(static_cast<std::uint8_t>(data[0]) << 8 | static_cast<std::uint8_t>(data[1]));
+  }
+
+  std::size_t header_size_ = 0;
+  std::optional<asio::ip::tcp::endpoint> source_;
+  std::optional<asio::ip::tcp::endpoint> destination_;
+};
+
+// Extracts the SNI host name from a TLS ClientHello without terminating TLS.
+// The handshake message is read in place from the first record; only a
+// ClientHello split across several records is copied to be reassembled.
+class TlsClientHelloParser {
+public:
+  enum class Result {
+    incomplete,
+    complete,
+    error,
+  };
+
+  // Parses `data`, everything received so far. `complete` includes a
+  // ClientHello without SNI, which leaves `server_name()` empty. The name is a
+  // view into `data` or the parser, so both must outlive its use.
+  Result parse(std::string_view data) {
+    server_name_ = {};
+    handshake_.clear();
+    std::string_view handshake;
+    for (std::size_t pos = 0;;) {
+      if (data.size() - pos < kRecordHeaderSize) {
+        return Result::incomplete;
+      }
+      auto record_length = read_uint16(data.substr(pos + 3));
+      if (data[pos] != kHandshakeRecord || data[pos + 1] != 3 || record_length == 0 || record_length > kMaxRecordSize) {
+        return Result::error;
+      }
+      auto fragment = data.substr(pos + kRecordHeaderSize, record_length);
+      if (pos == 0 && message_size(fragment) <= fragment.size()) {
+        handshake = fragment;
+        break;
+      }
+      handshake_.append(fragment);
+      if (message_size(handshake_) <= handshake_.size()) {
+        handshake = handshake_;
+        break;
+      }
+      if (fragment.size() < record_length) {
+        return Result::incomplete;
+      }
+      pos += kRecordHeaderSize + record_length;
+    }
+    if (handshake[0] != kClientHello) {
+      return Result::error;
+    }
+    return parse_client_hello(handshake.substr(4, message_size(handshake) - 4)) ? Result::complete : Result::error;
+  }
+
+  std::string_view server_name() const {
+    return server_name_;
+  }
+
+private:
+  static constexpr char kHandshakeRecord = 22;
+  static constexpr char kClientHello = 1;
+  static constexpr std::size_t kRecordHeaderSize = 5;
+  static constexpr std::size_t kMaxRecordSize = 16384;
+  static constexpr std::uint16_t kServerNameExtension = 0;
+
+  // Reads the length-prefixed fields of the message front to back.
+  struct Reader {
+    std::string_view data;
+
+    bool skip(std::size_t size) {
+      if (data.size() < size) {
+        return false;
+      }
+      data.remove_prefix(size);
+      return true;
+    }
+
+    bool read_uint16(std::uint16_t &value) {
+      if (data.size() < 2) {
+        return false;
+      }
+      value = TlsClientHelloParser::read_uint16(data);
+      data.remove_prefix(2);
+      return true;
+    }
+
+    bool read_vector(std::size_t length_size, std::string_view &value) {
+      if (data.size() < length_size) {
+        return false;
+      }
+      std::size_t length = length_size == 1 ? static_cast<std::uint8_t>(data[0]) : TlsClientHelloParser::read_uint16(data);
+      data.remove_prefix(length_size);
+      if (data.size() < length) {
+        return false;
+      }
+      value = data.substr(0, length);
+      data.remove_prefix(length);
+      return true;
+    }
+  };
+
+  // Size of the handshake message including its 4-byte header, or npos while
+  // the header itself is incomplete.
+  static std::size_t message_size(std::string_view handshake) {
+    if (handshake.size() < 4) {
+      return std::string_view::npos;
+    }
+    return 4 + (static_cast<std::size_t>(static_cast<std::uint8_t>(handshake[1])) << 16 | read_uint16(handshake.substr(2)));
+  }
+
+  bool parse_client_hello(std::string_view body) {
+    Reader reader{body};
+    std::string_view session_id, cipher_suites, compression_methods, extensions;
+    // legacy_version and random
+    if (!reader.skip(2 + 32) || !reader.read_vector(1, session_id) || !reader.read_vector(2, cipher_suites) ||
+        !reader.read_vector(1, compression_methods)) {
+      return false;
+    }
+    if (reader.data.empty()) {
+      return true;
+    }
+    if (!reader.read_vector(2, extensions)) {
+      return false;
+    }
+    Reader extension_reader{extensions};
+    while (!extension_reader.data.empty()) {
+      std::uint16_t type;
+      std::string_view extension;
+      if (!extension_reader.read_uint16(type) || !extension_reader.read_vector(2, extension)) {
+        return false;
+      }
+      if (type != kServerNameExtension) {
+        continue;
+      }
+      Reader name_reader{extension};
+      std::string_view names;
+      if (!name_reader.read_vector(2, names)) {
+        return false;
+      }
+      Reader names_reader{names};
+      while (!names_reader.data.empty()) {
+        std::string_view name;
+        auto name_type = names_reader.data[0];
+        if (!names_reader.skip(1) || !names_reader.read_vector(2, name)) {
+          return false;
+        }
+        if (name_type == 0) {
+          server_name_ = name;
+          return true;
+        }
+      }
+    }
+    return true;
+  }
+
+  static std::uint16_t read_uint16(std::string_view data) {
+    return static_cast<std::uint16_t>(static_cast<std::uint8_t>(data[0]) << 8 | static_cast<std::uint8_t>(data[1]));
+  }
+
+  std::string handshake_;
+  std::string_view server_name_;
+};
+
+// Tells the protocol of a client connection from its first bytes. Each check
+// only looks at a fixed prefix, so a decision needs a few bytes at most.
+class ProtocolSniffer {
+public:
+  // Returns nullopt while the bytes so far are a prefix of a known protocol
+  // and `final` is false.
+  static std::optional<SniffedProtocol> sniff(std::string_view data, bool final) {
+    static constexpr std::string_view kHttpMethods[] = {"GET ", "POST ", "PUT ", "HEAD ", "DELETE ", "OPTIONS ", "PATCH ", "CONNECT ",
+      "TRACE ", "PRI "};
+    bool partial = false;
+    auto check = [&data, &partial](std::string_view prefix) {
+      auto size = std::min(data.size(), prefix.size());
+      if (data.substr(0, size) != prefix.substr(0, size)) {
+        return false;
+      }
+      partial |= size < prefix.size();
+      return size == prefix.size();
+    };
+    if (check(kTlsHandshake)) {
+      return SniffedProtocol::tls;
+    }
+    if (check("SSH-")) {
+      return SniffedProtocol::ssh;
+    }
+    if (check("PROXY ") || check(kProxyProtocolV2Signature)) {
+      return SniffedProtocol::proxy_protocol;
+    }
+    for (auto method : kHttpMethods) {
+      if (check(method)) {
+        return SniffedProtocol::http;
+      }
+    }
+    if (partial && !final) {
+      return std::nullopt;
+    }
+    return SniffedProtocol::unknown;
+  }
+
+  static std::optional<SniffedProtocol> parse_protocol(std::string_view name) {
+    if (name == "tls") {
+      return SniffedProtocol::tls;
+    } else if (name == "http") {
+      return SniffedProtocol::http;
+    } else if (name == "ssh") {
+      return SniffedProtocol::ssh;
+    } else if (name == "proxy") {
+      return SniffedProtocol::proxy_protocol;
+    }
+    return std::nullopt;
+  }
+
+private:
+  // Handshake record, major version 3.
+  static constexpr std::string_view kTlsHandshake{"\x16\x03", 2};
+  static constexpr std::string_view kProxyProtocolV2Signature{"\r\n\r\n\0\r\nQUIT\n", 12};
+};
+
+// Finds the Host header of the first request on a plain HTTP connection. Each
+// call resumes at the first line it has not seen yet and the scan stops at the
+// Host line or the empty line that ends the header, so the header is walked
+// once however it is split. Line ends are found with memchr via
+// std::string_view::find, which the C library vectorizes.
+class HttpHostScanner {
+public:
+  enum class Result {
+    incomplete,
+    complete,
+  };
+
+  // Scans `data`, everything received so far. `complete` includes a request
+  // without a Host header, which leaves `host()` empty.
+  Result scan(std::string_view data) {
+    for (;;) {
+      auto end = data.find('\n', line_start_);
+      if (end == std::string_view::npos) {
+        return Result::incomplete;
+      }
+      auto line = data.substr(line_start_, end - line_start_);
+      if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+      }
+      bool request_line = line_start_ == 0;
+      line_start_ = end + 1;
+      if (request_line) {
+        continue;
+      }
+      if (line.empty()) {
+        return Result::complete;
+      }
+      if (line.size() > 5 && equals_ignore_case(line.substr(0, 5), "host:")) {
+        auto value = trim(line.substr(5));
+        if (value.starts_with('[')) {
+          // IPv6 literal
+          value = value.substr(0, value.find(']') + 1);
+        } else if (auto colon = value.rfind(':'); colon != std::string_view::npos) {
+          value = value.substr(0, colon);
+        }
+        host_offset_ = value.data() - data.data();
+        host_size_ = value.size();
+        return Result::complete;
+      }
+    }
+  }
+
+  // The Host value without the port, a view into `data`.
+  std::string_view host(std::string_view data) const {
+    return data.substr(host_offset_, host_size_);
+  }
+
+private:
+  static bool equals_ignore_case(std::string_view a, std::string_view lower) {
+    return std::equal(a.begin(), a.end(), lower.begin(), lower.end(), [](char c, char l) { return (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c) == l; });
+  }
+
+  static std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+      value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+      value.remove_suffix(1);
+    }
+    return value;
+  }
+
+  std::size_t line_start_ = 0;
+  std::size_t host_offset_ = 0;
+  std::size_t host_size_ = 0;
+};
+
+// Exact and wildcard ("*.example.com") host names mapped to target groups. A
+// wildcard matches subdomains at any depth. The exact name wins, then the
+// longest wildcard suffix, so a lookup costs at most one probe per label.
+class HostnameTable {
+public:
+  void add(std::string_view pattern, std::shared_ptr<TargetGroup> group) {
+    if (pattern.starts_with("*.")) {
+      wildcards_[to_lower(pattern.substr(1))] = std::move(group);
+    } else {
+      exact_[to_lower(pattern)] = std::move(group);
+    }
+  }
+
+  bool empty() const {
+    return exact_.empty() && wildcards_.empty();
+  }
+
+  std::shared_ptr<TargetGroup> find(std::string_view hostname) const {
+    if (!hostname.empty() && hostname.back() == '.') {
+      hostname.remove_suffix(1);
+    }
+    std::array<char, kMaxHostnameSize> buffer;
+    if (hostname.empty() || hostname.size() > buffer.size()) {
+      return nullptr;
+    }
+    std::transform(hostname.begin(), hostname.end(), buffer.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; });
+    std::string_view name(buffer.data(), hostname.size());
+    if (auto it = exact_.find(name); it != exact_.end()) {
+      return it->second;
+    }
+    if (wildcards_.empty()) {
+      return nullptr;
+    }
+    for (auto pos = name.find('.'); pos != std::string_view::npos; pos = name.find('.', pos + 1)) {
+      if (auto it = wildcards_.find(name.substr(pos)); it != wildcards_.end()) {
+        return it->second;
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  static constexpr std::size_t kMaxHostnameSize = 255;
+
+  struct Hash {
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view value) const {
+      return std::hash<std::string_view>()(value);
+    }
+  };
+
+  using Map = std::unordered_map<std::string, std::shared_ptr<TargetGroup>, Hash, std::equal_to<>>;
+
+  static std::string to_lower(std::string_view value) {
+    std::string result(value);
+    std::transform(result.begin(), result.end(), result.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; });
+    return result;
+  }
+
+  Map exact_;
+  // Keyed by the suffix including its leading dot, e.g. ".example.com".
+  Map wildcards_;
+};
+
+// Longest-prefix-match table from IPv4/IPv6 prefixes to values, built once
+// when the listener is created. It is laid out like a poptrie: the top 18
+// address bits index a flat array directly, and below that each node covers 6
+// bits with a 64-bit bitmap of children and one of leaf runs, so children and
+// leaves are found by popcount into flat arrays. Leaves are pushed down at
+// build time, so a lookup stops at the first leaf without tracking the best
+// match so far: at most 3 nodes below the array for IPv4.
+class PrefixTable {
+public:
+  // Returns false if `length` is longer than the address, or too short for an
+  // IPv4-mapped one. Host bits are ignored; of two equal prefixes the one
+  // added last wins. Values must be below 2^31.
+  bool add(asio::ip::address address, std::uint32_t length, std::uint32_t value) {
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+      if (length < 96) {
+        return false;
+      }
+      length -= 96;
+    }
+    bool v6;
+    auto key = to_key(address, v6);
+    if (length > (v6 ? 128u : 32u)) {
+      return false;
+    }
+    for (std::uint32_t bit = length; bit < 128; ++bit) {
+      key[bit / 64] &= ~(std::uint64_t(1) << (63 - bit % 64));
+    }
+    (v6 ? v6_ : v4_).prefixes.push_back({key, length, value});
+    return true;
+  }
+
+  bool empty() const {
+    return v4_.prefixes.empty() && v4_.direct.empty() && v6_.prefixes.empty() && v6_.direct.empty();
+  }
+
+  void build() {
+    for (auto *trie : {&v4_, &v6_}) {
+      if (trie->prefixes.empty()) {
+        continue;
+      }
+      auto &prefixes = trie->prefixes;
+      auto deeper = std::stable_partition(prefixes.begin(), prefixes.end(), [](const auto &prefix) { return prefix.length <= kDirectBits; });
+      std::stable_sort(prefixes.begin(), deeper, [](const auto &a, const auto &b) { return a.length < b.length; });
+      std::stable_sort(deeper, prefixes.end(), [](const auto &a, const auto &b) { return direct_index(a.key) < direct_index(b.key); });
+      trie->direct.assign(std::size_t(1) << kDirectBits, 0);
+      for (auto it = prefixes.begin(); it != deeper; ++it) {
+        auto span = std::uint32_t(1) << (kDirectBits - it->length);
+        std::fill_n(trie->direct.begin() + (direct_index(it->key) & ~(span - 1)), span, it->value);
+      }
+      for (auto group = deeper; group != prefixes.end();) {
+        auto index = direct_index(group->key);
+        auto group_end = std::find_if(group, prefixes.end(), [index](const auto &prefix) { return direct_index(prefix.key) != index; });
+        auto node = static_cast<std::uint32_t>(trie->nodes.size());
+        trie->nodes.emplace_back();
+        trie->nodes[node] = build_node(*trie, std::span<const Prefix>(group, group_end), kDirectBits, trie->direct[index]);
+        trie->direct[index] = kNodeFlag | node;
+        group = group_end;
+      }
+      trie->prefixes = {};
+    }
+  }
+
+  // Returns the value of the longest matching prefix, or 0 if none matches.
+  std::uint32_t find(const asio::ip::address &address) const {
+    bool v6;
+    auto key = to_key(address, v6);
+    const auto &trie = v6 ? v6_ : v4_;
+    if (trie.direct.empty()) {
+      return 0;
+    }
+    auto entry = trie.direct[direct_index(key)];
+    if (!(entry & kNodeFlag)) {
+      return entry;
+    }
+    const Node *node = &trie.nodes[entry & ~kNodeFlag];
+    for (std::uint32_t offset = kDirectBits;; offset += kStride) {
+      auto chunk = chunk_at(key, offset);
+      auto mask = (std::uint64_t(2) << chunk) - 1;
+      if (!(node->children >> chunk & 1)) {
+        return trie.leaves[node->leaf_base + std::popcount(node->leaf_runs & mask) - 1];
+      }
+      node = &trie.nodes[node->child_base + std::popcount(node->children & mask) - 1];
+    }
+  }
+
+private:
+  static constexpr std::uint32_t kDirectBits = 18;
+  static constexpr std::uint32_t kStride = 6;
+  // Marks an entry of the direct array that holds a node index, not a value.
+  static constexpr std::uint32_t kNodeFlag = 0x80000000;
+
+  // Address bits, most significant first; IPv4 uses the top 32 bits.
+  using Key = std::array<std::uint64_t, 2>;
+
+  struct Prefix {
+    Key key;
+    std::uint32_t length;
+    std::uint32_t value;
+  };
+
+  // Bit i of `children` is set if entry i has a child node. Bit i of
+  // `leaf_runs` is set if entry i starts a run of equal leaves.
+  struct Node {
+    std::uint64_t children;
+    std::uint64_t leaf_runs;
+    std::uint32_t child_base;
+    std::uint32_t leaf_base;
+  };
+
+  struct Trie {
+    std::vector<Prefix> prefixes;
+    std::vector<std::uint32_t> direct;
+    std::vector<Node> nodes;
+    std::vector<std::uint32_t> leaves;
+  };
+
+  // Sets `v6` to whether the address is IPv6 after unmapping IPv4-mapped
+  // ones. Builds the key straight from the bytes, without the copies and
+  // checks of asio's unmapping, which cost more than a lookup in the array.
+  static Key to_key(const asio::ip::address &address, bool &v6) {
+    if (address.is_v4()) {
+      v6 = false;
+      return {std::uint64_t(address.to_v4().to_uint()) << 32, 0};
+    }
+    auto bytes = address.to_v6().to_bytes();
+    Key key = {0, 0};
+    for (std::size_t i = 0; i < 8; ++i) {
+      key[0] = key[0] << 8 | bytes[i];
+      key[1] = key[1] << 8 | bytes[8 + i];
+    }
+    // ::ffff:0:0/96
+    v6 = key[0] != 0 || key[1] >> 32 != 0xffff;
+    if (!v6) {
+      return {key[1] << 32, 0};
+    }
+    return key;
+  }
+
+  static std::uint32_t direct_index(const Key &key) {
+    return static_cast<std::uint32_t>(key[0] >> (64 - kDirectBits));
+  }
+
+  // The 6 bits at `offset`, zero past the end of the key.
+  static std::uint32_t chunk_at(const Key &key, std::uint32_t offset) {
+    auto word = offset / 64;
+    auto shift = offset % 64;
+    std::uint64_t bits = word < key.size() ? key[word] << shift : 0;
+    if (shift > 64 - kStride && word + 1 < key.size()) {
+      bits |= key[word + 1] >> (64 - shift);
+    }
+    return static_cast<std::uint32_t>(bits >> (64 - kStride));
+  }
+
+  // `prefixes` all lie below this node, in the order they were added.
+  // Prefixes that end within its stride fill its entries, shortest first, on
+  // top of the value inherited from above; longer ones go down to the
+  // children, which inherit the entry they hang off.
+  static Node build_node(Trie &trie, std::span<const Prefix> prefixes, std::uint32_t offset, std::uint32_t inherited) {
+    std::array<std::uint32_t, 64> leaves;
+    leaves.fill(inherited);
+    std::vector<const Prefix *> ending;
+    std::array<std::vector<Prefix>, 64> deeper;
+    for (const auto &prefix : prefixes) {
+      if (prefix.length <= offset + kStride) {
+        ending.push_back(&prefix);
+      } else {
+        deeper[chunk_at(prefix.key, offset)].push_back(prefix);
+      }
+    }
+    std::stable_sort(ending.begin(), ending.end(), [](const auto *a, const auto *b) { return a->length < b->length; });
+    for (const auto *prefix : ending) {
+      auto span = std::uint32_t(1) << (offset + kStride - prefix->length);
+      auto first = chunk_at(prefix->key, offset) & ~(span - 1);
+      std::fill_n(leaves.begin() + first, span, prefix->value);
+    }
+    Node node = {0, 0, 0, static_cast<std::uint32_t>(trie.leaves.size())};
+    for (std::uint32_t i = 0; i < leaves.size(); ++i) {
+      if (i == 0 || leaves[i] != leaves[i - 1]) {
+        node.leaf_runs |= std::uint64_t(1) << i;
+        trie.leaves.push_back(leaves[i]);
+      }
+      if (!deeper[i].empty()) {
+        node.children |= std::uint64_t(1) << i;
+      }
+    }
+    // Children of one node are contiguous, so they are reserved before
+    // recursing into any of them.
+    node.child_base = static_cast<std::uint32_t>(trie.nodes.size());
+    trie.nodes.resize(trie.nodes.size() + std::popcount(node.children));
+    auto child = node.child_base;
+    for (std::uint32_t i = 0; i < deeper.size(); ++i) {
+      if (!deeper[i].empty()) {
+        auto child_node = build_node(trie, deeper[i], offset + kStride, leaves[i]);
+        trie.nodes[child++] = child_node;
+        deeper[i] = {};
+      }
+    }
+    return node;
+  }
+
+  Trie v4_;
+  Trie v6_;
+};
+
+// Picks the target group of a session, possibly from the first bytes the
+// client sends: an SNI route for TLS or a Host route for HTTP, then the route
+// of the sniffed protocol, then the default. Client subnet rules are checked
+// before any of that. Built once per listener and shared read-only by its
+// sessions. The first request decides for the whole connection; later
+// keep-alive requests follow it to the same target.
+class Router {
+public:
+  using ProtocolRoutes = std::array<std::shared_ptr<TargetGroup>, static_cast<std::size_t>(SniffedProtocol::unknown)>;
+
+  // Parsing progress of one session, so that each call only looks at new bytes.
+  struct State {
+    HttpHostScanner http;
+  };
+
+  // The longest matching prefix selects a rule; its value is the rule index
+  // plus one. The ports of a range share one prefix table.
+  struct ClientRule {
+    bool allow;
+    std::shared_ptr<TargetGroup> group;
+  };
+  struct ClientRules {
+    std::shared_ptr<const PrefixTable> prefixes;
+    std::vector<ClientRule> rules;
+    bool deny_unmatched = false;
+  };
+
+  Router(std::shared_ptr<TargetGroup> default_group, HostnameTable sni_routes, HostnameTable host_routes, ProtocolRoutes protocol_routes,
+      ClientRules client_rules)
+    : default_group_(std::move(default_group)), sni_routes_(std::move(sni_routes)), host_routes_(std::move(host_routes)),
+      protocol_routes_(std::move(protocol_routes)), client_rules_(std::move(client_rules)) {}
+
+  bool filters_clients() const {
+    return !client_rules_.rules.empty();
+  }
+
+  // Returns nullopt if the client must be rejected. A non-null group is the
+  // fixed route of the client's subnet, which skips all other routes.
+  std::optional<std::shared_ptr<TargetGroup>> match_client(const asio::ip::address &address) const {
+    auto index = client_rules_.prefixes->find(address);
+    if (index == 0) {
+      return client_rules_.deny_unmatched ? std::nullopt : std::optional<std::shared_ptr<TargetGroup>>(nullptr);
+    }
+    const auto &rule = client_rules_.rules[index - 1];
+    if (!rule.allow) {
+      return std::nullopt;
+    }
+    return rule.group;
+  }
+
+  bool inspects_client_data() const {
+    return !sni_routes_.empty() || !host_routes_.empty() || std::any_of(protocol_routes_.begin(), protocol_routes_.end(), [](const auto &group) { return group != nullptr; });
+  }
+
+  // Returns nullopt while more client data is needed and `final` is false.
+  // A null group means that no route matches and there is no default.
+  std::optional<std::shared_ptr<TargetGroup>> route(std::string_view client_data, bool final, State &state) const {
+    auto protocol = ProtocolSniffer::sniff(client_data, final);
+    if (!protocol) {
+      return std::nullopt;
+    }
+    if (*protocol == SniffedProtocol::tls && !sni_routes_.empty()) {
+      TlsClientHelloParser parser;
+      auto result = parser.parse(client_data);
+      if (result == TlsClientHelloParser::Result::incomplete && !final) {
+        return std::nullopt;
+      }
+      if (result == TlsClientHelloParser::Result::complete && !parser.server_name().empty()) {
+        if (auto group = sni_routes_.find(parser.server_name())) {
+          return group;
+        }
+      }
+    }
+    if (*protocol == SniffedProtocol::http && !host_routes_.empty()) {
+      auto result = state.http.scan(client_data);
+      if (result == HttpHostScanner::Result::incomplete && !final) {
+        return std::nullopt;
+      }
+      if (result == HttpHostScanner::Result::complete && !state.http.host(client_data).empty()) {
+        if (auto group = host_routes_.find(state.http.host(client_data))) {
+          return group;
+        }
+      }
+    }
+    if (*protocol != SniffedProtocol::unknown) {
+      if (const auto &group = protocol_routes_[static_cast<std::size_t>(*protocol)]) {
+        return group;
+      }
+    }
+    return default_group_;
+  }
+
+  const std::shared_ptr<TargetGroup> &default_group() const {
+    return default_group_;
+  }
+
+private:
+  std::shared_ptr<TargetGroup> default_group_;
+  HostnameTable sni_routes_;
+  HostnameTable host_routes_;
+  ProtocolRoutes protocol_routes_;
+  ClientRules client_rules_;
+};
+
+struct RelayConnectionOptions {
+  std::uint32_t timeout;
+  std::uint32_t connect_timeout;
+  std::uint32_t connect_attempts;
+  std::vector<ProxyHop> proxy_chain;
+  bool http_proxy_pipelining;
+  ProxyProtocolVersion proxy_protocol;
+  bool proxy_protocol_session_id;
+  bool accept_proxy_protocol;
+  std::uint32_t sniff_timeout;
+  std::size_t sniff_max_size;
+  // Offset of the listen port from the first one of its range.
+  std::uint32_t port_offset;
+};
+
+class RelayConnection {
+public:
+  RelayConnection(std::uint64_t session_id, const RelayConnectionOptions &options, std::shared_ptr<const Router> router,
+      std::shared_ptr<RetryBudget> retry_budget, std::shared_ptr<Http2ConnectionPool> http2_pool,
+      std::shared_ptr<ClientLimiter> client_limiter)
+    : session_id_(session_id), options_(options), router_(std::move(router)), retry_budget_(std::move(retry_budget)),
+      http2_pool_(std::move(http2_pool)), client_limiter_(std::move(client_limiter)) {}
+
+  ~RelayConnection() {
+    if (target_) {
+      target_->connection_finished();
+    }
+  }
+
+  // `client_group` is the fixed route of the client's subnet, if any.
+  asio::awaitable<void> relay(asio::ip::tcp::socket client, std::shared_ptr<TargetGroup> client_group) {
+    start_time_ = std::chrono::steady_clock::now();
+    auto client_endpoint = client.remote_endpoint();
+    auto local_endpoint = client.local_endpoint();
+    std::string client_data;
+    if (options_.accept_proxy_protocol) {
+      try {
+        client_data = co_await read_proxy_protocol_header(client, client_endpoint, local_endpoint);
+      } catch (std::exception &) {
+        Metrics::proxy_protocol_rejections.add();
+        Log::info("[session: {}] | rejected, no valid PROXY protocol header from {}", session_id_, endpoint_to_string(client_endpoint));
+        co_return;
+      }
+      if (router_->filters_clients()) {
+        auto match = router_->match_client(client_endpoint.address());
+        if (!match) {
+          Metrics::client_denials.add();
+          Log::info("[session: {}] | rejected, client {} denied", session_id_, endpoint_to_string(client_endpoint));
+          co_return;
+        }
+        client_group = std::move(*match);
+      }
+      if (client_limiter_) {
+        client_lease_ = client_limiter_->admit(client_endpoint.address());
+        if (!client_lease_) {
+          Metrics::client_limit_rejections.add();
+          Log::info("[session: {}] | rejected, connection limit reached for {}", session_id_, endpoint_to_string(client_endpoint));
+          co_return;
+        }
+      }
+    }
+    Log::info("[session: {}] | start connection from {}", session_id_, endpoint_to_string(client_endpoint));
+    if (client_group) {
+      target_group_ = std::move(client_group);
+    } else if (router_->inspects_client_data()) {
+      try {
+        target_group_ = co_await peek_route(client, client_data);
+      } catch (std::exception &) {
+        Log::info("[session: {}] | end connection", session_id_);
+        co_return;
+      }
+    } else {
+      target_group_ = router_->default_group();
+    }
+    if (!target_group_) {
+      Metrics::route_misses.add();
+      Log::info("[session: {}] | rejected, no route matches", session_id_);
+      co_return;
+    }
+    target_ = target_group_->select(client_endpoint.address());
+    if (!target_) {
+      Metrics::circuit_breaker_rejections.add();
+      Log::info("[session: {}] | rejected, circuit open", session_id_);
+      co_return;
+    }
+    target_->connection_started();
+    try {
+      auto executor = co_await asio::this_coro::executor;
+      if (options_.proxy_protocol != ProxyProtocolVersion::none) {
+        pending_uplink_ = ProxyProtocolHeader::encode(options_.proxy_protocol, client_endpoint, local_endpoint,
+            options_.proxy_protocol_session_id ? std::optional<std::uint64_t>(session_id_) : std::nullopt);
+      }
+      pending_client_data_ = !client_data.empty();
+      if (pending_uplink_.empty()) {
+        pending_uplink_ = std::move(client_data);
+      } else {
+        pending_uplink_ += client_data;
+      }
+      Tunnel tunnel = co_await open_tunnel(client);
+      if (!tunnel.pending_downlink.empty()) {
+        co_await forward_pending_downlink(client, tunnel.pending_downlink);
+      }
+      if (tunnel.stream) {
+        co_await tunnel_transfer(client, *tunnel.stream);
+      } else {
+        co_await tunnel_transfer(client, tunnel.socket);
+      }
+    } catch (std::exception &e) {
+    }
+    Log::info("[session: {}] | end connection", session_id_);
+  }
+
+private:
+  // Replaces the endpoints with the ones the load balancer reports and returns
+  // the client data that arrived together with the header.
+  asio::awaitable<std::string> read_proxy_protocol_header(asio::ip::tcp::socket &client, asio::ip::tcp::endpoint &client_endpoint,
+      asio::ip::tcp::endpoint &local_endpoint) {
+    Watchdog watchdog(co_await asio::this_coro::executor);
+    watchdog.expires_after(std::chrono::seconds(kProxyProtocolHeaderTimeout));
+    std::array<char, kProxyProtocolMaxHeaderSize> header;
+    std::size_t bytes_received = 0;
+    ProxyProtocolParser parser;
+    for (;;) {
+      if (bytes_received == header.size()) {
+        Log::debug("[session: {}] | PROXY protocol header too large", session_id_);
+        throw std::runtime_error("PROXY protocol header too large");
+      }
+      auto [ec, bytes_read] = co_await client.async_read_some(asio::buffer(header.data() + bytes_received, header.size() - bytes_received),
+        asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+      if (watchdog.is_expired()) {
+        Log::debug("[session: {}] | read PROXY protocol header timeout", session_id_);
+        throw std::system_error(std::make_error_code(std::errc::timed_out));
+      }
+      if (ec) {
+        Log::debug("[session: {}] | read PROXY protocol header error: {}", session_id_, ec.message());
+        throw std::system_error(ec);
+      }
+      bytes_received += bytes_read;
+      auto result = parser.parse(std::string_view(header.data(), bytes_received));
+      if (result == ProxyProtocolParser::Result::complete) {
+        break;
+      }
+      if (result == ProxyProtocolParser::Result::error) {
+        Log::debug("[session: {}] | bad PROXY protocol header", session_id_);
+        throw std::runtime_error("bad PROXY protocol header");
+      }
+    }
+    if (parser.source()) {
+      Log::debug("[session: {}] | PROXY protocol client {} via {}", session_id_, endpoint_to_string(*parser.source()), endpoint_to_string(client_endpoint));
+      client_endpoint = *parser.source();
+      local_endpoint = *parser.destination();
+    }
+    co_return std::string(header.data() + parser.header_size(), bytes_received - parser.header_size());
+  }
+
+  // Reads client data until the router can pick a target group, within the
+  // sniff deadline and buffer size, then decides with what has arrived. The
+  // bytes stay in `data` to be replayed to the target.
+  asio::awaitable<std::shared_ptr<TargetGroup>> peek_route(asio::ip::tcp::socket &client, std::string &data) {
+    Watchdog watchdog(co_await asio::this_coro::executor);
+    watchdog.expires_after(std::chrono::seconds(options_.sniff_timeout));
+    Router::State state;
+    for (;;) {
+      if (auto group = router_->route(data, data.size() >= options_.sniff_max_size, state)) {
+        Log::debug("[session: {}] | routed after peeking {} bytes", session_id_, data.size());
+        co_return *group;
+      }
+      auto offset = data.size();
+      data.resize(options_.sniff_max_size);
+      auto [ec, bytes_read] = co_await client.async_read_some(asio::buffer(data.data() + offset, data.size() - offset),
+        asio::as_tuple(asio::bind_cancellation_slot(watchdog.cancel_slot(), asio::use_awaitable)));
+      data.resize(offset + bytes_read);
+      if (watchdog.is_expired()) {
+        Log::debug("[session: {}] | peek timeout after {} bytes", session_id_, data.size());
+        co_return *router_->route(data, true, state);
+      }
+      if (ec == asio::error::eof && !data.empty()) {
+        // The client sent all it has and half-closed; the relay forwards the
+        // bytes and the close.
+        Log::debug("[session: {}] | peek eof after {} bytes", session_id_, data.size());
+        co_return *router_->route(data, true, state);
+      }
+      if (ec) {
+        Log::debug("[session: {}] | peek read error: {}", session_id_, ec.message());
+        throw std::system_error(ec);
+      }
+    }
+  }
+
+  // Returns a socket that is ready to carry client data to the target, either
+  // taken from the pool (already tunneled in http-proxy mode) or freshly opened.
+  // A failed attempt fails over to another target while the retry budget allows.
+  asio::awaitable<Tunnel> open_tunnel(asio::ip::tcp::socket &client) {
+    if (const auto &pool = target_->pool(options_.port_offset)) {
+      if (auto tunnel = pool->acquire()) {
+        Log::debug("[session: {}] | use pooled connection to {}", session_id_, endpoint_to_string(tunnel->socket.remote_endpoint()));
+        co_return std::move(*tunnel);
+      }
+    }
+    retry_budget_->record_attempt();
+    std::vector<std::shared_ptr<Target>> tried;
+    for (std::uint32_t attempt = 1;; ++attempt) {
+      UpstreamConnector connector(stdx::format("session: {}", session_id_));
+      connector.set_deadline(std::chrono::steady_clock::now() + std::chrono::seconds(options_.connect_timeout));
+      std::optional<asio::ip::tcp::socket> server;
+      std::string pending_downlink;
+      std::shared_ptr<Http2Stream> stream;
+      std::exception_ptr error;
+      auto permit = co_await target_->connect_limiter().acquire();
+      if (permit) {
+        try {
+          if (http2_pool_) {
+            stream = co_await open_http2_stream(connector);
+          } else {
+            server.emplace(co_await connect_to_server(connector));
+          }
+          if (server && !options_.proxy_chain.empty()) {
+            if (options_.proxy_chain.back().type == ViaType::http_proxy && options_.http_proxy_pipelining && !early_data_read_) {
+              read_early_data(client);
+            }
+            pending_downlink = co_await connector.proxy_handshake(*server, *target_->proxy_chain(options_.port_offset), asio::buffer(early_data_));
+          }
+        } catch (std::exception &) {
+          error = std::current_exception();
+        }
+        target_group_->record_outcome(target_, !error);
+        if (!error && stream) {
+          co_return Tunnel{asio::ip::tcp::socket(co_await asio::this_coro::executor), {}, std::move(stream)};
+        }
+        if (!error) {
+          co_return Tunnel{std::move(*server), std::move(pending_downlink), nullptr};
+        }
+      } else {
+        auto address = target_->address(options_.port_offset);
+        Log::debug("[session: {}] | upstream connect queue of {}:{} is full or timed out", session_id_, std::get<0>(address), std::get<1>(address));
+        error = std::make_exception_ptr(std::system_error(std::make_error_code(std::errc::resource_unavailable_try_again)));
+      }
+      tried.push_back(target_);
+      if (attempt >= options_.connect_attempts) {
+        std::rethrow_exception(error);
+      }
+      auto next_target = target_group_->select_retry(tried);
+      if (!next_target) {
+        std::rethrow_exception(error);
+      }
+      if (!retry_budget_->try_acquire_retry()) {
+        Metrics::connect_retry_budget_exhausted.add();
+        Log::debug("[session: {}] | retry budget exhausted", session_id_);
+        std::rethrow_exception(error);
+      }
+      Metrics::connect_retries.add();
+      auto next_address = next_target->address(options_.port_offset);
+      Log::debug("[session: {}] | retry on {}:{}", session_id_, std::get<0>(next_address), std::get<1>(next_address));
+      target_->connection_finished();
+      target_ = std::move(next_target);
+      target_->connection_started();
+    }
+  }
+
+  // Takes whatever the client has sent so far without waiting for more, so it
+  // can ride along with the CONNECT request. A failed attempt keeps the bytes
+  // to send them again with the next one. Bytes already queued for the target
+  // go in front of them.
+  void read_early_data(asio::ip::tcp::socket &client) {
+    early_data_read_ = true;
+    early_data_ = std::move(pending_uplink_);
+    pending_uplink_.clear();
+    asio::error_code ec;
+    auto available = client.available(ec);
+    if (ec || available == 0) {
+      return;
+    }
+    auto offset = early_data_.size();
+    early_data_.resize(offset + std::min(available, kMaxEarlyDataSize));
+    auto bytes_read = client.read_some(asio::buffer(early_data_.data() + offset, early_data_.size() - offset), ec);
+    early_data_.resize(offset + (ec ? 0 : bytes_read));
+  }
+
+  asio::awaitable<void> forward_pending_downlink(asio::ip::tcp::socket &client, const std::string &data) {
+    Log::trace("[session: {}] | forward {} bytes received during the handshake", session_id_, data.size());
+    record_first_byte();
+    auto [ec, bytes_written] = co_await asio::async_write(client, asio::buffer(data), asio::as_tuple(asio::use_awaitable));
+    if (ec) {
+      Log::debug("[session: {}] | downlink transfer write error: {}", session_id_, ec.message());
+      throw std::system_error(ec);
+    }
+  }
+
+  void record_first_byte() {
+    if (!first_byte_received_) {
+      first_byte_received_ = true;
+      Metrics::session_ttfb.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time_));
+    }
+  }
+
+  // The shared HTTP/2 connection is not this target's connect latency, so the
+  // stream round trip is recorded instead.
+  asio::awaitable<std::shared_ptr<Http2Stream>> open_http2_stream(UpstreamConnector &connector) {
+    const auto &request = *target_->http2_connect_request(options_.port_offset);
+    Log::debug("[session: {}] | open http2 stream CONNECT {}", session_id_, request.authority());
+    auto start_time = std::chrono::steady_clock::now();
+    auto deadline = std::min(start_time + std::chrono::seconds(kProxyHandshakeTimeout), connector.deadline());
+    std::shared_ptr<Http2Stream> stream;
+    try {
+      stream = co_await http2_pool_->open_stream(connector, request, deadline);
+      co_await stream->wait_for_response(deadline);
+    } catch (std::exception &e) {
+      Log::error("[session: {}] | http2 CONNECT {} failed: {}", session_id_, request.authority(), e.what());
+      target_->record_connect_failure(std::chrono::seconds(options_.connect_timeout));
+      throw;
+    }
+    target_->record_connect_latency(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time));
+    Log::debug("[session: {}] | http2 stream {} established", session_id_, stream->id());
+    co_return stream;
+  }
+
+  asio::awaitable<asio::ip::tcp::socket> connect_to_server(UpstreamConnector &connector) {
+    auto address = server_address();
+    if (options_.proxy_chain.empty()) {
+      Log::debug("[session: {}] | start connecting to {}:{}", session_id_, std::get<0>(address), std::get<1>(address));
+    } else if (options_.proxy_chain.front().type == ViaType::http_proxy) {
+      Log::debug("[session: {}] | start connecting to the http proxy server {}:{}", session_id_, std::get<0>(address), std::get<1>(address));
+    } else {
+      Log::debug("[session: {}] | start connecting to the socks5 proxy server {}:{}", session_id_, std::get<0>(address), std::get<1>(address));
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    std::optional<asio::ip::tcp::socket> server;
+    try {
+      server.emplace(co_await connector.connect(address));
+    } catch (std::exception &) {
+      target_->record_connect_failure(std::chrono::seconds(options_.connect_timeout));
+      throw;
+    }
+    target_->record_connect_latency(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time));
+    co_return std::move(*server);
+  }
+
+  template <typename Server>
+  asio::awaitable<void> tunnel_transfer(asio::ip::tcp::socket &client, Server &server) {
+    Deadline deadline;
+    Log::debug("[session: {}] | start tunnel transfer", session_id_);
+    auto transfer_result = co_await (tunnel_transfer(client, server, deadline) || tunnel_transfer_timeout(deadline));
+    if (transfer_result.index() == 1) {
+      Log::debug("[session: {}] | tunnel transfer connection closed due to timeout", session_id_);
+    }
+    Log::debug("[session: {}] | end tunnel transfer", session_id_);
+  }
+
+  template <typename Server>
+  asio::awaitable<void> tunnel_transfer(asio::ip::tcp::socket &client, Server &server, Deadline &deadline) {
+    try {
+      if (!pending_uplink_.empty()) {
+        co_await send_pending_uplink(client, server, deadline);
+      }
+      co_await (transfer(TransferType::uplink, client, server, deadline) && transfer(TransferType::downlink, server, client, deadline));
+    } catch (std::exception &) {
+    }
+  }
+
+  // A bare PROXY protocol header is coalesced with the first uplink write when
+  // the client has already sent something. Otherwise the queued bytes go out
+  // right away, because a target that speaks first would wait forever.
+  template <typename Server>
+  asio::awaitable<void> send_pending_uplink(asio::ip::tcp::socket &client, Server &server, Deadline &deadline) {
+    asio::error_code ec;
+    if (!pending_client_data_ && client.available(ec) > 0) {
+      co_return;
+    }
+    Log::trace("[session: {}] | send {} bytes queued for the target", session_id_, pending_uplink_.size());
+    co_await write_all(TransferType::uplink, server, asio::buffer(pending_uplink_), deadline);
+    pending_uplink_.clear();
+  }
+
+  // The socket overloads return the operation itself, so the plain TCP path
+  // pays nothing for also supporting HTTP/2 streams.
+  static auto async_read_some(asio::ip::tcp::socket &socket, asio::mutable_buffer buffer) {
+    return socket.async_read_some(buffer, asio::as_tuple(asio::use_awaitable));
+  }
+
+  static auto async_read_some(Http2Stream &stream, asio::mutable_buffer buffer) {
+    return stream.async_read_some(buffer);
+  }
+
+  static auto async_write_some(asio::ip::tcp::socket &socket, asio::const_buffer buffer) {
+    return socket.async_write_some(buffer, asio::as_tuple(asio::use_awaitable));
+  }
+
+  static auto async_write_some(Http2Stream &stream, asio::const_buffer buffer) {
+    return stream.async_write_some(buffer);
+  }
+
+  template <typename From, typename To>
+  asio::awaitable<void> transfer(TransferType type, From &from, To &to, Deadline &deadline) {
+    std::array<char, 4096> buffer;
+    std::string transfer_type_string = transfer_type_to_string(type);
+    for (;;) {
+      deadline.expires_after(std::chrono::seconds(options_.timeout));
+      auto [read_error, bytes_read] = co_await async_read_some(from, asio::buffer(buffer));
+      if (read_error) {
+        if (read_error.value() == asio::error::eof) {
+          Log::debug("[session: {}] | {} transfer read eof", session_id_, transfer_type_string);
+          co_return;
+        }
+        Log::debug("[session: {}] | {} transfer read error: {}", session_id_, transfer_type_string, read_error.message());
+        throw std::system_error(read_error);
+      }
+      if (type == TransferType::downlink) {
+        record_first_byte();
+      }
+      if (type == TransferType::uplink && !pending_uplink_.empty()) {
+        pending_uplink_.append(buffer.data(), bytes_read);
+        co_await write_all(type, to, asio::buffer(pending_uplink_), deadline);
+        pending_uplink_.clear();
+        continue;
+      }
+      co_await write_all(type, to, asio::buffer(buffer.data(), bytes_read), deadline);
+    }
+  }
+
+  template <typename To>
+  asio::awaitable<void> write_all(TransferType type, To &to, asio::const_buffer data, Deadline &deadline) {
+    std::size_t bytes_written = 0;
+    while (bytes_written < data.size()) {
+      deadline.expires_after(std::chrono::seconds(options_.timeout));
+      auto [write_error, bytes_transferred] = co_await async_write_some(to, data + bytes_written);
+      if (write_error) {
+        Log::debug("[session: {}] | {} transfer write error: {}", session_id_, transfer_type_to_string(type), write_error.message());
+        throw std::system_error(write_error);
+      }
+      bytes_written += bytes_transferred;
+    }
+  }
+
+  asio::awaitable<void> tunnel_transfer_timeout(const Deadline &deadline) {
+    asio::steady_timer timer(co_await asio::this_coro::executor);
+    while (!deadline.is_expired()) {
+      timer.expires_at(deadline.time_point());
+      co_await timer.async_wait(asio::use_awaitable);
+    }
+  }
+
+  AddressType server_address() const {
+    return options_.proxy_chain.empty() ? target_->address(options_.port_offset) : options_.proxy_chain.front().address;
+  }
+
+  std::string transfer_type_to_string(TransferType transfer_type) {
+    switch (transfer_type) {
+      case TransferType::uplink:
+        return "uplink";
+      case TransferType::downlink:
+        return "downlink";
+      default:
+        // unreachable
+        std::abort();
+    }
+  }
+
+private:
+  std::uint64_t session_id_;
+  RelayConnectionOptions options_;
+  std::shared_ptr<const Router> router_;
+  std::shared_ptr<TargetGroup> target_group_;
+  std::shared_ptr<RetryBudget> retry_budget_;
+  std::shared_ptr<Target> target_;
+  std::shared_ptr<Http2ConnectionPool> http2_pool_;
+  // Only used behind a PROXY protocol sender; see RelayServer::accept.
+  std::shared_ptr<ClientLimiter> client_limiter_;
+  std::optional<ClientLimiter::Lease> client_lease_;
+  std::chrono::steady_clock::time_point start_time_;
+  bool first_byte_received_ = false;
+  bool early_data_read_ = false;
+  std::string early_data_;
+  // Bytes for the target ahead of anything still to be read from the client:
+  // the PROXY protocol header and client data read along with the incoming one.
+  std::string pending_uplink_;
+  bool pending_client_data_ = false;
+};
+
+struct RelayServerOptions {
+  asio::ip::address listen_address;
+  asio::ip::port_type listen_port;
+  std::uint32_t listen_port_count;
+  std::vector<TargetOptions> targets;
+  std::vector<HostnameRouteOptions> sni_routes;
+  std::vector<HostnameRouteOptions> host_routes;
+  std::vector<ProtocolRouteOptions> protocol_routes;
+  std::vector<ClientRuleOptions> client_rules;
+  ClientLimitOptions client_limits;
+  LoadBalancePolicy lb_policy;
+  std::uint32_t timeout;
+  std::uint32_t connect_timeout;
+  std::uint32_t connect_attempts;
+  std::vector<ProxyHop> proxy_chain;
+  std::vector<std::string> http_proxy_headers;
+  bool http_proxy_pipelining;
+  ProxyProtocolVersion proxy_protocol;
+  bool proxy_protocol_session_id;
+  bool accept_proxy_protocol;
+  std::uint32_t sniff_timeout;
+  std::size_t sniff_max_size;
+  std::string http_proxy_username;
+  std::string http_proxy_password;
+  bool http_proxy_preemptive_auth;
+  std::string socks5_username;
+  std::string socks5_password;
+  std::size_t http2_connections;
+  UpstreamPoolOptions pool_options;
+};
+
+// Serves one listen port, or a range of them on the same executor. Each port
+// of a range relays to the targets' ports moved up by its offset from the
+// first port. The routes, target groups and client rules are built once for
+// the range and sessions apply the offset when connecting; only what names the
+// target port, i.e. proxy requests and pools, is kept per offset.
+class RelayServer : public std::enable_shared_from_this<RelayServer> {
+public:
+  RelayServer(const asio::any_io_executor &executor, const RelayServerOptions &options, std::shared_ptr<RetryBudget> retry_budget)
+    : options_(options), retry_budget_(std::move(retry_budget)) {
+    auto client_prefixes = std::make_shared<PrefixTable>();
+    for (std::size_t i = 0; i < options.client_rules.size(); ++i) {
+      client_prefixes->add(options.client_rules[i].address, options.client_rules[i].length, static_cast<std::uint32_t>(i + 1));
+    }
+    client_prefixes->build();
+    router_ = make_router(std::move(client_prefixes));
+    acceptors_.reserve(options.listen_port_count);
+    for (std::uint32_t offset = 0; offset < options.listen_port_count; ++offset) {
+      asio::ip::tcp::endpoint endpoint(options.listen_address, static_cast<asio::ip::port_type>(options.listen_port + offset));
+      acceptors_.emplace_back(executor, endpoint);
+    }
+    if (ClientLimiter::enabled(options.client_limits)) {
+      client_limiter_ = std::make_shared<ClientLimiter>(options.client_limits);
+    }
+    if (!options.proxy_chain.empty() && options.proxy_chain.front().type == ViaType::http2_proxy) {
+      auto headers = options.http_proxy_headers;
+      if (!options.http_proxy_username.empty()) {
+        headers.push_back(HttpConnectRequest::basic_authorization(options.http_proxy_username, options.http_proxy_password));
+      }
+      http2_pool_ = Http2ConnectionPool::shared(options.proxy_chain.front().address, options.http2_connections);
+      for (const auto &target : targets()) {
+        for (std::uint32_t offset = 0; offset < options.listen_port_count; ++offset) {
+          target->set_http2_connect_request(offset, std::make_shared<const Http2ConnectRequest>(target->address(offset), headers));
+        }
+      }
+    } else if (!options.proxy_chain.empty()) {
+      std::string extra_headers;
+      for (const auto &header : options.http_proxy_headers) {
+        extra_headers += header + "\r\n";
+      }
+      auto shared_extra_headers = std::make_shared<const std::string>(std::move(extra_headers));
+      std::shared_ptr<const std::string> authorization;
+      if (!options.http_proxy_username.empty()) {
+        authorization = std::make_shared<const std::string>(HttpConnectRequest::basic_authorization(options.http_proxy_username, options.http_proxy_password));
+      }
+      for (const auto &target : targets()) {
+        for (std::uint32_t offset = 0; offset < options.listen_port_count; ++offset) {
+          auto chain = std::make_shared<ProxyChain>();
+          for (std::size_t hop = 0; hop < options.proxy_chain.size(); ++hop) {
+            auto next_address = hop + 1 < options.proxy_chain.size() ? options.proxy_chain[hop + 1].address : target->address(offset);
+            if (options.proxy_chain[hop].type == ViaType::http_proxy) {
+              chain->emplace_back(std::in_place_type<HttpConnectRequest>, next_address, shared_extra_headers, authorization, options.http_proxy_preemptive_auth);
+            } else {
+              chain->emplace_back(std::in_place_type<Socks5ConnectRequest>, next_address, options.socks5_username, options.socks5_password);
+            }
+          }
+          target->set_proxy_chain(offset, std::move(chain));
+        }
+      }
+    }
+    if (options.pool_options.size > 0) {
+      for (const auto &target : targets()) {
+        for (std::uint32_t offset = 0; offset < options.listen_port_count; ++offset) {
+          target->set_pool(offset, std::make_shared<UpstreamPool>(executor, server_address(*target, offset), target->proxy_chain(offset),
+            options.pool_options));
+        }
+      }
+    }
+  }
+
+  asio::awaitable<void> listen() {
+    for (const auto &group : target_groups_) {
+      for (const auto &target : group->targets()) {
+        for (std::uint32_t offset = 0; offset < options_.listen_port_count; ++offset) {
+          if (const auto &pool = target->pool(offset)) {
+            pool->start();
+          }
+        }
+        if (target->health_check_options().type != HealthCheckType::none) {
+          std::make_shared<HealthChecker>(group, target, server_address(*target, 0))->start(co_await asio::this_coro::executor);
+        }
+      }
+    }
+    RelayConnectionOptions conn_options = {
+      .timeout = options_.timeout,
+      .connect_timeout = options_.connect_timeout,
+      .connect_attempts = options_.connect_attempts,
+      .proxy_chain = options_.proxy_chain,
+      .http_proxy_pipelining = options_.http_proxy_pipelining,
+      .proxy_protocol = options_.proxy_protocol,
+      .proxy_protocol_session_id = options_.proxy_protocol_session_id,
+      .accept_proxy_protocol = options_.accept_proxy_protocol,
+      .sniff_timeout = options_.sniff_timeout,
+      .sniff_max_size = options_.sniff_max_size,
+      .port_offset = 0,
+    };
+    // Each further port of a range gets its own accept loop on the same
+    // executor, which keeps the server alive.
+    auto executor = co_await asio::this_coro::executor;
+    for (std::size_t index = 1; index < acceptors_.size(); ++index) {
+      asio::co_spawn(executor, [self = shared_from_this(), index, conn_options]() {
+        return self->accept(index, conn_options);
+      }, asio::detached);
+    }
+    co_await accept(0, conn_options);
+  }
+
+private:
+  asio::awaitable<void> accept(std::size_t index, RelayConnectionOptions conn_options) {
+    auto executor = co_await asio::this_coro::executor;
+    auto &acceptor = acceptors_[index];
+    const auto &router = router_;
+    conn_options.port_offset = static_cast<std::uint32_t>(index);
+    auto listen_endpoint = endpoint_to_string(acceptor.local_endpoint());
+    asio::steady_timer retry_timer(executor);
+    for (;;) {
+      auto [accept_error, client] = co_await acceptor.async_accept(asio::as_tuple(asio::use_awaitable));
+      if (accept_error == asio::error::operation_aborted) {
+        co_return;
+      }
+      if (accept_error) {
+        // E.g. out of file descriptors: keep listening, but give sessions a
+        // moment to close instead of spinning on the same error.
+        Log::error("[listener] | accept on {} error: {}", listen_endpoint, accept_error.message());
+        retry_timer.expires_after(std::chrono::milliseconds(kAcceptRetryDelayMs));
+        co_await retry_timer.async_wait(asio::as_tuple(asio::use_awaitable));
+        continue;
+      }
+      // Denied clients and clients over their limits are closed here, before
+      // a session is spawned for them. Behind a PROXY protocol sender the real
+      // client is only known to the session, which checks both itself.
+      std::shared_ptr<TargetGroup> client_group;
+      std::optional<ClientLimiter::Lease> lease;
+      if ((router->filters_clients() || client_limiter_) && !options_.accept_proxy_protocol) {
+        asio::error_code ec;
+        auto address = client.remote_endpoint(ec).address();
+        if (ec) {
+          continue;
+        }
+        if (router->filters_clients()) {
+          auto match = router->match_client(address);
+          if (!match) {
+            Metrics::client_denials.add();
+            Log::debug("[listener] | denied connection from {}", address.to_string());
+            continue;
+          }
+          client_group = std::move(*match);
+        }
+        if (client_limiter_) {
+          lease = client_limiter_->admit(address);
+          if (!lease) {
+            Metrics::client_limit_rejections.add();
+            Log::debug("[listener] | connection limit reached for {}", address.to_string());
+            continue;
+          }
+        }
+      }
+      auto session_id = s_next_session_id++;
+      asio::co_spawn(executor, [session_id, conn_options, router, retry_budget = retry_budget_,
+          http2_pool = http2_pool_, client_limiter = client_limiter_, client = std::move(client),
+          client_group = std::move(client_group), lease = std::move(lease)]() mutable -> asio::awaitable<void> {
+        RelayConnection conn(session_id, conn_options, std::move(router), std::move(retry_budget), std::move(http2_pool),
+          std::move(client_limiter));
+        co_await conn.relay(std::move(client), std::move(client_group));
+      }, asio::detached);
+    }
+  }
+
+  // The routes of all ports in the range. Their target groups are added to
+  // those of the server.
+  std::shared_ptr<const Router> make_router(std::shared_ptr<const PrefixTable> client_prefixes) {
+    auto make_group = [this](const std::vector<TargetOptions> &targets) {
+      auto group = std::make_shared<TargetGroup>(targets, options_.lb_policy);
+      target_groups_.push_back(group);
+      return group;
+    };
+    std::shared_ptr<TargetGroup> default_group;
+    if (!options_.targets.empty()) {
+      default_group = make_group(options_.targets);
+    }
+    HostnameTable sni_routes;
+    for (const auto &route : options_.sni_routes) {
+      sni_routes.add(route.hostname, make_group(route.targets));
+    }
+    HostnameTable host_routes;
+    for (const auto &route : options_.host_routes) {
+      host_routes.add(route.hostname, make_group(route.targets));
+    }
+    Router::ProtocolRoutes protocol_routes;
+    for (const auto &route : options_.protocol_routes) {
+      protocol_routes[static_cast<std::size_t>(route.protocol)] = make_group(route.targets);
+    }
+    Router::ClientRules client_rules = {std::move(client_prefixes), {}, false};
+    for (const auto &rule : options_.client_rules) {
+      std::shared_ptr<TargetGroup> group;
+      if (rule.action == ClientRuleOptions::Action::route) {
+        group = make_group(rule.targets);
+      } else if (rule.action == ClientRuleOptions::Action::allow) {
+        client_rules.deny_unmatched = true;
+      }
+      client_rules.rules.push_back({rule.action != ClientRuleOptions::Action::deny, std::move(group)});
+    }
+    return std::make_shared<const Router>(std::move(default_group), std::move(sni_routes), std::move(host_routes),
+        std::move(protocol_routes), std::move(client_rules));
+  }
+
+  AddressType server_address(const Target &target, std::uint32_t port_offset) const {
+    return options_.proxy_chain.empty() ? target.address(port_offset) : options_.proxy_chain.front().address;
+  }
+
+  std::vector<std::shared_ptr<Target>> targets() const {
+    std::vector<std::shared_ptr<Target>> result;
+    for (const auto &group : target_groups_) {
+      result.insert(result.end(), group->targets().begin(), group->targets().end());
+    }
+    return result;
+  }
+
+  // Session ids are unique across all listeners of the process.
+  static std::uint64_t s_next_session_id;
+
+  RelayServerOptions options_;
+  // Indexed by the offset of the port from the first one.
+  std::vector<asio::ip::tcp::acceptor> acceptors_;
+  std::shared_ptr<const Router> router_;
+  std::vector<std::shared_ptr<TargetGroup>> target_groups_;
+  std::shared_ptr<ClientLimiter> client_limiter_;
+  std::shared_ptr<RetryBudget> retry_budget_;
+  std::shared_ptr<Http2ConnectionPool> http2_pool_;
+};
+
+std::uint64_t RelayServer::s_next_session_id = 10000;
+
+struct Args {
+  asio::ip::address listen_address = asio::ip::address_v4::any();
+  asio::ip::port_type listen_port = 8886;
+  std::uint32_t listen_port_count = 1;
+  std::vector<TargetOptions> targets;
+  std::vector<HostnameRouteOptions> sni_routes;
+  std::vector<HostnameRouteOptions> host_routes;
+  std::vector<ProtocolRouteOptions> protocol_routes;
+  std::vector<ClientRuleOptions> client_rules;
+  ClientLimitOptions client_limits = {
+    .max_sessions_per_ip = 0,
+    .max_rate_per_ip = 0,
+    .max_sessions_per_prefix = 0,
+    .max_rate_per_prefix = 0,
+    .prefix_length_v4 = 24,
+    .prefix_length_v6 = 64,
+  };
+  std::uint32_t sniff_timeout = kSniffTimeout;
+  std::size_t sniff_max_size = kSniffMaxSize;
+  LoadBalancePolicy lb_policy = LoadBalancePolicy::round_robin;
+  HealthCheckOptions health_check = {
+    .type = HealthCheckType::none,
+    .interval = 5,
+    .timeout = 2,
+    .rise = 2,
+    .fall = 3,
+  };
+  OutlierDetectionOptions outlier_detection = {
+    .min_failures = 0,
+    .error_rate = 50,
+    .base_ejection_time = 10,
+  };
+  std::uint32_t timeout = 240;
+  std::uint32_t connect_timeout = kConnectTimeout;
+  std::uint32_t connect_attempts = 3;
+  std::uint32_t retry_budget = 10;
+  std::vector<asio::ip::address> source_addresses;
+  std::optional<std::pair<std::uint16_t, std::uint16_t>> source_port_range;
+  ConnectLimitOptions connect_limit = {
+    .max_in_flight = 0,
+    .max_queue = 1024,
+    .queue_timeout = 5,
+  };
+  std::vector<ViaType> via_types;
+  std::vector<AddressType> http_proxy_addresses;
+  std::vector<std::string> http_proxy_headers;
+  bool http_proxy_pipelining = false;
+  std::string http_proxy_username;
+  std::string http_proxy_password;
+  bool http_proxy_preemptive_auth = true;
+  std::vector<AddressType> socks5_addresses;
+  AddressType http2_proxy_address = {"", 0};
+  std::size_t http2_connections = 2;
+  std::vector<ProxyHop> proxy_chain;
+  std::string socks5_username;
+  std::string socks5_password;
+  ProxyProtocolVersion proxy_protocol = ProxyProtocolVersion::none;
+  bool proxy_protocol_session_id = false;
+  bool accept_proxy_protocol = false;
+  std::size_t pool_size = 0;
+  std::uint32_t pool_idle_timeout = 60;
+  std::uint32_t pool_refill_rate = 100;
+  std::uint32_t stats_interval = 0;
+  LogLevel log_level = LogLevel::info;
+  std::string config_file;
+
+  static void print_usage() {
+#ifdef _WIN32
+    const char *prog = "tcp-relay.exe";
+#else
+    const char *prog = "tcp-relay";
+#endif
+    Args args;
+    std::cout << "Usage: " << prog << " [options]\n\n"
+              << "options:\n"
+              << "  -h, --help                  Show this help message and exit\n"
+              << "  -v, --version               Print the program version and exit\n"
+              << "  -l, --listen_addr string    Local address to listen on (default: " << args.listen_address.to_string() << ")\n"
+              << "  -p, --port number[-number]  Local port or port range to listen on, each port of a range relays to the target ports moved up as far (default: " << args.listen_port << ")\n"
+              << "  -t, --target string         Taget address (host:port[,weight]) to connect, repeat to add more targets\n"
+              << "  --sni_route string          Route TLS connections by SNI (hostname=host:port[,weight]), hostname may be *.domain, repeat to add routes or targets; -t is the default\n"
+              << "  --host_route string         Route plain HTTP connections by the Host header of the first request (hostname=host:port[,weight]), like --sni_route\n"
+              << "  --protocol_route string     Route by the first client bytes (protocol=host:port[,weight]), protocol is tls, http, ssh or proxy; -t is the fallback\n"
+              << "  --allow string              Accept only clients in these subnets (address[/length]), repeat to add more\n"
+              << "  --deny string               Close connections from this subnet (address[/length]) right after accept; the longest matching --allow, --deny or --cidr_route wins\n"
+              << "  --cidr_route string         Route the clients of a subnet (address[/length]=host:port[,weight]) ahead of any other route\n"
+              << "  --max_conns_per_ip number   Max concurrent sessions of one client address, 0 for unlimited (default: " << args.client_limits.max_sessions_per_ip << ")\n"
+              << "  --max_rate_per_ip number    Max new connections per second of one client address, up to 65534, 0 for unlimited (default: " << args.client_limits.max_rate_per_ip << ")\n"
+              << "  --max_conns_per_prefix number Like --max_conns_per_ip, for all the clients of a subnet (default: " << args.client_limits.max_sessions_per_prefix << ")\n"
+              << "  --max_rate_per_prefix number  Like --max_rate_per_ip, for all the clients of a subnet (default: " << args.client_limits.max_rate_per_prefix << ")\n"
+              << "  --client_prefix number,number IPv4 and IPv6 prefix lengths of the subnets for the per-prefix limits (default: " << args.client_limits.prefix_length_v4 << "," << args.client_limits.prefix_length_v6 << ")\n"
+              << "  --sniff_timeout number      Max time (in seconds) to wait for client data when routing by SNI or protocol (default: " << args.sniff_timeout << ")\n"
+              << "  --sniff_max_size number     Max client bytes buffered when routing by SNI or protocol (default: " << args.sniff_max_size << ")\n"
+              << "  --lb_policy [round_robin | least_conn | p2c | ewma | maglev] Load balancing policy across targets (default: round_robin)\n"
+              << "  --health_check [none | tcp | handshake] Actively probe targets, handshake goes through the proxy (default: none)\n"
+              << "  --health_check_interval number Interval (in seconds) between probes (default: " << args.health_check.interval << ")\n"
+              << "  --health_check_timeout number  Probe timeout (in seconds) (default: " << args.health_check.timeout << ")\n"
+              << "  --health_check_rise number     Successful probes to mark a target healthy (default: " << args.health_check.rise << ")\n"
+              << "  --health_check_fall number     Failed probes to mark a target unhealthy (default: " << args.health_check.fall << ")\n"
+              << "  --outlier_failures number   Failures within " << kOutlierWindow << "s that eject a target, 0 to disable (default: " << args.outlier_detection.min_failures << ")\n"
+              << "  --outlier_error_rate number Minimum failure percentage to eject a target (default: " << args.outlier_detection.error_rate << ")\n"
+              << "  --outlier_ejection_time number Base ejection time (in seconds), doubled on each ejection (default: " << args.outlier_detection.base_ejection_time << ")\n"
+              << "  --timeout number            Connection timeout (in seconds) (default: " << args.timeout << ")\n"
+              << "  --connect_timeout number    Deadline (in seconds) for one upstream connect attempt, including the proxy handshake (default: " << args.connect_timeout << ")\n"
+              << "  --connect_attempts number   Targets to try before giving up on a session (default: " << args.connect_attempts << ")\n"
+              << "  --retry_budget number       Max connect retries as a percentage of sessions, at least " << kMinRetriesPerWindow << " per " << kRetryBudgetWindow << " seconds; 0 disables retries (default: " << args.retry_budget << ")\n"
+              << "  --source_addr string        Local address for upstream connections, repeat to spread connections over several addresses\n"
+              << "  --source_port_range string  Local port range (first-last) for upstream connections, Linux >= 6.3\n"
+              << "  --max_connecting number     Max upstream connects in flight per target, 0 for unlimited (default: " << args.connect_limit.max_in_flight << ")\n"
+              << "  --max_connect_queue number  Max sessions waiting for a connect slot per target (default: " << args.connect_limit.max_queue << ")\n"
+              << "  --connect_queue_timeout number Max time (in seconds) to wait for a connect slot (default: " << args.connect_limit.queue_timeout << ")\n"
+              << "  --via [none | http_proxy | socks5 | http2_proxy] Transfer via other proxy, a comma separated list chains proxies in order (default: none)\n"
+              << "  --http_proxy string         HTTP-Proxy address (host:port), repeat for each http_proxy in the chain\n"
+              << "  --http_proxy_header string  Extra header (\"Name: value\") for the CONNECT request, may be repeated\n"
+              << "  --http_proxy_pipelining     Send early client data together with the CONNECT request\n"
+              << "  --http_proxy_user string    HTTP-Proxy username for Basic authentication\n"
+              << "  --http_proxy_password string HTTP-Proxy password for Basic authentication\n"
+              << "  --http_proxy_auth [preemptive | challenge] Send credentials with the first CONNECT, or only after a 407 (default: preemptive)\n"
+              << "  --socks5 string             SOCKS5 proxy address (host:port), repeat for each socks5 in the chain\n"
+              << "  --http2_proxy string        HTTP/2 proxy address (host:port), cleartext with prior knowledge, cannot be chained\n"
+              << "  --http2_connections number  Max HTTP/2 connections to the proxy, each multiplexing many tunnels (default: " << args.http2_connections << ")\n"
+              << "  --socks5_user string        SOCKS5 username, enables username/password authentication\n"
+              << "  --socks5_password string    SOCKS5 password, empty if not given\n"
+              << "  --proxy_protocol [none | v1 | v2] Send a PROXY protocol header with the client address to the target (default: none)\n"
+              << "  --proxy_protocol_session_id Add the session id as a unique id TLV to PROXY protocol v2 headers\n"
+              << "  --accept_proxy_protocol     Expect a PROXY protocol v1/v2 header from a load balancer on every accepted connection\n"
+              << "  --pool_size number          Idle pre-connected upstream sockets (tunnels when using --via) to keep (default: " << args.pool_size << ", disabled)\n"
+              << "  --pool_idle_timeout number  Idle time (in seconds) before a pooled socket is discarded (default: " << args.pool_idle_timeout << ")\n"
+              << "  --pool_refill_rate number   Max new pooled connections per second (default: " << args.pool_refill_rate << ")\n"
+              << "  --stats_interval number     Interval (in seconds) to log statistics, 0 to disable (default: " << args.stats_interval << ")\n"
+              << "  --log_level string [trace | debug | info | warn | error | disable] Log level (default: info)\n"
+              << "  -c, --config string         Read routes from a file, one listener per line with the options above\n";
+  }
+
+  static asio::ip::port_type parse_port(const std::string &port) {
+    auto result = std::stoul(port);
+    if (result <= 0 || result >= 65536) {
+      throw std::invalid_argument("invalid port value");
+    }
+    return static_cast<asio::ip::port_type>(result);
+  }
+
+  // std::stoul accepts a sign and wraps negative values, and unsigned long
+  // may be wider than the option.
+  static std::uint32_t parse_uint32(const std::string &value) {
+    std::size_t end = 0;
+    if (value.find('-') != std::string::npos) {
+      throw std::invalid_argument("negative value");
+    }
+    auto result = std::stoul(value, &end);
+    if (end != value.size() || result > std::numeric_limits<std::uint32_t>::max()) {
+      throw std::out_of_range("invalid value");
+    }
+    return static_cast<std::uint32_t>(result);
+  }
+
+  static AddressType parse_host_port_pair(const std::string &address) {
     std::regex re(R"((.+):(\d+))");
     std::smatch m;
     if (!std::regex_match(address, m, re)) {
@@ -476,12 +5176,99 @@ struct Args {
     return {host, port};
   }
 
-  static Args parse_args(const std::vector<std::string>& argv) {
+  static TargetOptions parse_target(const std::string &target) {
+    auto pos = target.rfind(',');
+    if (pos == std::string::npos) {
+      return {parse_host_port_pair(target), 1, {}, {}, {}};
+    }
+    auto weight = std::stoul(target.substr(pos + 1));
+    if (weight == 0 || weight > kMaxTargetWeight) {
+      throw std::invalid_argument("invalid weight value");
+    }
+    return {parse_host_port_pair(target.substr(0, pos)), static_cast<std::uint32_t>(weight), {}, {}, {}};
+  }
+
+  // "hostname=host:port[,weight]", adding the target to the route of the same
+  // hostname if there is one already.
+  static void add_hostname_route(std::vector<HostnameRouteOptions> &routes, const std::string &value) {
+    auto pos = value.find('=');
+    if (pos == std::string::npos) {
+      throw std::invalid_argument("invalid route");
+    }
+    auto hostname = value.substr(0, pos);
+    std::transform(hostname.begin(), hostname.end(), hostname.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; });
+    auto wildcard = hostname.rfind('*');
+    if (hostname.empty() || (wildcard != std::string::npos && (wildcard != 0 || hostname.size() < 3 || hostname[1] != '.'))) {
+      throw std::invalid_argument("invalid hostname");
+    }
+    auto target = parse_target(value.substr(pos + 1));
+    auto it = std::find_if(routes.begin(), routes.end(), [&hostname](const auto &route) { return route.hostname == hostname; });
+    if (it == routes.end()) {
+      routes.push_back({hostname, {}});
+      it = routes.end() - 1;
+    }
+    it->targets.push_back(std::move(target));
+  }
+
+  // "protocol=host:port[,weight]", adding the target to the route of the same
+  // protocol if there is one already.
+  static void add_protocol_route(std::vector<ProtocolRouteOptions> &routes, const std::string &value) {
+    auto pos = value.find('=');
+    auto protocol = pos == std::string::npos ? std::nullopt : ProtocolSniffer::parse_protocol(value.substr(0, pos));
+    if (!protocol) {
+      throw std::invalid_argument("invalid protocol");
+    }
+    auto target = parse_target(value.substr(pos + 1));
+    auto it = std::find_if(routes.begin(), routes.end(), [&protocol](const auto &route) { return route.protocol == *protocol; });
+    if (it == routes.end()) {
+      routes.push_back({*protocol, {}});
+      it = routes.end() - 1;
+    }
+    it->targets.push_back(std::move(target));
+  }
+
+  // "address[/length]" for --allow and --deny, "address[/length]=host:port[,weight]"
+  // for --cidr_route, adding the target to the route of the same subnet if
+  // there is one already. A bare address stands for itself alone.
+  static void add_client_rule(std::vector<ClientRuleOptions> &rules, ClientRuleOptions::Action action, const std::string &value) {
+    auto cidr = value;
+    std::vector<TargetOptions> targets;
+    if (action == ClientRuleOptions::Action::route) {
+      auto pos = value.find('=');
+      if (pos == std::string::npos) {
+        throw std::invalid_argument("invalid route");
+      }
+      cidr = value.substr(0, pos);
+      targets.push_back(parse_target(value.substr(pos + 1)));
+    }
+    auto slash = cidr.find('/');
+    auto address = asio::ip::make_address(cidr.substr(0, slash));
+    auto max_length = address.is_v4() ? 32ul : 128ul;
+    auto length = slash == std::string::npos ? max_length : std::stoul(cidr.substr(slash + 1));
+    if (length > max_length || (address.is_v6() && address.to_v6().is_v4_mapped() && length < 96)) {
+      throw std::invalid_argument("invalid prefix length");
+    }
+    auto it = std::find_if(rules.begin(), rules.end(), [&](const auto &rule) {
+      return rule.action == action && action == ClientRuleOptions::Action::route && rule.address == address && rule.length == length;
+    });
+    if (it == rules.end()) {
+      rules.push_back({action, address, static_cast<std::uint32_t>(length), {}});
+      it = rules.end() - 1;
+    }
+    it->targets.insert(it->targets.end(), targets.begin(), targets.end());
+  }
+
+  static Args parse_args(const std::vector<std::string>& argv, const std::string &where = {}) {
     Args args;
     std::string arg;
+    // The first option that configures a route rather than the process.
+    std::string route_option;
     bool invalid_param = false;
     for (std::size_t i = 1; i < argv.size(); ++i) {
       arg = argv[i];
+      if (route_option.empty() && !is_process_option(arg)) {
+        route_option = arg;
+      }
       if (arg == "-h" || arg == "--help") {
         print_usage();
         std::exit(EXIT_SUCCESS);
@@ -494,29 +5281,321 @@ struct Args {
           break;
         }
         try {
-          args.listen_address = asio::ip::make_address(argv[i]);
+          args.listen_address = asio::ip::make_address(argv[i]);
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "-p" || arg == "--port") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          auto pos = argv[i].find('-');
+          args.listen_port = parse_port(argv[i].substr(0, pos));
+          auto last = pos == std::string::npos ? args.listen_port : parse_port(argv[i].substr(pos + 1));
+          if (last < args.listen_port) {
+            invalid_param = true;
+            break;
+          }
+          args.listen_port_count = last - args.listen_port + 1u;
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "-t" || arg == "--target") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.targets.push_back(parse_target(argv[i]));
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--sni_route") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          add_hostname_route(args.sni_routes, argv[i]);
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--host_route") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          add_hostname_route(args.host_routes, argv[i]);
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--allow" || arg == "--deny" || arg == "--cidr_route") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        auto action = arg == "--allow" ? ClientRuleOptions::Action::allow : arg == "--deny" ? ClientRuleOptions::Action::deny : ClientRuleOptions::Action::route;
+        try {
+          add_client_rule(args.client_rules, action, argv[i]);
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--max_conns_per_ip" || arg == "--max_rate_per_ip" || arg == "--max_conns_per_prefix" || arg == "--max_rate_per_prefix") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          auto value = std::stoull(argv[i]);
+          bool rate = arg == "--max_rate_per_ip" || arg == "--max_rate_per_prefix";
+          if (value > (rate ? ClientLimiter::kMaxRate : std::numeric_limits<std::uint32_t>::max())) {
+            invalid_param = true;
+            break;
+          }
+          if (arg == "--max_conns_per_ip") {
+            args.client_limits.max_sessions_per_ip = value;
+          } else if (arg == "--max_rate_per_ip") {
+            args.client_limits.max_rate_per_ip = value;
+          } else if (arg == "--max_conns_per_prefix") {
+            args.client_limits.max_sessions_per_prefix = value;
+          } else {
+            args.client_limits.max_rate_per_prefix = value;
+          }
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--client_prefix") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          auto pos = argv[i].find(',');
+          if (pos == std::string::npos) {
+            invalid_param = true;
+            break;
+          }
+          args.client_limits.prefix_length_v4 = std::stoul(argv[i].substr(0, pos));
+          args.client_limits.prefix_length_v6 = std::stoul(argv[i].substr(pos + 1));
+          if (args.client_limits.prefix_length_v4 > 32 || args.client_limits.prefix_length_v6 > 128) {
+            invalid_param = true;
+            break;
+          }
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--protocol_route") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          add_protocol_route(args.protocol_routes, argv[i]);
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--sniff_timeout") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.sniff_timeout = std::stoul(argv[i]);
+          if (args.sniff_timeout == 0) {
+            invalid_param = true;
+            break;
+          }
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--sniff_max_size") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.sniff_max_size = std::stoul(argv[i]);
+          if (args.sniff_max_size < 16 || args.sniff_max_size > 1024 * 1024) {
+            invalid_param = true;
+            break;
+          }
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--lb_policy") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        if (argv[i] == "round_robin") {
+          args.lb_policy = LoadBalancePolicy::round_robin;
+        } else if (argv[i] == "least_conn") {
+          args.lb_policy = LoadBalancePolicy::least_conn;
+        } else if (argv[i] == "p2c") {
+          args.lb_policy = LoadBalancePolicy::power_of_two;
+        } else if (argv[i] == "ewma") {
+          args.lb_policy = LoadBalancePolicy::ewma;
+        } else if (argv[i] == "maglev") {
+          args.lb_policy = LoadBalancePolicy::maglev;
+        } else {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--health_check") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        if (argv[i] == "none") {
+          args.health_check.type = HealthCheckType::none;
+        } else if (argv[i] == "tcp") {
+          args.health_check.type = HealthCheckType::tcp;
+        } else if (argv[i] == "handshake" || argv[i] == "http_connect") {
+          args.health_check.type = HealthCheckType::handshake;
+        } else {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--health_check_interval" || arg == "--health_check_timeout" || arg == "--health_check_rise" || arg == "--health_check_fall") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          auto value = parse_uint32(argv[i]);
+          if (value == 0) {
+            invalid_param = true;
+            break;
+          } else if (arg == "--health_check_interval") {
+            args.health_check.interval = value;
+          } else if (arg == "--health_check_timeout") {
+            args.health_check.timeout = value;
+          } else if (arg == "--health_check_rise") {
+            args.health_check.rise = value;
+          } else {
+            args.health_check.fall = value;
+          }
         } catch (std::exception &) {
           invalid_param = true;
           break;
         }
-      } else if (arg == "-p" || arg == "--port") {
+      } else if (arg == "--outlier_failures" || arg == "--outlier_error_rate" || arg == "--outlier_ejection_time") {
         if (++i >= argv.size()) {
           invalid_param = true;
           break;
         }
         try {
-          args.listen_port = parse_port(argv[i]);
+          auto value = parse_uint32(argv[i]);
+          if (arg == "--outlier_failures") {
+            args.outlier_detection.min_failures = value;
+          } else if (arg == "--outlier_error_rate") {
+            args.outlier_detection.error_rate = value;
+            if (value == 0 || value > 100) {
+              invalid_param = true;
+              break;
+            }
+          } else {
+            args.outlier_detection.base_ejection_time = value;
+            if (value == 0) {
+              invalid_param = true;
+              break;
+            }
+          }
         } catch (std::exception &) {
           invalid_param = true;
           break;
         }
-      } else if (arg == "-t" || arg == "--target") {
+      } else if (arg == "--connect_timeout" || arg == "--connect_attempts" || arg == "--retry_budget") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          auto value = parse_uint32(argv[i]);
+          if (arg == "--connect_timeout") {
+            args.connect_timeout = value;
+            if (value == 0) {
+              invalid_param = true;
+              break;
+            }
+          } else if (arg == "--connect_attempts") {
+            args.connect_attempts = value;
+            if (value == 0) {
+              invalid_param = true;
+              break;
+            }
+          } else {
+            args.retry_budget = value;
+          }
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--source_addr") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.source_addresses.push_back(asio::ip::make_address(argv[i]));
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--source_port_range") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          auto pos = argv[i].find('-');
+          if (pos == std::string::npos) {
+            invalid_param = true;
+            break;
+          }
+          auto first = parse_port(argv[i].substr(0, pos));
+          auto last = parse_port(argv[i].substr(pos + 1));
+          if (first > last) {
+            invalid_param = true;
+            break;
+          }
+          args.source_port_range = {first, last};
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--max_connecting" || arg == "--max_connect_queue" || arg == "--connect_queue_timeout") {
         if (++i >= argv.size()) {
           invalid_param = true;
           break;
         }
         try {
-          args.target_address = parse_host_port_pair(argv[i]);
+          auto value = parse_uint32(argv[i]);
+          if (arg == "--max_connecting") {
+            args.connect_limit.max_in_flight = value;
+          } else if (arg == "--max_connect_queue") {
+            args.connect_limit.max_queue = value;
+          } else {
+            args.connect_limit.queue_timeout = value;
+            if (value == 0) {
+              invalid_param = true;
+              break;
+            }
+          }
         } catch (std::exception &) {
           invalid_param = true;
           break;
@@ -539,11 +5618,26 @@ struct Args {
           invalid_param = true;
           break;
         }
+        args.via_types.clear();
         if (argv[i] == "none") {
-          args.via_type = ViaType::none;
-        } else if (argv[i] == "http_proxy") {
-          args.via_type = ViaType::http_proxy;
-        } else {
+          continue;
+        }
+        for (std::size_t begin = 0; begin <= argv[i].size();) {
+          auto end = std::min(argv[i].find(',', begin), argv[i].size());
+          auto type = argv[i].substr(begin, end - begin);
+          begin = end + 1;
+          if (type == "http_proxy") {
+            args.via_types.push_back(ViaType::http_proxy);
+          } else if (type == "socks5") {
+            args.via_types.push_back(ViaType::socks5);
+          } else if (type == "http2_proxy") {
+            args.via_types.push_back(ViaType::http2_proxy);
+          } else {
+            invalid_param = true;
+            break;
+          }
+        }
+        if (invalid_param || args.via_types.empty()) {
           invalid_param = true;
           break;
         }
@@ -553,11 +5647,151 @@ struct Args {
           break;
         }
         try {
-          args.http_proxy_address = parse_host_port_pair(argv[i]);
+          args.http_proxy_addresses.push_back(parse_host_port_pair(argv[i]));
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--socks5") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.socks5_addresses.push_back(parse_host_port_pair(argv[i]));
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--http2_proxy") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.http2_proxy_address = parse_host_port_pair(argv[i]);
+        } catch (std::exception &) {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--http2_connections") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.http2_connections = std::stoul(argv[i]);
+          if (args.http2_connections == 0) {
+            invalid_param = true;
+          }
+        } catch (std::exception &) {
+          invalid_param = true;
+        }
+      } else if (arg == "--http_proxy_user" || arg == "--http_proxy_password") {
+        if (++i >= argv.size() || argv[i].empty()) {
+          invalid_param = true;
+          break;
+        }
+        (arg == "--http_proxy_user" ? args.http_proxy_username : args.http_proxy_password) = argv[i];
+      } else if (arg == "--http_proxy_auth") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        if (argv[i] == "preemptive") {
+          args.http_proxy_preemptive_auth = true;
+        } else if (argv[i] == "challenge") {
+          args.http_proxy_preemptive_auth = false;
+        } else {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--socks5_user" || arg == "--socks5_password") {
+        // RFC 1929 allows an empty password, but not an empty user name.
+        if (++i >= argv.size() || (arg == "--socks5_user" && argv[i].empty()) || argv[i].size() > 255) {
+          invalid_param = true;
+          break;
+        }
+        (arg == "--socks5_user" ? args.socks5_username : args.socks5_password) = argv[i];
+      } else if (arg == "--pool_size") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.pool_size = std::stoul(argv[i]);
+        } catch (std::exception &) {
+          invalid_param = true;
+        }
+      } else if (arg == "--pool_idle_timeout") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.pool_idle_timeout = std::stoul(argv[i]);
+          if (args.pool_idle_timeout == 0) {
+            invalid_param = true;
+          }
+        } catch (std::exception &) {
+          invalid_param = true;
+        }
+      } else if (arg == "--pool_refill_rate") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.pool_refill_rate = std::stoul(argv[i]);
+          if (args.pool_refill_rate == 0 || args.pool_refill_rate > 1000000) {
+            invalid_param = true;
+          }
+        } catch (std::exception &) {
+          invalid_param = true;
+        }
+      } else if (arg == "--stats_interval") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        try {
+          args.stats_interval = std::stoul(argv[i]);
         } catch (std::exception &) {
           invalid_param = true;
+        }
+      } else if (arg == "--http_proxy_pipelining") {
+        args.http_proxy_pipelining = true;
+      } else if (arg == "--proxy_protocol") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        if (argv[i] == "none") {
+          args.proxy_protocol = ProxyProtocolVersion::none;
+        } else if (argv[i] == "v1") {
+          args.proxy_protocol = ProxyProtocolVersion::v1;
+        } else if (argv[i] == "v2") {
+          args.proxy_protocol = ProxyProtocolVersion::v2;
+        } else {
+          invalid_param = true;
+          break;
+        }
+      } else if (arg == "--proxy_protocol_session_id") {
+        args.proxy_protocol_session_id = true;
+      } else if (arg == "--accept_proxy_protocol") {
+        args.accept_proxy_protocol = true;
+      } else if (arg == "--http_proxy_header") {
+        if (++i >= argv.size()) {
+          invalid_param = true;
+          break;
+        }
+        const auto &header = argv[i];
+        auto colon = header.find(':');
+        if (colon == std::string::npos || colon == 0 || header.find_first_of("\r\n") != std::string::npos) {
+          invalid_param = true;
           break;
         }
+        args.http_proxy_headers.push_back(header);
       } else if (arg == "--log_level") {
         if (++i >= argv.size()) {
           invalid_param = true;
@@ -580,29 +5814,143 @@ struct Args {
           invalid_param = true;
           break;
         }
+      } else if (arg == "-c" || arg == "--config") {
+        if (++i >= argv.size() || argv[i].empty()) {
+          invalid_param = true;
+          break;
+        }
+        args.config_file = argv[i];
       } else {
-        std::cerr << "Unknown argument: " << arg << std::endl;
+        std::cerr << where << "Unknown argument: " << arg << std::endl;
         print_usage();
         std::exit(EXIT_FAILURE);
       }
     }
 
     if (invalid_param) {
-        std::cerr << "Invalid parameter for argument: " << arg << std::endl;
+        std::cerr << where << "Invalid parameter for argument: " << arg << std::endl;
         std::exit(EXIT_FAILURE);
     }
 
-    if (std::get<0>(args.target_address).empty() || std::get<1>(args.target_address) == 0) {
-      std::cerr << "Missing required argument '-t, --target'" << std::endl;
+    if (!args.config_file.empty()) {
+      if (!route_option.empty()) {
+        std::cerr << where << "The argument '" << route_option << "' cannot be combined with '--config', which declares the options of each route." << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      return args;
+    }
+    if (args.targets.empty() && args.sni_routes.empty() && args.host_routes.empty() && args.protocol_routes.empty() &&
+        std::none_of(args.client_rules.begin(), args.client_rules.end(), [](const auto &rule) { return rule.action == ClientRuleOptions::Action::route; })) {
+      std::cerr << where << "Missing required argument '-t, --target'" << std::endl;
       print_usage();
       std::exit(EXIT_FAILURE);
     }
 
-    if (args.via_type == ViaType::http_proxy) {
-      if (std::get<0>(args.http_proxy_address).empty() || std::get<1>(args.http_proxy_address) == 0) {
-        std::cerr << "The argument '--http_proxy' is required because the value of the argument '--via' is set to 'http_proxy'." << std::endl;
+    // Each hop in the chain takes the next address given for its type. As
+    // before chaining, addresses of a type the chain does not use are ignored.
+    auto via_count = [&args](ViaType type) {
+      return static_cast<std::size_t>(std::count(args.via_types.begin(), args.via_types.end(), type));
+    };
+    if (args.http_proxy_addresses.size() < via_count(ViaType::http_proxy)) {
+      std::cerr << where << "The argument '--http_proxy' must be given once for every 'http_proxy' in the argument '--via'." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if (via_count(ViaType::http_proxy) > 0 && args.http_proxy_addresses.size() > via_count(ViaType::http_proxy)) {
+      std::cerr << where << "Warning: extra '--http_proxy' addresses are ignored." << std::endl;
+    }
+    if (args.socks5_addresses.size() < via_count(ViaType::socks5)) {
+      std::cerr << where << "The argument '--socks5' must be given once for every 'socks5' in the argument '--via'." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if (via_count(ViaType::socks5) > 0 && args.socks5_addresses.size() > via_count(ViaType::socks5)) {
+      std::cerr << where << "Warning: extra '--socks5' addresses are ignored." << std::endl;
+    }
+    if (args.http_proxy_username.empty() != args.http_proxy_password.empty()) {
+      std::cerr << where << "The arguments '--http_proxy_user' and '--http_proxy_password' must be given together." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if (args.socks5_username.empty() && !args.socks5_password.empty()) {
+      std::cerr << where << "The argument '--socks5_password' requires '--socks5_user'." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if (via_count(ViaType::http2_proxy) > 0) {
+      if (args.via_types.size() != 1) {
+        std::cerr << where << "The value 'http2_proxy' of the argument '--via' cannot be chained with other proxies." << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      if (std::get<0>(args.http2_proxy_address).empty() || std::get<1>(args.http2_proxy_address) == 0) {
+        std::cerr << where << "The argument '--http2_proxy' is required because the value of the argument '--via' is set to 'http2_proxy'." << std::endl;
         std::exit(EXIT_FAILURE);
       }
+      if (args.pool_size > 0 || args.health_check.type == HealthCheckType::handshake) {
+        std::cerr << where << "The arguments '--pool_size' and '--health_check handshake' are not supported with '--via http2_proxy'." << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+    }
+    auto next_http_proxy = args.http_proxy_addresses.begin();
+    auto next_socks5 = args.socks5_addresses.begin();
+    for (auto type : args.via_types) {
+      switch (type) {
+        case ViaType::http_proxy:
+          args.proxy_chain.push_back({type, *next_http_proxy++});
+          break;
+        case ViaType::socks5:
+          args.proxy_chain.push_back({type, *next_socks5++});
+          break;
+        default:
+          args.proxy_chain.push_back({type, args.http2_proxy_address});
+          break;
+      }
+    }
+
+    if (args.proxy_protocol_session_id && args.proxy_protocol != ProxyProtocolVersion::v2) {
+      std::cerr << where << "The argument '--proxy_protocol_session_id' requires '--proxy_protocol v2'." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if (args.listen_port_count > 1) {
+      std::vector<const std::vector<TargetOptions> *> target_lists = {&args.targets};
+      for (const auto &route : args.sni_routes) {
+        target_lists.push_back(&route.targets);
+      }
+      for (const auto &route : args.host_routes) {
+        target_lists.push_back(&route.targets);
+      }
+      for (const auto &route : args.protocol_routes) {
+        target_lists.push_back(&route.targets);
+      }
+      for (const auto &rule : args.client_rules) {
+        target_lists.push_back(&rule.targets);
+      }
+      for (const auto *targets : target_lists) {
+        for (const auto &target : *targets) {
+          if (std::get<1>(target.address) + args.listen_port_count - 1 > 65535) {
+            std::cerr << where << "The target port " << std::get<1>(target.address) << " moved up by the range of '-p, --port' exceeds 65535." << std::endl;
+            std::exit(EXIT_FAILURE);
+          }
+        }
+      }
+    }
+    if (args.health_check.type == HealthCheckType::handshake && args.proxy_chain.empty()) {
+      std::cerr << where << "The argument '--health_check handshake' requires '--via'." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    auto configure_target = [&args](TargetOptions &target) {
+      target.health_check = args.health_check;
+      target.outlier_detection = args.outlier_detection;
+      target.connect_limit = args.connect_limit;
+    };
+    std::for_each(args.targets.begin(), args.targets.end(), configure_target);
+    for (auto &route : args.sni_routes) {
+      std::for_each(route.targets.begin(), route.targets.end(), configure_target);
+    }
+    for (auto &route : args.host_routes) {
+      std::for_each(route.targets.begin(), route.targets.end(), configure_target);
+    }
+    for (auto &route : args.protocol_routes) {
+      std::for_each(route.targets.begin(), route.targets.end(), configure_target);
+    }
+    for (auto &rule : args.client_rules) {
+      std::for_each(rule.targets.begin(), rule.targets.end(), configure_target);
     }
     return args;
   }
@@ -616,43 +5964,264 @@ struct Args {
     return parse_args(argv_vec);
   }
 
+  // Options that configure the whole process rather than one route.
+  static bool is_process_option(std::string_view arg) {
+    static constexpr std::array<std::string_view, 7> kProcessOptions = {"-c", "--config", "--log_level", "--stats_interval",
+      "--retry_budget", "--source_addr", "--source_port_range"};
+    return std::find(kProcessOptions.begin(), kProcessOptions.end(), arg) != kProcessOptions.end();
+  }
+
+  // Reads one route per line: a listener with its own targets, proxies,
+  // timeouts and limits, written with the same options as the command line.
+  // Empty lines and lines starting with '#' are skipped, and a trailing '\'
+  // continues a route on the next line. Options that configure the whole
+  // process are only accepted on the command line and copied into each route.
+  static std::vector<Args> parse_config(const Args &args) {
+    std::ifstream file(args.config_file);
+    if (!file) {
+      std::cerr << "Cannot open config file: " << args.config_file << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    std::vector<Args> routes;
+    std::string line;
+    std::string route_line;
+    std::size_t line_number = 0;
+    std::size_t route_line_number = 0;
+    while (std::getline(file, line)) {
+      ++line_number;
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (route_line.empty()) {
+        route_line_number = line_number;
+      }
+      if (!line.empty() && line.back() == '\\') {
+        line.back() = ' ';
+        route_line += line;
+        continue;
+      }
+      route_line += line;
+      auto where = stdx::format("{}:{}: ", args.config_file, route_line_number);
+      auto words = split_words(route_line);
+      route_line.clear();
+      if (!words) {
+        std::cerr << where << "Unterminated quote" << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      if (words->empty() || words->front()[0] == '#') {
+        continue;
+      }
+      for (const auto &word : *words) {
+        if (is_process_option(word)) {
+          std::cerr << where << "The argument '" << word << "' applies to the whole process and must be given on the command line." << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+      }
+      words->insert(words->begin(), args.config_file);
+      auto route = parse_args(*words, where);
+      for (const auto &other : routes) {
+        // A wildcard address takes the port on every local address.
+        bool same_address = other.listen_address == route.listen_address || other.listen_address.is_unspecified() ||
+          route.listen_address.is_unspecified();
+        if (same_address && other.listen_port < route.listen_port + route.listen_port_count &&
+            route.listen_port < other.listen_port + other.listen_port_count) {
+          std::cerr << where << "The listen address is already used by another route." << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+      }
+      route.retry_budget = args.retry_budget;
+      route.source_addresses = args.source_addresses;
+      route.source_port_range = args.source_port_range;
+      route.stats_interval = args.stats_interval;
+      route.log_level = args.log_level;
+      routes.push_back(std::move(route));
+    }
+    if (routes.empty()) {
+      std::cerr << "No routes in config file: " << args.config_file << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    return routes;
+  }
+
+  // Splits a line into words like a shell without expansions: whitespace
+  // separates words, quotes group them and a backslash escapes one character.
+  static std::optional<std::vector<std::string>> split_words(const std::string &line) {
+    std::vector<std::string> words;
+    std::string word;
+    bool in_word = false;
+    char quote = 0;
+    for (std::size_t i = 0; i < line.size(); ++i) {
+      char c = line[i];
+      if (quote) {
+        if (c == quote) {
+          quote = 0;
+        } else if (c == '\\' && quote == '"' && i + 1 < line.size()) {
+          word += line[++i];
+        } else {
+          word += c;
+        }
+      } else if (c == ' ' || c == '\t') {
+        if (in_word) {
+          words.push_back(std::move(word));
+          word.clear();
+          in_word = false;
+        }
+      } else {
+        in_word = true;
+        if (c == '"' || c == '\'') {
+          quote = c;
+        } else if (c == '\\' && i + 1 < line.size()) {
+          word += line[++i];
+        } else {
+          word += c;
+        }
+      }
+    }
+    if (quote) {
+      return std::nullopt;
+    }
+    if (in_word) {
+      words.push_back(std::move(word));
+    }
+    return words;
+  }
+
   static void print_args(const Args &args) {
+    auto ports = std::to_string(args.listen_port);
+    if (args.listen_port_count > 1) {
+      ports += "-" + std::to_string(args.listen_port + args.listen_port_count - 1);
+    }
     if (args.listen_address.is_v6()) {
-      std::cout << "Listen address: [" << args.listen_address.to_string() << "]:" << args.listen_port << "\n";
+      std::cout << "Listen address: [" << args.listen_address.to_string() << "]:" << ports << "\n";
     } else {
-      std::cout << "Listen address: " << args.listen_address.to_string() << ":" << args.listen_port << "\n";
+      std::cout << "Listen address: " << args.listen_address.to_string() << ":" << ports << "\n";
+    }
+    for (const auto &target : args.targets) {
+      std::cout << "Target address: " << std::get<0>(target.address) << ":" << std::get<1>(target.address);
+      if (args.targets.size() > 1) {
+        std::cout << " (weight: " << target.weight << ")";
+      }
+      std::cout << "\n";
+    }
+    for (const auto &route : args.sni_routes) {
+      for (const auto &target : route.targets) {
+        std::cout << "SNI route: " << route.hostname << " -> " << std::get<0>(target.address) << ":" << std::get<1>(target.address) << "\n";
+      }
+    }
+    for (const auto &route : args.host_routes) {
+      for (const auto &target : route.targets) {
+        std::cout << "Host route: " << route.hostname << " -> " << std::get<0>(target.address) << ":" << std::get<1>(target.address) << "\n";
+      }
+    }
+    static constexpr const char *kProtocolNames[] = {"tls", "http", "ssh", "proxy"};
+    for (const auto &route : args.protocol_routes) {
+      for (const auto &target : route.targets) {
+        std::cout << "Protocol route: " << kProtocolNames[static_cast<std::size_t>(route.protocol)] << " -> " << std::get<0>(target.address) << ":" << std::get<1>(target.address) << "\n";
+      }
+    }
+    for (const auto &rule : args.client_rules) {
+      auto subnet = stdx::format("{}/{}", rule.address.to_string(), rule.length);
+      if (rule.action != ClientRuleOptions::Action::route) {
+        std::cout << (rule.action == ClientRuleOptions::Action::allow ? "Allow clients: " : "Deny clients: ") << subnet << "\n";
+      }
+      for (const auto &target : rule.targets) {
+        std::cout << "CIDR route: " << subnet << " -> " << std::get<0>(target.address) << ":" << std::get<1>(target.address) << "\n";
+      }
     }
-    std::cout << "Target address: " << std::get<0>(args.target_address) << ":" << std::get<1>(args.target_address) << "\n";
-    if (args.via_type == ViaType::http_proxy) {
-      std::cout << "Via HTTP-Proxy: " << std::get<0>(args.http_proxy_address) << ":" << std::get<1>(args.http_proxy_address) << "\n";
+    for (const auto &hop : args.proxy_chain) {
+      std::cout << (hop.type == ViaType::http_proxy ? "Via HTTP-Proxy: " : hop.type == ViaType::socks5 ? "Via SOCKS5: " : "Via HTTP/2-Proxy: ")
+                << std::get<0>(hop.address) << ":" << std::get<1>(hop.address) << "\n";
     }
     std::cout << "Connection timeout: " << args.timeout << "\n";
+    for (const auto &address : args.source_addresses) {
+      std::cout << "Source address: " << address.to_string() << "\n";
+    }
+    if (args.accept_proxy_protocol) {
+      std::cout << "Accept PROXY protocol: yes\n";
+    }
+    if (args.proxy_protocol != ProxyProtocolVersion::none) {
+      std::cout << "PROXY protocol: " << (args.proxy_protocol == ProxyProtocolVersion::v1 ? "v1" : "v2") << "\n";
+    }
+    if (args.pool_size > 0) {
+      std::cout << "Upstream pool size: " << args.pool_size << " (idle timeout: " << args.pool_idle_timeout << ")\n";
+    }
   }
 };
 
+// Tests and benchmarks include this file for its classes and bring their own
+// main.
+#ifndef TCP_RELAY_NO_MAIN
 int main(int argc, char** argv) {
   auto args = Args::parse_args(argc, argv);
-  Args::print_args(args);
+  auto routes = args.config_file.empty() ? std::vector<Args>{args} : Args::parse_config(args);
+  for (const auto &route : routes) {
+    Args::print_args(route);
+  }
   Log::set_log_level(args.log_level);
+  SourceAddressPool::set_addresses(args.source_addresses);
+  if (args.source_port_range) {
+    SourceAddressPool::set_port_range(args.source_port_range->first, args.source_port_range->second);
+  }
   try {
     asio::io_context io_context(1);
     asio::signal_set signals(io_context, SIGINT, SIGTERM);
     signals.async_wait([&](auto, auto){ io_context.stop(); });
-    asio::co_spawn(io_context, [args]() -> asio::awaitable<void> {
+    // All routes share the event loop, the retry budget and the HTTP/2
+    // connections to a common proxy.
+    auto retry_budget = std::make_shared<RetryBudget>(args.retry_budget);
+    // The servers bind their ports here, before the loop runs, so that a port
+    // that cannot be bound stops the process instead of only that route.
+    std::vector<std::shared_ptr<RelayServer>> servers;
+    for (const auto &route : routes) {
       RelayServerOptions options = {
-        .listen_address = args.listen_address,
-        .listen_port = args.listen_port,
-        .target_address = args.target_address,
-        .timeout = args.timeout,
-        .via_type = args.via_type,
-        .http_proxy_address = args.http_proxy_address,
+        .listen_address = route.listen_address,
+        .listen_port = route.listen_port,
+        .listen_port_count = route.listen_port_count,
+        .targets = route.targets,
+        .sni_routes = route.sni_routes,
+        .host_routes = route.host_routes,
+        .protocol_routes = route.protocol_routes,
+        .client_rules = route.client_rules,
+        .client_limits = route.client_limits,
+        .lb_policy = route.lb_policy,
+        .timeout = route.timeout,
+        .connect_timeout = route.connect_timeout,
+        .connect_attempts = route.connect_attempts,
+        .proxy_chain = route.proxy_chain,
+        .http_proxy_headers = route.http_proxy_headers,
+        .http_proxy_pipelining = route.http_proxy_pipelining,
+        .proxy_protocol = route.proxy_protocol,
+        .proxy_protocol_session_id = route.proxy_protocol_session_id,
+        .accept_proxy_protocol = route.accept_proxy_protocol,
+        .sniff_timeout = route.sniff_timeout,
+        .sniff_max_size = route.sniff_max_size,
+        .http_proxy_username = route.http_proxy_username,
+        .http_proxy_password = route.http_proxy_password,
+        .http_proxy_preemptive_auth = route.http_proxy_preemptive_auth,
+        .socks5_username = route.socks5_username,
+        .socks5_password = route.socks5_password,
+        .http2_connections = route.http2_connections,
+        .pool_options = {
+          .size = route.pool_size,
+          .idle_timeout = route.pool_idle_timeout,
+          .refill_rate = route.pool_refill_rate,
+        },
       };
-      RelayServer server(co_await asio::this_coro::executor, options);
-      co_await server.listen();
-    }, asio::detached);
+      servers.push_back(std::make_shared<RelayServer>(io_context.get_executor(), options, retry_budget));
+    }
+    for (const auto &server : servers) {
+      asio::co_spawn(io_context, [server]() -> asio::awaitable<void> {
+        co_await server->listen();
+      }, asio::detached);
+    }
+    if (args.stats_interval > 0) {
+      asio::co_spawn(io_context, Metrics::report_periodically(std::chrono::seconds(args.stats_interval)), asio::detached);
+    }
     io_context.run();
   } catch (std::exception &e) {
     std::printf("Exception: %s\n", e.what());
+    return EXIT_FAILURE;
   }
   return 0;
 }
+#endif
@@ -0,0 +1,94 @@
+/*
+ *    client_limiter_test.cpp:
+ *
+ *    ClientLimiter session and rate limits per client address and subnet.
+ *
+ */
+
+#include "test.hpp"
+
+#include <thread>
+
+namespace {
+
+ClientLimitOptions options(std::uint32_t sessions_per_ip, std::uint32_t rate_per_ip, std::uint32_t sessions_per_prefix,
+    std::uint32_t rate_per_prefix) {
+  return {sessions_per_ip, rate_per_ip, sessions_per_prefix, rate_per_prefix, 24, 64};
+}
+
+// Rates are counted per steady_clock second; starting right after a second
+// begins keeps a test within one.
+void wait_for_next_second() {
+  auto now = std::chrono::steady_clock::now();
+  std::this_thread::sleep_until(std::chrono::floor<std::chrono::seconds>(now) + std::chrono::seconds(1));
+}
+
+} // namespace
+
+TEST(sessions_per_ip) {
+  auto limiter = std::make_shared<ClientLimiter>(options(2, 0, 0, 0));
+  auto client = asio::ip::make_address("192.0.2.1");
+  auto first = limiter->admit(client);
+  auto second = limiter->admit(client);
+  CHECK(first && second);
+  CHECK(!limiter->admit(client));
+  CHECK(limiter->admit(asio::ip::make_address("192.0.2.2")));
+  // The IPv4-mapped form is the same client.
+  CHECK(!limiter->admit(asio::ip::make_address("::ffff:192.0.2.1")));
+  first.reset();
+  CHECK(limiter->admit(client));
+}
+
+TEST(lease_move_assignment_releases) {
+  auto limiter = std::make_shared<ClientLimiter>(options(1, 0, 0, 0));
+  auto a = asio::ip::make_address("192.0.2.1");
+  auto b = asio::ip::make_address("192.0.2.2");
+  auto lease = limiter->admit(a);
+  auto other = limiter->admit(b);
+  CHECK(lease && other);
+  *lease = std::move(*other);
+  CHECK(limiter->admit(a));
+  CHECK(!limiter->admit(b));
+}
+
+TEST(sessions_per_prefix) {
+  auto limiter = std::make_shared<ClientLimiter>(options(0, 0, 2, 0));
+  auto first = limiter->admit(asio::ip::make_address("192.0.2.1"));
+  auto second = limiter->admit(asio::ip::make_address("192.0.2.200"));
+  CHECK(first && second);
+  CHECK(!limiter->admit(asio::ip::make_address("192.0.2.3")));
+  CHECK(limiter->admit(asio::ip::make_address("192.0.3.1")));
+  auto v6_first = limiter->admit(asio::ip::make_address("2001:db8::1"));
+  auto v6_second = limiter->admit(asio::ip::make_address("2001:db8::ffff:2"));
+  CHECK(v6_first && v6_second);
+  CHECK(!limiter->admit(asio::ip::make_address("2001:db8::3")));
+  CHECK(limiter->admit(asio::ip::make_address("2001:db8:0:1::1")));
+}
+
+TEST(rate_per_ip) {
+  auto limiter = std::make_shared<ClientLimiter>(options(0, 5, 0, 0));
+  auto client = asio::ip::make_address("192.0.2.1");
+  wait_for_next_second();
+  for (int i = 0; i < 5; ++i) {
+    CHECK(limiter->admit(client));
+  }
+  CHECK(!limiter->admit(client));
+  CHECK(limiter->admit(asio::ip::make_address("192.0.2.2")));
+}
+
+// The sketch counters saturate at 65535; the highest accepted limit must
+// still reject.
+TEST(highest_rate_limit_applies) {
+  auto limiter = std::make_shared<ClientLimiter>(options(0, ClientLimiter::kMaxRate, 0, 0));
+  auto client = asio::ip::make_address("192.0.2.1");
+  wait_for_next_second();
+  std::uint32_t admitted = 0;
+  for (std::uint32_t i = 0; i < ClientLimiter::kMaxRate + 10; ++i) {
+    admitted += limiter->admit(client).has_value();
+  }
+  CHECK(admitted == ClientLimiter::kMaxRate);
+}
+
+int main() {
+  return test::run_all();
+}
@@ -0,0 +1,301 @@
+/*
+ *    http2_test.cpp:
+ *
+ *    HpackDecoder against the examples of RFC 7541 Appendix C, and
+ *    Http2Connection against a fake HTTP/2 proxy on the loopback interface
+ *    that answers a CONNECT stream with scripted frames.
+ *
+ */
+
+#include "test.hpp"
+
+namespace {
+
+using Headers = std::vector<HpackDecoder::Header>;
+
+std::string from_hex(std::string_view hex) {
+  std::string bytes;
+  for (std::size_t i = 0; i + 1 < hex.size();) {
+    if (hex[i] == ' ') {
+      ++i;
+      continue;
+    }
+    bytes += static_cast<char>(std::stoi(std::string(hex.substr(i, 2)), nullptr, 16));
+    i += 2;
+  }
+  return bytes;
+}
+
+Headers decode(HpackDecoder &decoder, std::string_view hex) {
+  Headers headers;
+  CHECK(decoder.decode(from_hex(hex), headers));
+  return headers;
+}
+
+// C.5 and C.6 use a 256 byte table; the decoder is told so by a dynamic
+// table size update (0x3fe101) at the start of the first block.
+constexpr std::string_view kTableSize256 = "3fe101 ";
+
+const Headers kRequest1 = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}};
+const Headers kRequest2 = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+  {"cache-control", "no-cache"}};
+const Headers kRequest3 = {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+  {"custom-key", "custom-value"}};
+const Headers kResponse1 = {{":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+  {"location", "https://www.example.com"}};
+const Headers kResponse2 = {{":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+  {"location", "https://www.example.com"}};
+const Headers kResponse3 = {{":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+  {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+  {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}};
+
+} // namespace
+
+TEST(hpack_c3_requests_without_huffman) {
+  HpackDecoder decoder;
+  CHECK(decode(decoder, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d") == kRequest1);
+  CHECK(decode(decoder, "8286 84be 5808 6e6f 2d63 6163 6865") == kRequest2);
+  CHECK(decode(decoder, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65") == kRequest3);
+}
+
+TEST(hpack_c4_requests_with_huffman) {
+  HpackDecoder decoder;
+  CHECK(decode(decoder, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff") == kRequest1);
+  CHECK(decode(decoder, "8286 84be 5886 a8eb 1064 9cbf") == kRequest2);
+  CHECK(decode(decoder, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf") == kRequest3);
+}
+
+TEST(hpack_c5_responses_without_huffman) {
+  HpackDecoder decoder;
+  CHECK(decode(decoder, std::string(kTableSize256) +
+    "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d "
+    "546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d") == kResponse1);
+  CHECK(decode(decoder, "4803 3330 37c1 c0bf") == kResponse2);
+  // Inserting the new date and the cookie evicts older entries; c0/c1 must
+  // still resolve to the right ones.
+  CHECK(decode(decoder,
+    "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f "
+    "6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b "
+    "2076 6572 7369 6f6e 3d31") == kResponse3);
+}
+
+TEST(hpack_c6_responses_with_huffman) {
+  HpackDecoder decoder;
+  CHECK(decode(decoder, std::string(kTableSize256) +
+    "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 "
+    "8f0b 97c8 e9ae 82ae 43d3") == kResponse1);
+  CHECK(decode(decoder, "4883 640e ffc1 c0bf") == kResponse2);
+  CHECK(decode(decoder,
+    "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 "
+    "dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07") == kResponse3);
+}
+
+TEST(hpack_malformed_blocks) {
+  for (auto hex : {
+      "80",         // index 0
+      "be",         // dynamic index past an empty table
+      "ff",         // integer cut short
+      "3fe21f",     // table size update above the limit
+      "4003 6162",  // literal name longer than the block
+      "4081 ff00",  // Huffman padding longer than 7 bits
+    }) {
+    HpackDecoder decoder;
+    Headers headers;
+    CHECK(!decoder.decode(from_hex(hex), headers));
+  }
+}
+
+namespace {
+
+constexpr std::uint8_t kData = 0x0;
+constexpr std::uint8_t kHeaders = 0x1;
+constexpr std::uint8_t kRstStream = 0x3;
+constexpr std::uint8_t kSettings = 0x4;
+constexpr std::uint8_t kWindowUpdate = 0x8;
+constexpr std::uint8_t kContinuation = 0x9;
+constexpr std::uint8_t kEndHeaders = 0x4;
+
+struct Frame {
+  std::uint8_t type;
+  std::uint8_t flags;
+  std::uint32_t stream_id;
+  std::string payload;
+};
+
+std::string uint32_bytes(std::uint32_t value) {
+  return {static_cast<char>(value >> 24), static_cast<char>(value >> 16), static_cast<char>(value >> 8), static_cast<char>(value)};
+}
+
+std::uint32_t read_uint32(std::string_view data) {
+  return static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[0])) << 24 | static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[1])) << 16 |
+    static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[2])) << 8 | static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[3]));
+}
+
+std::string frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+  auto length = static_cast<std::uint32_t>(payload.size());
+  std::string bytes = {static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length),
+    static_cast<char>(type), static_cast<char>(flags)};
+  bytes += uint32_bytes(stream_id);
+  bytes += payload;
+  return bytes;
+}
+
+asio::awaitable<std::optional<Frame>> read_frame(asio::ip::tcp::socket &socket) {
+  std::array<char, 9> header;
+  auto [ec, n] = co_await asio::async_read(socket, asio::buffer(header), asio::as_tuple(asio::use_awaitable));
+  if (ec) {
+    co_return std::nullopt;
+  }
+  Frame frame{static_cast<std::uint8_t>(header[3]), static_cast<std::uint8_t>(header[4]), read_uint32({header.data() + 5, 4}) & 0x7fffffff, {}};
+  frame.payload.resize(static_cast<std::uint8_t>(header[0]) << 16 | static_cast<std::uint8_t>(header[1]) << 8 | static_cast<std::uint8_t>(header[2]));
+  auto [payload_ec, m] = co_await asio::async_read(socket, asio::buffer(frame.payload), asio::as_tuple(asio::use_awaitable));
+  if (payload_ec) {
+    co_return std::nullopt;
+  }
+  co_return frame;
+}
+
+struct Outcome {
+  Headers request;              // the CONNECT header block the proxy decoded
+  std::vector<Frame> received;  // frames after the CONNECT HEADERS
+  std::string response_error;   // what wait_for_response threw, if anything
+  std::string data;             // what the stream read
+  asio::error_code read_error;  // how reading the stream ended
+};
+
+// The fake proxy answers the CONNECT HEADERS with `script`, then records the
+// client's frames until it resets the stream or closes the connection. The
+// client reads the stream until an error or end of stream.
+Outcome exchange(const std::string &script) {
+  Outcome outcome;
+  test::run_async([&]() -> asio::awaitable<void> {
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::acceptor acceptor(executor, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::co_spawn(executor, [&]() -> asio::awaitable<void> {
+      auto peer = co_await acceptor.async_accept(asio::use_awaitable);
+      std::string preface(24, '\0');
+      co_await asio::async_read(peer, asio::buffer(preface), asio::use_awaitable);
+      CHECK(preface == "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+      HpackDecoder decoder;
+      bool scripted = false;
+      while (auto frame = co_await read_frame(peer)) {
+        if (!scripted && frame->type == kHeaders) {
+          CHECK(frame->stream_id == 1);
+          CHECK(frame->flags & kEndHeaders);
+          CHECK(decoder.decode(frame->payload, outcome.request));
+          co_await asio::async_write(peer, asio::buffer(script), asio::use_awaitable);
+          scripted = true;
+        } else if (scripted) {
+          outcome.received.push_back(*frame);
+          if (frame->type == kRstStream) {
+            break;
+          }
+        }
+      }
+    }, asio::detached);
+    asio::ip::tcp::socket socket(executor);
+    co_await socket.async_connect(acceptor.local_endpoint(), asio::use_awaitable);
+    auto connection = std::make_shared<Http2Connection>(std::move(socket));
+    connection->start();
+    auto stream = connection->open_stream(Http2ConnectRequest({"example.com", 443}, {"X-Test: 1", "Connection: close"}));
+    try {
+      co_await stream->wait_for_response(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    } catch (const std::exception &e) {
+      outcome.response_error = e.what();
+      co_return;
+    }
+    std::array<char, 1024> buffer;
+    for (;;) {
+      auto [ec, bytes_read] = co_await stream->async_read_some(asio::buffer(buffer));
+      if (ec) {
+        outcome.read_error = ec;
+        break;
+      }
+      outcome.data.append(buffer.data(), bytes_read);
+    }
+  });
+  return outcome;
+}
+
+const std::string kOk = frame(kHeaders, kEndHeaders, 1, "\x88");
+
+bool has_rst_stream(const Outcome &outcome, std::uint32_t error_code) {
+  return std::any_of(outcome.received.begin(), outcome.received.end(), [&](const Frame &f) {
+    return f.type == kRstStream && f.stream_id == 1 && f.payload.size() == 4 && read_uint32(f.payload) == error_code;
+  });
+}
+
+} // namespace
+
+TEST(http2_connect_and_data) {
+  auto outcome = exchange(kOk + frame(kData, 0, 1, "hello") + frame(kData, 0x1, 1, " world"));
+  CHECK(outcome.request == Headers({{":method", "CONNECT"}, {":authority", "example.com:443"}, {"x-test", "1"}}));
+  CHECK(outcome.response_error.empty());
+  CHECK(outcome.data == "hello world");
+  CHECK(outcome.read_error == asio::error::eof);
+}
+
+TEST(http2_connect_refused) {
+  auto outcome = exchange(frame(kHeaders, kEndHeaders | 0x1, 1, "\x8d"));
+  CHECK(outcome.response_error == "HTTP/2 CONNECT failed with status 404");
+}
+
+TEST(http2_padded_data) {
+  auto outcome = exchange(kOk + frame(kData, 0x8 | 0x1, 1, std::string("\x03", 1) + "abc" + std::string(3, '\0')));
+  CHECK(outcome.data == "abc");
+}
+
+TEST(http2_connection_window_update_zero) {
+  auto outcome = exchange(kOk + frame(kWindowUpdate, 0, 0, uint32_bytes(0)));
+  CHECK(outcome.read_error == asio::error::connection_aborted);
+}
+
+TEST(http2_stream_window_update_zero) {
+  auto outcome = exchange(kOk + frame(kWindowUpdate, 0, 1, uint32_bytes(0)));
+  CHECK(outcome.read_error == asio::error::connection_reset);
+  CHECK(has_rst_stream(outcome, 0x1));
+}
+
+TEST(http2_connection_window_overflow) {
+  auto outcome = exchange(kOk + frame(kWindowUpdate, 0, 0, uint32_bytes(0x7fffffff - 65535 + 1)));
+  CHECK(outcome.read_error == asio::error::connection_aborted);
+}
+
+TEST(http2_connection_window_at_limit) {
+  auto outcome = exchange(kOk + frame(kWindowUpdate, 0, 0, uint32_bytes(0x7fffffff - 65535)) + frame(kData, 0x1, 1, "ok"));
+  CHECK(outcome.data == "ok");
+  CHECK(outcome.read_error == asio::error::eof);
+}
+
+TEST(http2_stream_window_overflow) {
+  auto outcome = exchange(kOk + frame(kWindowUpdate, 0, 1, uint32_bytes(0x7fffffff - 65535 + 1)));
+  CHECK(outcome.read_error == asio::error::connection_reset);
+  CHECK(has_rst_stream(outcome, 0x3));
+}
+
+TEST(http2_initial_window_size_overflow) {
+  auto outcome = exchange(kOk + frame(kWindowUpdate, 0, 1, uint32_bytes(1)) +
+    frame(kSettings, 0, 0, std::string("\x00\x04", 2) + uint32_bytes(0x7fffffff)));
+  CHECK(outcome.read_error == asio::error::connection_aborted);
+}
+
+// A header block is capped at 64 KiB however it is split.
+TEST(http2_header_block_too_large) {
+  std::string script = frame(kHeaders, 0, 1, "\x88");
+  for (int i = 0; i < 5; ++i) {
+    script += frame(kContinuation, 0, 1, std::string(16000, '\x80'));
+  }
+  auto outcome = exchange(script);
+  CHECK(!outcome.response_error.empty());
+}
+
+TEST(http2_header_block_in_continuations) {
+  auto outcome = exchange(frame(kHeaders, 0, 1, "") + frame(kContinuation, 0, 1, "") +
+    frame(kContinuation, kEndHeaders, 1, "\x88") + frame(kData, 0x1, 1, "ok"));
+  CHECK(outcome.response_error.empty());
+  CHECK(outcome.data == "ok");
+}
+
+int main() {
+  return test::run_all();
+}
@@ -0,0 +1,128 @@
+/*
+ *    http_connect_test.cpp:
+ *
+ *    Runs UpstreamConnector::http_proxy_handshake against a fake HTTP proxy on
+ *    the loopback interface that answers each CONNECT with a scripted response.
+ *
+ */
+
+#include "test.hpp"
+
+namespace {
+
+struct Outcome {
+  std::string received;  // everything the proxy read until the client closed
+  std::string leftover;  // what the handshake returned
+  std::string error;     // what the handshake threw, if anything
+};
+
+// The fake proxy answers the n-th request header with responses[n], and
+// records all bytes it reads until the client closes the connection.
+Outcome handshake(const HttpConnectRequest &request, const std::string &early_data,
+    const std::vector<std::string> &responses) {
+  Outcome outcome;
+  test::run_async([&]() -> asio::awaitable<void> {
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::acceptor acceptor(executor, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::co_spawn(executor, [&]() -> asio::awaitable<void> {
+      auto peer = co_await acceptor.async_accept(asio::use_awaitable);
+      std::size_t headers_seen = 0;
+      std::size_t search_from = 0;
+      std::array<char, 4096> buffer;
+      for (;;) {
+        auto [ec, bytes_read] = co_await peer.async_read_some(asio::buffer(buffer), asio::as_tuple(asio::use_awaitable));
+        if (ec) {
+          break;
+        }
+        outcome.received.append(buffer.data(), bytes_read);
+        for (std::size_t end; headers_seen < responses.size() &&
+            (end = outcome.received.find("\r\n\r\n", search_from)) != std::string::npos;) {
+          search_from = end + 4;
+          co_await asio::async_write(peer, asio::buffer(responses[headers_seen++]), asio::use_awaitable);
+        }
+      }
+    }, asio::detached);
+    asio::ip::tcp::socket server(executor);
+    co_await server.async_connect(acceptor.local_endpoint(), asio::use_awaitable);
+    try {
+      outcome.leftover = co_await UpstreamConnector("test").http_proxy_handshake(server, request,
+        asio::buffer(early_data), std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    } catch (const std::exception &e) {
+      outcome.error = e.what();
+    }
+    server.shutdown(asio::ip::tcp::socket::shutdown_send);
+  });
+  return outcome;
+}
+
+std::size_t count(const std::string &s, std::string_view needle) {
+  std::size_t n = 0;
+  for (auto pos = s.find(needle); pos != std::string::npos; pos = s.find(needle, pos + 1)) {
+    ++n;
+  }
+  return n;
+}
+
+const auto kNoHeaders = std::make_shared<const std::string>();
+const auto kCredentials = std::make_shared<const std::string>("Proxy-Authorization: Basic YTpi\r\n");
+const std::string kOk = "HTTP/1.1 200 Connection established\r\n\r\n";
+const std::string kChallenge =
+  "HTTP/1.1 407 Proxy Authentication Required\r\nContent-Length: 4\r\nConnection: keep-alive\r\n\r\ndeny";
+
+} // namespace
+
+TEST(pipelined_early_data) {
+  HttpConnectRequest request({"example.com", 443}, kNoHeaders, nullptr, false);
+  auto outcome = handshake(request, "hello", {kOk + "world"});
+  CHECK(outcome.error.empty());
+  CHECK(outcome.received == "CONNECT example.com:443 HTTP/1.1\r\nHost: example.com:443\r\n"
+    "Proxy-Connection: keep-alive\r\n\r\nhello");
+  CHECK(outcome.leftover == "world");
+}
+
+TEST(ipv6_authority) {
+  HttpConnectRequest request({"::1", 443}, kNoHeaders, nullptr, false);
+  auto outcome = handshake(request, "", {kOk});
+  CHECK(outcome.error.empty());
+  CHECK(outcome.received.starts_with("CONNECT [::1]:443 HTTP/1.1\r\n"));
+}
+
+TEST(preemptive_credentials) {
+  HttpConnectRequest request({"example.com", 443}, kNoHeaders, kCredentials, true);
+  auto outcome = handshake(request, "hello", {kOk});
+  CHECK(outcome.error.empty());
+  CHECK(count(outcome.received, "Proxy-Authorization") == 1);
+  CHECK(outcome.received.ends_with("\r\n\r\nhello"));
+}
+
+TEST(challenge_then_credentials) {
+  HttpConnectRequest request({"example.com", 443}, kNoHeaders, kCredentials, false);
+  auto outcome = handshake(request, "hello", {kChallenge, kOk});
+  CHECK(outcome.error.empty());
+  CHECK(count(outcome.received, "CONNECT ") == 2);
+  CHECK(count(outcome.received, "Proxy-Authorization") == 1);
+  CHECK(count(outcome.received, "hello") == 1);
+  CHECK(outcome.received.ends_with("\r\n\r\nhello"));
+}
+
+// The proxy does not ask for credentials; the early data held back for the
+// retry must still be sent.
+TEST(challenge_expected_but_accepted) {
+  HttpConnectRequest request({"example.com", 443}, kNoHeaders, kCredentials, false);
+  auto outcome = handshake(request, "hello", {kOk + "world"});
+  CHECK(outcome.error.empty());
+  CHECK(count(outcome.received, "CONNECT ") == 1);
+  CHECK(count(outcome.received, "Proxy-Authorization") == 0);
+  CHECK(outcome.received.ends_with("\r\n\r\nhello"));
+  CHECK(outcome.leftover == "world");
+}
+
+TEST(connect_refused) {
+  HttpConnectRequest request({"example.com", 443}, kNoHeaders, nullptr, false);
+  auto outcome = handshake(request, "", {"HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n"});
+  CHECK(outcome.error == "HTTP connect failed");
+}
+
+int main() {
+  return test::run_all();
+}
@@ -0,0 +1,231 @@
+/*
+ *    prefix_table_test.cpp:
+ *
+ *    Compares PrefixTable lookups with a brute-force longest prefix match over
+ *    random prefixes and addresses.
+ *
+ */
+
+#include "test.hpp"
+
+#include <random>
+
+namespace {
+
+struct Reference {
+  struct Entry {
+    std::vector<std::uint8_t> bytes;  // 4 or 16
+    std::uint32_t length;
+    std::uint32_t value;
+  };
+
+  static std::vector<std::uint8_t> to_bytes(asio::ip::address address) {
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+      address = asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6());
+    }
+    if (address.is_v4()) {
+      auto bytes = address.to_v4().to_bytes();
+      return {bytes.begin(), bytes.end()};
+    }
+    auto bytes = address.to_v6().to_bytes();
+    return {bytes.begin(), bytes.end()};
+  }
+
+  static bool matches(const std::vector<std::uint8_t> &a, const std::vector<std::uint8_t> &b, std::uint32_t length) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (std::uint32_t bit = 0; bit < length; ++bit) {
+      if ((a[bit / 8] ^ b[bit / 8]) & (0x80 >> bit % 8)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void add(const asio::ip::address &address, std::uint32_t length, std::uint32_t value) {
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+      length -= 96;
+    }
+    entries.push_back({to_bytes(address), length, value});
+  }
+
+  // Longest match; of equal prefixes the one added last.
+  std::uint32_t find(const asio::ip::address &address) const {
+    auto bytes = to_bytes(address);
+    const Entry *best = nullptr;
+    for (const auto &entry : entries) {
+      if (matches(entry.bytes, bytes, entry.length) && (!best || entry.length >= best->length)) {
+        best = &entry;
+      }
+    }
+    return best ? best->value : 0;
+  }
+
+  std::vector<Entry> entries;
+};
+
+asio::ip::address random_address(std::mt19937_64 &rng, bool v6) {
+  if (!v6) {
+    return asio::ip::address_v4(static_cast<std::uint32_t>(rng()));
+  }
+  asio::ip::address_v6::bytes_type bytes;
+  for (auto &byte : bytes) {
+    byte = static_cast<std::uint8_t>(rng());
+  }
+  return asio::ip::address_v6(bytes);
+}
+
+// An address inside the prefix, so that deep prefixes get hits too.
+asio::ip::address inside(std::mt19937_64 &rng, const Reference::Entry &entry) {
+  auto bytes = entry.bytes;
+  auto other = Reference::to_bytes(random_address(rng, bytes.size() == 16));
+  for (std::uint32_t bit = entry.length; bit < bytes.size() * 8; ++bit) {
+    std::uint8_t mask = 0x80 >> bit % 8;
+    bytes[bit / 8] = (bytes[bit / 8] & ~mask) | (other[bit / 8] & mask);
+  }
+  if (bytes.size() == 4) {
+    return asio::ip::address_v4({bytes[0], bytes[1], bytes[2], bytes[3]});
+  }
+  asio::ip::address_v6::bytes_type v6;
+  std::copy(bytes.begin(), bytes.end(), v6.begin());
+  return asio::ip::address_v6(v6);
+}
+
+asio::ip::address mapped(const asio::ip::address &address) {
+  return asio::ip::make_address_v6(asio::ip::v4_mapped, address.to_v4());
+}
+
+// Lengths around the ends and the 18-bit direct array, plus any others.
+std::uint32_t random_length(std::mt19937_64 &rng, bool v6) {
+  static constexpr std::array<std::uint32_t, 10> kV4 = {0, 1, 8, 16, 17, 18, 19, 24, 31, 32};
+  static constexpr std::array<std::uint32_t, 12> kV6 = {0, 1, 17, 18, 19, 24, 32, 48, 64, 96, 127, 128};
+  if (rng() % 2) {
+    return static_cast<std::uint32_t>(rng() % (v6 ? 129 : 33));
+  }
+  return v6 ? kV6[rng() % kV6.size()] : kV4[rng() % kV4.size()];
+}
+
+// Builds a table of `count` random prefixes, some of them nested inside
+// earlier ones, and checks `probes` lookups against the reference.
+void compare(std::uint64_t seed, std::size_t count, std::size_t probes) {
+  std::mt19937_64 rng(seed);
+  PrefixTable table;
+  Reference reference;
+  for (std::uint32_t value = 1; value <= count; ++value) {
+    bool v6 = rng() % 2;
+    auto length = random_length(rng, v6);
+    auto address = random_address(rng, v6);
+    if (!reference.entries.empty() && rng() % 2) {
+      // Nest inside an existing prefix of the same family, if any.
+      const auto &outer = reference.entries[rng() % reference.entries.size()];
+      if ((outer.bytes.size() == 16) == v6) {
+        address = inside(rng, outer);
+      }
+    }
+    if (!v6 && rng() % 4 == 0) {
+      CHECK(table.add(mapped(address), length + 96, value));
+      reference.add(mapped(address), length + 96, value);
+    } else {
+      CHECK(table.add(address, length, value));
+      reference.add(address, length, value);
+    }
+  }
+  table.build();
+  for (std::size_t i = 0; i < probes; ++i) {
+    asio::ip::address address;
+    if (rng() % 4 == 0) {
+      address = random_address(rng, rng() % 2);
+    } else {
+      address = inside(rng, reference.entries[rng() % reference.entries.size()]);
+    }
+    if (address.is_v4() && rng() % 4 == 0) {
+      address = mapped(address);
+    }
+    auto expected = reference.find(address);
+    auto found = table.find(address);
+    if (found != expected) {
+      std::fprintf(stderr, "seed %llu: %s -> %u, expected %u\n", static_cast<unsigned long long>(seed),
+        address.to_string().c_str(), found, expected);
+    }
+    CHECK(found == expected);
+  }
+}
+
+} // namespace
+
+TEST(empty_table) {
+  PrefixTable table;
+  CHECK(table.empty());
+  table.build();
+  CHECK(table.find(asio::ip::make_address("10.0.0.1")) == 0);
+  CHECK(table.find(asio::ip::make_address("::1")) == 0);
+}
+
+TEST(rejects_bad_lengths) {
+  PrefixTable table;
+  CHECK(!table.add(asio::ip::make_address("10.0.0.0"), 33, 1));
+  CHECK(!table.add(asio::ip::make_address("::"), 129, 1));
+  CHECK(!table.add(asio::ip::make_address("::ffff:10.0.0.0"), 95, 1));
+  CHECK(table.add(asio::ip::make_address("::ffff:10.0.0.0"), 96, 1));
+}
+
+TEST(default_routes_and_host_routes) {
+  PrefixTable table;
+  table.add(asio::ip::make_address("0.0.0.0"), 0, 1);
+  table.add(asio::ip::make_address("::"), 0, 2);
+  table.add(asio::ip::make_address("192.0.2.7"), 32, 3);
+  table.add(asio::ip::make_address("2001:db8::7"), 128, 4);
+  table.build();
+  CHECK(table.find(asio::ip::make_address("198.51.100.1")) == 1);
+  CHECK(table.find(asio::ip::make_address("192.0.2.7")) == 3);
+  CHECK(table.find(asio::ip::make_address("192.0.2.6")) == 1);
+  CHECK(table.find(asio::ip::make_address("::ffff:192.0.2.7")) == 3);
+  CHECK(table.find(asio::ip::make_address("2001:db8::7")) == 4);
+  CHECK(table.find(asio::ip::make_address("2001:db8::6")) == 2);
+}
+
+// Prefixes just above, at and just below the direct array, sharing it.
+TEST(direct_array_boundary) {
+  PrefixTable table;
+  table.add(asio::ip::make_address("10.0.0.0"), 17, 1);
+  table.add(asio::ip::make_address("10.0.64.0"), 18, 2);
+  table.add(asio::ip::make_address("10.0.96.0"), 19, 3);
+  table.add(asio::ip::make_address("10.0.96.0"), 24, 4);
+  table.add(asio::ip::make_address("10.0.96.1"), 32, 5);
+  table.build();
+  CHECK(table.find(asio::ip::make_address("10.0.0.1")) == 1);
+  CHECK(table.find(asio::ip::make_address("10.0.127.255")) == 3);
+  CHECK(table.find(asio::ip::make_address("10.0.64.1")) == 2);
+  CHECK(table.find(asio::ip::make_address("10.0.112.1")) == 3);
+  CHECK(table.find(asio::ip::make_address("10.0.96.2")) == 4);
+  CHECK(table.find(asio::ip::make_address("10.0.96.1")) == 5);
+  CHECK(table.find(asio::ip::make_address("10.0.128.0")) == 0);
+}
+
+TEST(last_added_wins) {
+  PrefixTable table;
+  table.add(asio::ip::make_address("10.1.2.3"), 8, 1);
+  table.add(asio::ip::make_address("10.0.0.0"), 8, 2);
+  table.add(asio::ip::make_address("10.200.0.0"), 24, 3);
+  table.add(asio::ip::make_address("::ffff:10.200.0.9"), 120, 4);
+  table.build();
+  CHECK(table.find(asio::ip::make_address("10.9.9.9")) == 2);
+  CHECK(table.find(asio::ip::make_address("10.200.0.1")) == 4);
+}
+
+TEST(brute_force_small_tables) {
+  for (std::uint64_t seed = 1; seed <= 200; ++seed) {
+    compare(seed, 1 + seed % 20, 200);
+  }
+}
+
+TEST(brute_force_large_tables) {
+  for (std::uint64_t seed = 1000; seed < 1010; ++seed) {
+    compare(seed, 2000, 20000);
+  }
+}
+
+int main() {
+  return test::run_all();
+}
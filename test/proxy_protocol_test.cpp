@@ -0,0 +1,180 @@
+/*
+ *    proxy_protocol_test.cpp:
+ *
+ *    ProxyProtocolParser on v1 and v2 headers, whole and split across reads
+ *    the way the session feeds it: everything received so far each time.
+ *
+ */
+
+#include "test.hpp"
+
+namespace {
+
+using Result = ProxyProtocolParser::Result;
+
+// Feeds `data` in chunks of `chunk_size` bytes until the parser decides.
+Result parse(ProxyProtocolParser &parser, std::string_view data, std::size_t chunk_size = 0) {
+  if (chunk_size == 0) {
+    chunk_size = data.size();
+  }
+  auto result = Result::incomplete;
+  for (std::size_t size = std::min(chunk_size, data.size());; size = std::min(size + chunk_size, data.size())) {
+    result = parser.parse(data.substr(0, size));
+    if (result != Result::incomplete || size == data.size()) {
+      return result;
+    }
+  }
+}
+
+Result parse(std::string_view data) {
+  ProxyProtocolParser parser;
+  return parse(parser, data);
+}
+
+std::string v2_header(std::uint8_t version_command, std::uint8_t family, const std::string &addresses) {
+  std::string header("\r\n\r\n\0\r\nQUIT\n", 12);
+  header += static_cast<char>(version_command);
+  header += static_cast<char>(family);
+  header += static_cast<char>(addresses.size() >> 8);
+  header += static_cast<char>(addresses.size());
+  return header + addresses;
+}
+
+std::string bytes(std::initializer_list<int> values) {
+  std::string s;
+  for (auto value : values) {
+    s += static_cast<char>(value);
+  }
+  return s;
+}
+
+const std::string kV2Tcp4 = bytes({203, 0, 113, 5, 10, 0, 0, 1, 0x15, 0xb3, 0x00, 0x50});
+
+} // namespace
+
+TEST(v1_tcp4) {
+  ProxyProtocolParser parser;
+  std::string_view header = "PROXY TCP4 203.0.113.5 10.0.0.1 5555 80\r\n";
+  CHECK(parse(parser, header) == Result::complete);
+  CHECK(parser.header_size() == header.size());
+  CHECK(parser.source() == asio::ip::tcp::endpoint(asio::ip::make_address("203.0.113.5"), 5555));
+  CHECK(parser.destination() == asio::ip::tcp::endpoint(asio::ip::make_address("10.0.0.1"), 80));
+}
+
+TEST(v1_tcp6) {
+  ProxyProtocolParser parser;
+  CHECK(parse(parser, "PROXY TCP6 2001:db8::5 2001:db8::1 443 8443\r\n") == Result::complete);
+  CHECK(parser.source() == asio::ip::tcp::endpoint(asio::ip::make_address("2001:db8::5"), 443));
+  CHECK(parser.destination() == asio::ip::tcp::endpoint(asio::ip::make_address("2001:db8::1"), 8443));
+}
+
+TEST(v1_unknown_keeps_socket_addresses) {
+  ProxyProtocolParser parser;
+  CHECK(parse(parser, "PROXY UNKNOWN\r\n") == Result::complete);
+  CHECK(parser.header_size() == 15);
+  CHECK(!parser.source());
+  CHECK(parse("PROXY UNKNOWN ffff::1 ffff::2 1 2\r\n") == Result::complete);
+}
+
+TEST(v1_malformed) {
+  CHECK(parse("PROXY TCP4 2001:db8::5 10.0.0.1 5555 80\r\n") == Result::error);
+  CHECK(parse("PROXY TCP6 203.0.113.5 10.0.0.1 5555 80\r\n") == Result::error);
+  CHECK(parse("PROXY TCP4 203.0.113.5 10.0.0.1 5555\r\n") == Result::error);
+  CHECK(parse("PROXY TCP4 203.0.113.5 10.0.0.1 5555 80 extra\r\n") == Result::error);
+  CHECK(parse("PROXY TCP4 203.0.113.5 10.0.0.1 5555 70000\r\n") == Result::error);
+  CHECK(parse("PROXY UDP4 203.0.113.5 10.0.0.1 5555 80\r\n") == Result::error);
+  CHECK(parse("PROXX TCP4") == Result::error);
+  CHECK(parse("GET / HTTP/1.1\r\n") == Result::error);
+}
+
+// 107 bytes is the longest line the spec allows, CRLF included.
+TEST(v1_line_length_limit) {
+  std::string longest = "PROXY UNKNOWN " + std::string(107 - 16, 'x') + "\r\n";
+  CHECK(longest.size() == 107);
+  CHECK(parse(longest) == Result::complete);
+  std::string too_long = "PROXY UNKNOWN " + std::string(107 - 15, 'x') + "\r\n";
+  CHECK(parse(too_long) == Result::error);
+  CHECK(parse(std::string("PROXY UNKNOWN ") + std::string(200, 'x')) == Result::error);
+  CHECK(parse(std::string("PROXY UNKNOWN ") + std::string(50, 'x')) == Result::incomplete);
+}
+
+TEST(v2_proxy_tcp4) {
+  ProxyProtocolParser parser;
+  auto header = v2_header(0x21, 0x11, kV2Tcp4);
+  CHECK(parse(parser, header) == Result::complete);
+  CHECK(parser.header_size() == 28);
+  CHECK(parser.source() == asio::ip::tcp::endpoint(asio::ip::make_address("203.0.113.5"), 5555));
+  CHECK(parser.destination() == asio::ip::tcp::endpoint(asio::ip::make_address("10.0.0.1"), 80));
+}
+
+TEST(v2_proxy_tcp6_with_tlvs) {
+  ProxyProtocolParser parser;
+  std::string addresses(32, '\0');
+  addresses[15] = 5;
+  addresses[31] = 1;
+  addresses += bytes({0x01, 0xbb, 0x20, 0xfb});
+  addresses += bytes({0x05, 0x00, 0x02, 'i', 'd'});  // a unique id TLV
+  CHECK(parse(parser, v2_header(0x21, 0x21, addresses)) == Result::complete);
+  CHECK(parser.header_size() == 16 + 36 + 5);
+  CHECK(parser.source() == asio::ip::tcp::endpoint(asio::ip::make_address("::5"), 443));
+  CHECK(parser.destination() == asio::ip::tcp::endpoint(asio::ip::make_address("::1"), 8443));
+}
+
+TEST(v2_local_and_unspec_keep_socket_addresses) {
+  ProxyProtocolParser local;
+  CHECK(parse(local, v2_header(0x20, 0x00, "")) == Result::complete);
+  CHECK(local.header_size() == 16);
+  CHECK(!local.source());
+  ProxyProtocolParser unspec;
+  CHECK(parse(unspec, v2_header(0x21, 0x00, "")) == Result::complete);
+  CHECK(!unspec.source());
+}
+
+TEST(v2_malformed) {
+  // Address blocks too short for their family.
+  CHECK(parse(v2_header(0x21, 0x11, kV2Tcp4.substr(0, 11))) == Result::error);
+  CHECK(parse(v2_header(0x21, 0x21, kV2Tcp4)) == Result::error);
+  // Version 1 in the binary format, and an unknown command.
+  CHECK(parse(v2_header(0x11, 0x11, kV2Tcp4)) == Result::error);
+  CHECK(parse(v2_header(0x22, 0x11, kV2Tcp4)) == Result::error);
+  // A bad signature byte.
+  auto header = v2_header(0x21, 0x11, kV2Tcp4);
+  header[5] = 'x';
+  CHECK(parse(header) == Result::error);
+}
+
+TEST(v2_length_limit) {
+  auto at_limit = v2_header(0x21, 0x11, kV2Tcp4 + std::string(kProxyProtocolMaxHeaderSize - 16 - 12, '\0'));
+  CHECK(at_limit.size() == kProxyProtocolMaxHeaderSize);
+  CHECK(parse(at_limit) == Result::complete);
+  auto over_limit = v2_header(0x21, 0x11, kV2Tcp4 + std::string(kProxyProtocolMaxHeaderSize - 16 - 11, '\0'));
+  // Rejected from the fixed part alone, before the rest arrives.
+  CHECK(parse(over_limit.substr(0, 16)) == Result::error);
+}
+
+// The session feeds everything received so far; client data that arrived
+// with the header starts at header_size().
+TEST(split_across_reads_with_client_data) {
+  for (std::size_t chunk_size : {1, 2, 5, 13}) {
+    for (const auto &header : {std::string("PROXY TCP4 203.0.113.5 10.0.0.1 5555 80\r\n"), v2_header(0x21, 0x11, kV2Tcp4)}) {
+      ProxyProtocolParser parser;
+      auto data = header + "GET / HTTP/1.1\r\n";
+      CHECK(parse(parser, data, chunk_size) == Result::complete);
+      CHECK(parser.header_size() == header.size());
+      CHECK(data.substr(parser.header_size()) == "GET / HTTP/1.1\r\n");
+      CHECK(parser.source() == asio::ip::tcp::endpoint(asio::ip::make_address("203.0.113.5"), 5555));
+    }
+  }
+}
+
+TEST(incomplete_prefixes) {
+  CHECK(parse("") == Result::incomplete);
+  CHECK(parse("PRO") == Result::incomplete);
+  CHECK(parse("PROXY TCP4 203.0.113.5") == Result::incomplete);
+  CHECK(parse(std::string("\r\n\r\n\0\r\n", 7)) == Result::incomplete);
+  CHECK(parse(v2_header(0x21, 0x11, kV2Tcp4).substr(0, 20)) == Result::incomplete);
+}
+
+int main() {
+  return test::run_all();
+}
@@ -0,0 +1,116 @@
+/*
+ *    sniff_test.cpp:
+ *
+ *    ProtocolSniffer on whole and partial prefixes, and HttpHostScanner on
+ *    request headers split at every byte the way the session feeds it.
+ *
+ */
+
+#include "test.hpp"
+
+namespace {
+
+// Scans growing prefixes of `request` in steps of `chunk_size` and returns the
+// Host value once complete, or nullopt if the header never completes.
+std::optional<std::string> scan_host(std::string_view request, std::size_t chunk_size) {
+  HttpHostScanner scanner;
+  for (std::size_t size = std::min(chunk_size, request.size());; size = std::min(size + chunk_size, request.size())) {
+    auto data = request.substr(0, size);
+    if (scanner.scan(data) == HttpHostScanner::Result::complete) {
+      return std::string(scanner.host(data));
+    }
+    if (size == request.size()) {
+      return std::nullopt;
+    }
+  }
+}
+
+// The same result for every way of splitting the request.
+std::optional<std::string> host_of(std::string_view request) {
+  auto whole = scan_host(request, request.size());
+  for (std::size_t chunk_size = 1; chunk_size < request.size(); ++chunk_size) {
+    CHECK(scan_host(request, chunk_size) == whole);
+  }
+  return whole;
+}
+
+} // namespace
+
+TEST(sniff_known_protocols) {
+  CHECK(ProtocolSniffer::sniff(std::string_view("\x16\x03\x01\x02\x00", 5), false) == SniffedProtocol::tls);
+  CHECK(ProtocolSniffer::sniff("SSH-2.0-OpenSSH_9.6\r\n", false) == SniffedProtocol::ssh);
+  CHECK(ProtocolSniffer::sniff("PROXY TCP4 ", false) == SniffedProtocol::proxy_protocol);
+  CHECK(ProtocolSniffer::sniff(std::string_view("\r\n\r\n\0\r\nQUIT\n\x21", 13), false) == SniffedProtocol::proxy_protocol);
+  for (std::string_view method : {"GET /", "POST /", "PUT /", "HEAD /", "DELETE /", "OPTIONS *", "PATCH /", "CONNECT a:1",
+         "TRACE /", "PRI * HTTP/2.0"}) {
+    CHECK(ProtocolSniffer::sniff(method, false) == SniffedProtocol::http);
+    CHECK(ProtocolSniffer::sniff(method, true) == SniffedProtocol::http);
+  }
+}
+
+// Until the bytes rule out every protocol, the sniffer waits for more unless
+// the client has stopped sending.
+TEST(sniff_partial_prefixes) {
+  for (std::string_view prefix : {"", "G", "GE", "GET", "P", "PO", "PR", "PROXY", "CONN", "OPTIONS", "S", "SSH", "\x16", "\r\n\r\n"}) {
+    CHECK(ProtocolSniffer::sniff(prefix, false) == std::nullopt);
+    CHECK(ProtocolSniffer::sniff(prefix, true) == SniffedProtocol::unknown);
+  }
+  // A prefix of one method that rules out the rest.
+  CHECK(ProtocolSniffer::sniff("GEX", false) == SniffedProtocol::unknown);
+  CHECK(ProtocolSniffer::sniff("get /", false) == SniffedProtocol::unknown);
+  CHECK(ProtocolSniffer::sniff("GET/", false) == SniffedProtocol::unknown);
+  CHECK(ProtocolSniffer::sniff("\x16\x02", false) == SniffedProtocol::unknown);
+  CHECK(ProtocolSniffer::sniff("HELLO", true) == SniffedProtocol::unknown);
+}
+
+TEST(sniff_parse_protocol) {
+  CHECK(ProtocolSniffer::parse_protocol("tls") == SniffedProtocol::tls);
+  CHECK(ProtocolSniffer::parse_protocol("http") == SniffedProtocol::http);
+  CHECK(ProtocolSniffer::parse_protocol("ssh") == SniffedProtocol::ssh);
+  CHECK(ProtocolSniffer::parse_protocol("proxy") == SniffedProtocol::proxy_protocol);
+  CHECK(ProtocolSniffer::parse_protocol("TLS") == std::nullopt);
+  CHECK(ProtocolSniffer::parse_protocol("") == std::nullopt);
+}
+
+TEST(host_split_mid_line) {
+  std::string_view request = "GET /index.html HTTP/1.1\r\nUser-Agent: test\r\nHost: www.example.com\r\nAccept: */*\r\n\r\n";
+  CHECK(host_of(request) == "www.example.com");
+  // Bare line feeds and surrounding whitespace.
+  CHECK(host_of("GET / HTTP/1.1\nAccept: */*\nHost:\t www.example.com \t\n\n") == "www.example.com");
+}
+
+TEST(host_with_port) {
+  CHECK(host_of("GET / HTTP/1.1\r\nHost: www.example.com:8080\r\n\r\n") == "www.example.com");
+  CHECK(host_of("GET / HTTP/1.1\r\nHost: 192.0.2.1:80\r\n\r\n") == "192.0.2.1");
+}
+
+TEST(host_ipv6_literal) {
+  CHECK(host_of("GET / HTTP/1.1\r\nHost: [2001:db8::1]:8080\r\n\r\n") == "[2001:db8::1]");
+  CHECK(host_of("GET / HTTP/1.1\r\nHost: [::1]\r\n\r\n") == "[::1]");
+}
+
+// The header name is case-insensitive; the value is kept as sent and
+// HostnameTable lowercases it on lookup.
+TEST(host_mixed_case) {
+  CHECK(host_of("GET / HTTP/1.1\r\nHOST: WWW.Example.COM\r\n\r\n") == "WWW.Example.COM");
+  CHECK(host_of("GET / HTTP/1.1\r\nhOsT: www.example.com\r\n\r\n") == "www.example.com");
+}
+
+TEST(host_missing) {
+  CHECK(host_of("GET / HTTP/1.1\r\nAccept: */*\r\nX-Host: www.example.com\r\n\r\n") == "");
+  CHECK(host_of("GET / HTTP/1.0\r\n\r\n") == "");
+  // An empty Host header is skipped rather than taken.
+  CHECK(host_of("GET / HTTP/1.1\r\nHost:\r\n\r\n") == "");
+  // The request line is never a header, whatever it contains.
+  CHECK(host_of("Host: www.example.com\r\n\r\n") == "");
+}
+
+TEST(host_incomplete_header) {
+  CHECK(host_of("GET / HTTP/1.1\r\nAccept: */*\r\n") == std::nullopt);
+  CHECK(host_of("GET / HTTP/1.1\r\nHost: www.example.com") == std::nullopt);
+  CHECK(host_of("GET / HTTP/1.1") == std::nullopt);
+}
+
+int main() {
+  return test::run_all();
+}
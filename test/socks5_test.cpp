@@ -0,0 +1,125 @@
+/*
+ *    socks5_test.cpp:
+ *
+ *    Runs UpstreamConnector::socks5_handshake against a fake SOCKS5 proxy on
+ *    the loopback interface that answers with scripted replies.
+ *
+ */
+
+#include "test.hpp"
+
+namespace {
+
+struct Outcome {
+  std::string request;   // what the proxy received
+  std::string leftover;  // what the handshake returned
+  std::string error;     // what the handshake threw, if anything
+};
+
+// The fake proxy reads the whole pipelined request, writes `reply` and closes.
+Outcome handshake(const Socks5ConnectRequest &request, const std::string &reply) {
+  Outcome outcome;
+  test::run_async([&]() -> asio::awaitable<void> {
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::acceptor acceptor(executor, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::co_spawn(executor, [&]() -> asio::awaitable<void> {
+      auto peer = co_await acceptor.async_accept(asio::use_awaitable);
+      outcome.request.resize(request.buffer().size());
+      co_await asio::async_read(peer, asio::buffer(outcome.request), asio::use_awaitable);
+      co_await asio::async_write(peer, asio::buffer(reply), asio::use_awaitable);
+    }, asio::detached);
+    asio::ip::tcp::socket server(executor);
+    co_await server.async_connect(acceptor.local_endpoint(), asio::use_awaitable);
+    try {
+      outcome.leftover = co_await UpstreamConnector("test").socks5_handshake(server, request,
+        std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    } catch (const std::exception &e) {
+      outcome.error = e.what();
+    }
+  });
+  return outcome;
+}
+
+std::string bytes(std::initializer_list<int> values) {
+  std::string s;
+  for (auto value : values) {
+    s += static_cast<char>(value);
+  }
+  return s;
+}
+
+} // namespace
+
+TEST(no_auth_ipv4_bound_address) {
+  Socks5ConnectRequest request({"10.0.0.1", 443}, "", "");
+  auto outcome = handshake(request,
+    bytes({0x05, 0x00, 0x05, 0x00, 0x00, 0x01, 127, 0, 0, 1, 0x1f, 0x90}) + "early");
+  CHECK(outcome.error.empty());
+  CHECK(outcome.request == bytes({0x05, 0x01, 0x00, 0x05, 0x01, 0x00, 0x01, 10, 0, 0, 1, 0x01, 0xbb}));
+  CHECK(outcome.leftover == "early");
+}
+
+TEST(no_auth_domain_request_and_bound_address) {
+  Socks5ConnectRequest request({"example.com", 80}, "", "");
+  auto outcome = handshake(request, bytes({0x05, 0x00, 0x05, 0x00, 0x00, 0x03, 4}) + "host" + bytes({0x00, 0x50}));
+  CHECK(outcome.error.empty());
+  CHECK(outcome.request == bytes({0x05, 0x01, 0x00, 0x05, 0x01, 0x00, 0x03, 11}) + "example.com" + bytes({0x00, 0x50}));
+  CHECK(outcome.leftover.empty());
+}
+
+TEST(ipv6_bound_address) {
+  Socks5ConnectRequest request({"::1", 22}, "", "");
+  auto reply = bytes({0x05, 0x00, 0x05, 0x00, 0x00, 0x04}) + std::string(16, '\0') + bytes({0x00, 0x16});
+  auto outcome = handshake(request, reply);
+  CHECK(outcome.error.empty());
+  CHECK(outcome.request.size() == 3 + 4 + 16 + 2);
+  CHECK(outcome.leftover.empty());
+}
+
+TEST(username_password) {
+  Socks5ConnectRequest request({"10.0.0.1", 443}, "alice", "secret");
+  auto outcome = handshake(request,
+    bytes({0x05, 0x02, 0x01, 0x00, 0x05, 0x00, 0x00, 0x01, 0, 0, 0, 0, 0, 0}));
+  CHECK(outcome.error.empty());
+  CHECK(outcome.request.substr(0, 3) == bytes({0x05, 0x01, 0x02}));
+  CHECK(outcome.request.substr(3, 15) == bytes({0x01, 5}) + "alice" + bytes({6}) + "secret" + bytes({0x05}));
+}
+
+TEST(empty_password) {
+  Socks5ConnectRequest request({"10.0.0.1", 443}, "alice", "");
+  auto outcome = handshake(request,
+    bytes({0x05, 0x02, 0x01, 0x00, 0x05, 0x00, 0x00, 0x01, 0, 0, 0, 0, 0, 0}));
+  CHECK(outcome.error.empty());
+  CHECK(outcome.request.substr(3, 9) == bytes({0x01, 5}) + "alice" + bytes({0, 0x05}));
+}
+
+// The proxy answers only the method selection and closes; that must be
+// reported as a rejection, not as a read error.
+TEST(no_acceptable_method) {
+  Socks5ConnectRequest request({"10.0.0.1", 443}, "alice", "secret");
+  auto outcome = handshake(request, bytes({0x05, 0xff}));
+  CHECK(outcome.error == "SOCKS5 no acceptable authentication method");
+}
+
+TEST(authentication_rejected) {
+  Socks5ConnectRequest request({"10.0.0.1", 443}, "alice", "wrong");
+  auto outcome = handshake(request, bytes({0x05, 0x02, 0x01, 0x01}));
+  CHECK(outcome.error == "SOCKS5 authentication failed");
+}
+
+TEST(connect_refused) {
+  Socks5ConnectRequest request({"10.0.0.1", 443}, "", "");
+  auto outcome = handshake(request, bytes({0x05, 0x00, 0x05, 0x05, 0x00, 0x01, 0, 0, 0, 0, 0, 0}));
+  CHECK(outcome.error == "SOCKS5 connect failed");
+}
+
+TEST(truncated_reply) {
+  Socks5ConnectRequest request({"10.0.0.1", 443}, "", "");
+  auto outcome = handshake(request, bytes({0x05, 0x00, 0x05, 0x00, 0x00, 0x01, 0, 0}));
+  CHECK(!outcome.error.empty());
+  CHECK(outcome.error != "SOCKS5 connect failed");
+}
+
+int main() {
+  return test::run_all();
+}
@@ -0,0 +1,84 @@
+/*
+ *    test.hpp:
+ *
+ *    Minimal test helpers. Each test is its own executable that includes
+ *    src/tcp_relay.cpp for the classes under test, and exits non-zero if any
+ *    check failed.
+ *
+ */
+
+#pragma once
+
+#define TCP_RELAY_NO_MAIN
+#include "../src/tcp_relay.cpp"
+
+#include <cstdio>
+#include <functional>
+
+namespace test {
+
+struct Case {
+  const char *name;
+  std::function<void()> body;
+};
+
+inline std::vector<Case> &cases() {
+  static std::vector<Case> cases;
+  return cases;
+}
+
+inline int failures = 0;
+
+struct Register {
+  Register(const char *name, std::function<void()> body) {
+    cases().push_back({name, std::move(body)});
+  }
+};
+
+// Runs every registered case, reporting exceptions as failures.
+inline int run_all() {
+  for (auto &c : cases()) {
+    auto failures_before = failures;
+    try {
+      c.body();
+    } catch (const std::exception &e) {
+      std::fprintf(stderr, "%s: unexpected exception: %s\n", c.name, e.what());
+      ++failures;
+    }
+    std::printf("%-56s %s\n", c.name, failures == failures_before ? "ok" : "FAILED");
+  }
+  return failures == 0 ? 0 : 1;
+}
+
+// Runs the coroutine `f()` on a fresh io_context to completion, rethrowing
+// anything it threw.
+template <typename F>
+void run_async(F &&f) {
+  asio::io_context io_context;
+  std::exception_ptr error;
+  asio::co_spawn(io_context, std::forward<F>(f)(), [&](std::exception_ptr e) {
+    error = e;
+  });
+  io_context.run();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+} // namespace test
+
+#define TEST_CONCAT_(a, b) a##b
+#define TEST_CONCAT(a, b) TEST_CONCAT_(a, b)
+
+#define TEST(name)                                                             \
+  static void TEST_CONCAT(test_, name)();                                      \
+  static test::Register TEST_CONCAT(register_, name)(#name, TEST_CONCAT(test_, name)); \
+  static void TEST_CONCAT(test_, name)()
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      ++test::failures;                                                        \
+    }                                                                          \
+  } while (0)
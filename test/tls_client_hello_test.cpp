@@ -0,0 +1,186 @@
+/*
+ *    tls_client_hello_test.cpp:
+ *
+ *    TlsClientHelloParser on ClientHellos in one or several records, whole
+ *    and as they arrive, malformed ones, and SNI lookups in HostnameTable.
+ *
+ */
+
+#include "test.hpp"
+
+namespace {
+
+using Result = TlsClientHelloParser::Result;
+
+std::string uint16_bytes(std::size_t value) {
+  return {static_cast<char>(value >> 8), static_cast<char>(value)};
+}
+
+std::string vector16(const std::string &data) {
+  return uint16_bytes(data.size()) + data;
+}
+
+std::string server_name_extension(const std::string &name) {
+  return uint16_bytes(0) + vector16(vector16(std::string(1, '\0') + vector16(name)));
+}
+
+// A ClientHello handshake message with the given extensions; `padding`
+// bytes of an unknown extension make it as large as needed.
+std::string client_hello(const std::string &extensions, std::size_t padding = 0) {
+  std::string body = "\x03\x03" + std::string(32, 'r');
+  body += std::string(1, 32) + std::string(32, 's');          // session id
+  body += vector16("\x13\x01\x13\x02");                        // cipher suites
+  body += std::string("\x01\x00", 2);                          // compression
+  auto all = extensions;
+  if (padding > 0) {
+    all += uint16_bytes(0xfafa) + vector16(std::string(padding, 'p'));
+  }
+  body += vector16(all);
+  return std::string(1, '\x01') + '\0' + uint16_bytes(body.size()) + body;
+}
+
+// Wraps `handshake` in handshake records of at most `record_size` bytes.
+std::string records(const std::string &handshake, std::size_t record_size = 16384) {
+  std::string out;
+  for (std::size_t pos = 0; pos < handshake.size(); pos += record_size) {
+    auto fragment = handshake.substr(pos, record_size);
+    out += std::string("\x16\x03\x01", 3) + uint16_bytes(fragment.size()) + fragment;
+  }
+  return out;
+}
+
+// Feeds growing prefixes of `data`, like the session does, until a decision.
+Result parse(TlsClientHelloParser &parser, std::string_view data, std::size_t chunk_size) {
+  for (std::size_t size = std::min(chunk_size, data.size());; size = std::min(size + chunk_size, data.size())) {
+    auto result = parser.parse(data.substr(0, size));
+    if (result != Result::incomplete || size == data.size()) {
+      return result;
+    }
+  }
+}
+
+} // namespace
+
+TEST(single_record) {
+  auto data = records(client_hello(server_name_extension("www.example.com")));
+  for (std::size_t chunk_size : {std::size_t(1), std::size_t(7), data.size()}) {
+    TlsClientHelloParser parser;
+    CHECK(parse(parser, data, chunk_size) == Result::complete);
+    CHECK(parser.server_name() == "www.example.com");
+  }
+}
+
+// A post-quantum key share easily pushes the hello past one record.
+TEST(split_across_records) {
+  auto hello = client_hello(server_name_extension("split.example.com"), 20000);
+  for (std::size_t record_size : {std::size_t(16384), std::size_t(1000), std::size_t(3)}) {
+    auto data = records(hello, record_size);
+    for (std::size_t chunk_size : {std::size_t(1), std::size_t(1500), data.size()}) {
+      if (chunk_size == 1 && record_size != 1000) {
+        continue;
+      }
+      TlsClientHelloParser parser;
+      CHECK(parse(parser, data, chunk_size) == Result::complete);
+      CHECK(parser.server_name() == "split.example.com");
+    }
+  }
+}
+
+TEST(sni_after_other_extensions) {
+  auto extensions = uint16_bytes(0x002b) + vector16("\x02\x03\x04") + server_name_extension("late.example.com");
+  TlsClientHelloParser parser;
+  CHECK(parser.parse(records(client_hello(extensions))) == Result::complete);
+  CHECK(parser.server_name() == "late.example.com");
+}
+
+TEST(without_sni) {
+  TlsClientHelloParser parser;
+  CHECK(parser.parse(records(client_hello(uint16_bytes(0x002b) + vector16("\x02\x03\x04")))) == Result::complete);
+  CHECK(parser.server_name().empty());
+  // No extensions block at all, as in old clients.
+  auto hello = client_hello("");
+  hello.resize(hello.size() - 2);
+  hello[3] = static_cast<char>(hello[3] - 2);
+  CHECK(parser.parse(records(hello)) == Result::complete);
+  CHECK(parser.server_name().empty());
+}
+
+TEST(truncated_record) {
+  auto data = records(client_hello(server_name_extension("www.example.com")));
+  TlsClientHelloParser parser;
+  CHECK(parser.parse(data.substr(0, 3)) == Result::incomplete);
+  CHECK(parser.parse(data.substr(0, data.size() - 1)) == Result::incomplete);
+  auto split = records(client_hello(server_name_extension("www.example.com"), 2000), 1000);
+  CHECK(parser.parse(split.substr(0, 1500)) == Result::incomplete);
+}
+
+TEST(not_a_client_hello) {
+  auto hello = client_hello(server_name_extension("www.example.com"));
+  auto server_hello = hello;
+  server_hello[0] = 2;
+  CHECK(TlsClientHelloParser().parse(records(server_hello)) == Result::error);
+  // Not a handshake record, not TLS, an empty or oversized record.
+  auto data = records(hello);
+  data[0] = 23;
+  CHECK(TlsClientHelloParser().parse(data) == Result::error);
+  CHECK(TlsClientHelloParser().parse("GET / HTTP/1.1\r\n") == Result::error);
+  CHECK(TlsClientHelloParser().parse(std::string("\x16\x03\x01\x00\x00", 5)) == Result::error);
+  CHECK(TlsClientHelloParser().parse(std::string("\x16\x03\x01\x40\x01", 5)) == Result::error);
+  // A handshake record that continues with something else.
+  auto split = records(client_hello(server_name_extension("www.example.com"), 2000), 1000);
+  split[1005] = 23;
+  CHECK(TlsClientHelloParser().parse(split) == Result::error);
+}
+
+TEST(bad_vector_lengths) {
+  auto sni = server_name_extension("www.example.com");
+  auto hello = client_hello(sni);
+  auto sni_at = hello.find(sni);
+  // Each length field in turn claims one byte more than there is.
+  for (std::size_t offset : {sni_at + 2, sni_at + 4, sni_at + 7}) {
+    auto bad = hello;
+    bad[offset + 1] = static_cast<char>(bad[offset + 1] + 1);
+    CHECK(TlsClientHelloParser().parse(records(bad)) == Result::error);
+  }
+  // The session id and cipher suite vectors.
+  auto bad = hello;
+  bad[4 + 34] = static_cast<char>(200);
+  CHECK(TlsClientHelloParser().parse(records(bad)) == Result::error);
+  bad = hello;
+  bad[4 + 34 + 33 + 1] = static_cast<char>(0xff);
+  CHECK(TlsClientHelloParser().parse(records(bad)) == Result::error);
+  // A message shorter than the fixed fields.
+  std::string tiny = std::string("\x01\x00\x00\x05\x03\x03", 6) + "abc";
+  CHECK(TlsClientHelloParser().parse(records(tiny)) == Result::error);
+}
+
+TEST(hostname_table_lookups) {
+  std::vector<TargetOptions> targets = {{.address = {"127.0.0.1", 443}, .weight = 1}};
+  auto exact = std::make_shared<TargetGroup>(targets, LoadBalancePolicy::round_robin);
+  auto wildcard = std::make_shared<TargetGroup>(targets, LoadBalancePolicy::round_robin);
+  auto deeper = std::make_shared<TargetGroup>(targets, LoadBalancePolicy::round_robin);
+  HostnameTable table;
+  CHECK(table.empty());
+  table.add("WWW.Example.com", exact);
+  table.add("*.example.com", wildcard);
+  table.add("*.eu.example.com", deeper);
+  CHECK(!table.empty());
+  auto lookup = [&](const std::string &name) {
+    TlsClientHelloParser parser;
+    CHECK(parser.parse(records(client_hello(server_name_extension(name)))) == Result::complete);
+    return table.find(parser.server_name());
+  };
+  CHECK(lookup("www.example.com") == exact);
+  CHECK(lookup("WWW.EXAMPLE.COM.") == exact);
+  CHECK(lookup("api.example.com") == wildcard);
+  CHECK(lookup("a.b.example.com") == wildcard);
+  CHECK(lookup("x.eu.example.com") == deeper);
+  CHECK(lookup("example.com") == nullptr);
+  CHECK(lookup("www.example.org") == nullptr);
+  CHECK(table.find("") == nullptr);
+  CHECK(table.find(std::string(300, 'a')) == nullptr);
+}
+
+int main() {
+  return test::run_all();
+}